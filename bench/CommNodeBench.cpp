@@ -0,0 +1,545 @@
+#include "CommNode.h"
+#include "CommNodeLog.h"
+#include "LocalServer.h"
+#include "CommNodeClient.h"
+#include <benchmark/benchmark.h>
+#include <boost/uuid/random_generator.hpp>
+#include <boost/filesystem.hpp>
+#include <string.h>
+#include <thread>
+#include <netinet/tcp.h>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+//Neighbor fds start here so they can't collide with real descriptors we
+//might be handed by the benchmark library
+static const int FIRST_FAKE_FD = 100000;
+
+/**
+ * Reaches into CommNode for the parts we measure. Nothing here opens a
+ * socket: neighbors are added with a made up fd, which is the path taken
+ * when a neighbor connects to us.
+ */
+class CommNodeBench {
+	public:
+		static CommNode* createNode() {
+			NodeConfig config;
+			return new CommNode(NodeId(boost::uuids::random_generator()()), 
+				config);
+		}
+
+		/**
+		 * Fills the neighbor table with count neighbors and returns their ids
+		 */
+		static std::vector<NodeId> addNeighbors(CommNode* node, int count) {
+			std::vector<NodeId> ids;
+			boost::uuids::random_generator gen;
+
+			for (int i = 0; i < count; i++) {
+				ids.push_back(NodeId(gen()));
+				node->addNeighborAsync(ids.back(), "10.0.0.1", 8001,
+					FIRST_FAKE_FD + i);
+			}
+			return ids;
+		}
+
+		static void clearNeighbors(CommNode* node) {
+			std::lock_guard<InstrumentedMutex> lock(node->mapMutex);
+			for (auto& it : *node->neighbors)
+				node->neighborPool.release(it.second);
+			node->neighbors->clear();
+			node->localNeighbors->clear();
+		}
+
+		static void createTCPResponse(benchmark::State& state, const char* msg) {
+			CommNode* node = createNode();
+			std::vector<NodeId> ids = addNeighbors(node, state.range(0));
+
+			char buf[CommNode::DGRAM_SIZE];
+			for (auto _ : state) {
+				//The parser may write into the buffer, so start fresh each time
+				memset(buf, 0, sizeof buf);
+				strcpy(buf, msg);
+				benchmark::DoNotOptimize(node->createTCPResponse(
+					FIRST_FAKE_FD + state.range(0) - 1, buf));
+			}
+			state.SetItemsProcessed(state.iterations());
+
+			clearNeighbors(node);
+			delete node;
+		}
+
+		static void heartbeatParse(benchmark::State& state, bool self) {
+			CommNode* node = createNode();
+			std::vector<NodeId> ids = addNeighbors(node, state.range(0));
+
+			//Either our own heartbeat, or one from the last neighbor we know
+			char dgram[CommNode::DGRAM_SIZE];
+			memset(dgram, 0, sizeof dgram);
+			sprintf(dgram, "add %s %d", self ?
+				node->uuidStr.c_str() : ids.back().toString().c_str(),
+				8001);
+
+			sockaddr_in origin;
+			memset(&origin, 0, sizeof origin);
+			origin.sin_family = AF_INET;
+			origin.sin_addr.s_addr = inet_addr("10.0.0.1");
+
+			for (auto _ : state)
+				node->handleHeartbeat(dgram, origin);
+			state.SetItemsProcessed(state.iterations());
+
+			clearNeighbors(node);
+			delete node;
+		}
+
+		static uint64_t duplicateKey(const char* dgram, size_t len) {
+			return CommNode::duplicateKey(dgram, len);
+		}
+
+		static void neighborInsert(benchmark::State& state) {
+			CommNode* node = createNode();
+			for (auto _ : state) {
+				addNeighbors(node, state.range(0));
+
+				state.PauseTiming();
+				clearNeighbors(node);
+				state.ResumeTiming();
+			}
+			state.SetItemsProcessed(state.iterations() * state.range(0));
+			delete node;
+		}
+
+		static void neighborLookup(benchmark::State& state) {
+			CommNode* node = createNode();
+			std::vector<NodeId> ids = addNeighbors(node, state.range(0));
+
+			size_t i = 0;
+			for (auto _ : state) {
+				std::lock_guard<InstrumentedMutex> lock(node->mapMutex);
+				benchmark::DoNotOptimize(node->neighbors->find(ids[i]));
+				i = (i + 1) % ids.size();
+			}
+			state.SetItemsProcessed(state.iterations());
+
+			clearNeighbors(node);
+			delete node;
+		}
+
+		/**
+		 * Every thread queues a frame for its own fd and takes it off again,
+		 * the way handler threads queue replies while the timer thread queues
+		 * pings. The queues are held, so nothing is written.
+		 */
+		static void xferQueue(benchmark::State& state, CommNode* node) {
+			int fd = FIRST_FAKE_FD + state.thread_index();
+			std::string msg = "pong 1234567890";
+			{
+				std::lock_guard<InstrumentedMutex> lock(node->xferMutex);
+				node->sendQueues[fd].held = true;
+			}
+
+			SendQueue::Frame f;
+			for (auto _ : state) {
+				node->queueFrame(fd, msg);
+				std::lock_guard<InstrumentedMutex> lock(node->xferMutex);
+				benchmark::DoNotOptimize(node->sendQueues[fd].pop(f));
+			}
+			state.SetItemsProcessed(state.iterations());
+		}
+};
+
+static void BM_CreateTCPResponsePing(benchmark::State& state) {
+	CommNodeBench::createTCPResponse(state, "ping 1234567890");
+}
+BENCHMARK(BM_CreateTCPResponsePing)->Arg(1);
+
+static void BM_CreateTCPResponseGetUuid(benchmark::State& state) {
+	CommNodeBench::createTCPResponse(state, "get uuid");
+}
+BENCHMARK(BM_CreateTCPResponseGetUuid)->Arg(1);
+
+//A pong looks up the neighbor by fd; the argument is the table size
+static void BM_CreateTCPResponsePong(benchmark::State& state) {
+	CommNodeBench::createTCPResponse(state, 
+		"pong 1700000000000000000 1700000000000050000 1700000000000060000");
+}
+BENCHMARK(BM_CreateTCPResponsePong)->RangeMultiplier(8)->Range(1, 512);
+
+static void BM_HeartbeatParseKnown(benchmark::State& state) {
+	CommNodeBench::heartbeatParse(state, false);
+}
+BENCHMARK(BM_HeartbeatParseKnown)->RangeMultiplier(8)->Range(1, 512);
+
+static void BM_HeartbeatParseSelf(benchmark::State& state) {
+	CommNodeBench::heartbeatParse(state, true);
+}
+BENCHMARK(BM_HeartbeatParseSelf)->Arg(1);
+
+static void BM_NeighborInsert(benchmark::State& state) {
+	CommNodeBench::neighborInsert(state);
+}
+BENCHMARK(BM_NeighborInsert)->RangeMultiplier(8)->Range(8, 512);
+
+static void BM_NeighborLookup(benchmark::State& state) {
+	CommNodeBench::neighborLookup(state);
+}
+BENCHMARK(BM_NeighborLookup)->RangeMultiplier(8)->Range(8, 512);
+
+/**
+ * Neighbors joining and leaving while a relay reads the table: each 
+ * iteration replaces range(0) records and looks one up under a Guard
+ */
+static void BM_NeighborPoolChurn(benchmark::State& state) {
+	NeighborPool pool;
+	std::vector<NeighborHandle> live;
+	for (int i = 0; i < state.range(0); i++)
+		live.push_back(pool.allocate());
+
+	size_t i = 0;
+	for (auto _ : state) {
+		pool.release(live[i]);
+		live[i] = pool.allocate();
+		i = (i + 1) % live.size();
+
+		NeighborPool::Guard guard(pool);
+		benchmark::DoNotOptimize(pool.get(live[i]));
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.counters["slabs"] = pool.getSlabs();
+}
+BENCHMARK(BM_NeighborPoolChurn)->RangeMultiplier(8)->Range(8, 4096);
+
+static void BM_NodeIdParse(benchmark::State& state) {
+	std::string text = NodeId(boost::uuids::random_generator()()).toString();
+	NodeId id;
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(NodeId::parse(text, id));
+		benchmark::DoNotOptimize(id);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NodeIdParse);
+
+static void BM_NodeIdFormat(benchmark::State& state) {
+	NodeId id = NodeId(boost::uuids::random_generator()());
+	char text[NodeId::STRING_SIZE];
+	for (auto _ : state) {
+		id.format(text);
+		benchmark::DoNotOptimize(text);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_NodeIdFormat);
+
+static void BM_LogWrite(benchmark::State& state) {
+	std::string msg = "Added neighbor 0f2c4a9e-5b1d-4c3e-8f6a-7d9e0b1c2a3f at "
+		"address 10.0.0.1:8001";
+	for (auto _ : state)
+		cnLog->debug(msg);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LogWrite)->ThreadRange(1, 8)->UseRealTime();
+
+static CommNode* queueNode = NULL;
+
+static void BM_XferQueue(benchmark::State& state) {
+	CommNodeBench::xferQueue(state, queueNode);
+}
+BENCHMARK(BM_XferQueue)->ThreadRange(1, 8)->UseRealTime();
+
+/**
+ * Posts a batch of small tasks across many strands, the way the I/O thread
+ * posts frames for many connections, and waits for the pool to run them
+ */
+static void BM_StrandDispatch(benchmark::State& state) {
+	const int STRANDS = 64;
+	const int TASKS = 4096;
+
+	WorkerPool pool(state.range(0), std::vector<int>());
+	std::vector<std::shared_ptr<WorkerPool::Strand>> strands;
+	for (int i = 0; i < STRANDS; i++)
+		strands.push_back(pool.createStrand());
+	pool.start();
+
+	std::atomic<int> done(0);
+	for (auto _ : state) {
+		for (int i = 0; i < TASKS; i++)
+			strands[i % STRANDS]->post([&done]() { done++; });
+		pool.waitIdle();
+	}
+	state.SetItemsProcessed(state.iterations() * TASKS);
+	pool.stop();
+}
+BENCHMARK(BM_StrandDispatch)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+/**
+ * A rebalance of a settled node: the links it wants are already open and
+ * every neighbor has been measured
+ */
+static void BM_TopologyRebalance(benchmark::State& state) {
+	Topology topology(8, 2);
+	std::vector<Topology::Peer> peers(state.range(0));
+	boost::uuids::random_generator gen;
+
+	for (size_t i = 0; i < peers.size(); i++) {
+		peers[i].id = NodeId(gen());
+		peers[i].connected = false;
+		peers[i].outbound = false;
+		peers[i].pinned = false;
+		peers[i].roundTrip = 100000 + (int64_t)i * 1000;
+	}
+
+	for (auto _ : state) {
+		Topology::Plan plan = topology.rebalance(peers);
+		state.PauseTiming();
+		for (auto& p : peers) {
+			for (auto& id : plan.connect) {
+				if (p.id == id)
+					p.connected = p.outbound = true;
+			}
+			for (auto& id : plan.drop) {
+				if (p.id == id)
+					p.connected = p.outbound = false;
+			}
+		}
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TopologyRebalance)->RangeMultiplier(8)->Range(8, 4096);
+
+/**
+ * The checks the broadcast listener makes before relaying a datagram, under
+ * a flood from range(0) spoofed addresses that never repeats a heartbeat
+ */
+static void BM_RelayGuard(benchmark::State& state) {
+	DuplicateFilter duplicates(5000000000LL);
+	RateLimiter limit(50, 100);
+	std::string id = NodeId(boost::uuids::random_generator()()).toString();
+
+	//More heartbeats than the filter holds, so the tables keep rotating. Half
+	//carry a jittered gap after the sequence number, the rest are from older
+	//nodes that don't send one.
+	const int DGRAMS = DuplicateFilter::CAPACITY * 4;
+	std::vector<std::string> dgrams;
+	for (int i = 0; i < DGRAMS; i++) {
+		dgrams.push_back("add " + id + " 8001 8002 " + std::to_string(i));
+		if (i % 2 == 0)
+			dgrams.back() += " " + std::to_string(450 + i % 100);
+		dgrams.back().resize(CommNode::DGRAM_SIZE);
+	}
+
+	uint64_t i = 0;
+	int64_t now = 0;
+	for (auto _ : state) {
+		const std::string& dgram = dgrams[i % DGRAMS];
+		now += 1000;
+		if (limit.allow(i++ % state.range(0), now))
+			benchmark::DoNotOptimize(duplicates.check(
+				CommNodeBench::duplicateKey(dgram.data(), dgram.size()), now));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RelayGuard)->RangeMultiplier(8)->Range(1, 4096);
+
+/**
+ * A gossip round of the latency matrix in a cluster of range(0) nodes with
+ * 8 links each, in which one link changed: the update reaches us, we pass
+ * it on to a neighbor and the neighbor applies it
+ */
+static void BM_MatrixGossip(benchmark::State& state) {
+	const int NODES = state.range(0);
+	std::vector<NodeId> ids;
+	for (int i = 0; i < NODES; i++)
+		ids.push_back(NodeId(boost::uuids::random_generator()()));
+
+	std::vector<LatencyMatrix> origins;
+	std::vector<std::vector<LatencyMatrix::Sample>> links(NODES);
+	for (int i = 0; i < NODES; i++) {
+		origins.emplace_back(ids[i]);
+		for (int j = 1; j <= 8; j++) {
+			links[i].push_back({ LatencyMatrix::key(ids[(i + j) % NODES]),
+				1000000LL * j, 1000.0f * j });
+		}
+	}
+
+	LatencyMatrix us{NodeId(boost::uuids::random_generator()())};
+	LatencyMatrix neighbor{NodeId(boost::uuids::random_generator()())};
+	int64_t now = 0;
+	for (int i = 0; i < NODES; i++) {
+		origins[i].setLocal(links[i], now);
+		for (auto& frame : origins[i].deltasFor(0))
+			us.apply(frame.data());
+	}
+	for (auto& frame : us.deltasFor(0))
+		neighbor.apply(frame.data());
+
+	uint64_t i = 0;
+	size_t bytes = 0;
+	for (auto _ : state) {
+		int n = i++ % NODES;
+		links[n][0].roundTrip = links[n][0].roundTrip == 1000000 ?
+			4000000 : 1000000;
+		origins[n].setLocal(links[n], ++now);
+		for (auto& frame : origins[n].deltasFor(0))
+			us.apply(frame.data());
+		for (auto& frame : us.deltasFor(0)) {
+			neighbor.apply(frame.data());
+			bytes += frame.size();
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_MatrixGossip)->RangeMultiplier(8)->Range(8, 4096);
+
+/**
+ * Recording a ping with capture off (0) and on (1). The capture is started
+ * over before the file fills, so no records are dropped.
+ */
+static void BM_CaptureRecord(benchmark::State& state) {
+	const uint64_t PER_FILE = 1 << 20;
+	std::string path = (boost::filesystem::temp_directory_path() /
+		boost::filesystem::unique_path("commnode-bench-%%%%%%%%.cncap")).string();
+	unsigned char node[16] = {};
+	char frame[CommNode::DGRAM_SIZE] = {};
+	strcpy(frame, "ping 1792316435862027848");
+
+	uint64_t i = 0;
+	for (auto _ : state) {
+		if (state.range(0) && i++ % PER_FILE == 0) {
+			state.PauseTiming();
+			TrafficCapture::stop();
+			TrafficCapture::start(path, PER_FILE * 64, node, sizeof frame);
+			state.ResumeTiming();
+		}
+		TrafficCapture::record(TrafficCapture::TcpIn, 1, i, frame, sizeof frame);
+	}
+	TrafficCapture::stop();
+	boost::system::error_code ec;
+	boost::filesystem::remove(path, ec);
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CaptureRecord)->Arg(0)->Arg(1);
+
+/**
+ * A local client publishing through the daemon's shared memory ring, timed
+ * until the node has taken every message off it. The node has no
+ * neighbors, so this is the cost of getting a message to the node.
+ */
+static void BM_ClientIpc(benchmark::State& state) {
+	CommNode* node = CommNodeBench::createNode();
+	std::string path = (boost::filesystem::temp_directory_path() /
+		boost::filesystem::unique_path("commnode-bench-%%%%%%%%.sock")).string();
+	LocalServer server(*node, path);
+	CommNodeClient client;
+	if (!server.start() || !client.connect(path)) {
+		state.SkipWithError("Unable to attach a client");
+		delete node;
+		return;
+	}
+
+	std::string payload(CommNode::MAX_MESSAGE - 5, 'x');
+	uint64_t sent = 0;
+	for (auto _ : state) {
+		while (!client.publish("bench", payload))
+			std::this_thread::yield();
+		sent++;
+	}
+	while (server.getReceived() < sent)
+		std::this_thread::yield();
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * CommNode::DGRAM_SIZE);
+
+	client.close();
+	server.stop();
+	delete node;
+}
+BENCHMARK(BM_ClientIpc)->UseRealTime();
+
+/**
+ * The same messages as BM_ClientIpc, written as frames to a loopback TCP
+ * connection and read on another thread
+ */
+static void BM_LoopbackTcp(benchmark::State& state) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof addr;
+	if (bind(listener, (sockaddr*)&addr, sizeof addr) < 0 ||
+			listen(listener, 1) < 0 ||
+			getsockname(listener, (sockaddr*)&addr, &len) < 0) {
+		state.SkipWithError("Unable to listen on loopback");
+		close(listener);
+		return;
+	}
+
+	int writer = socket(AF_INET, SOCK_STREAM, 0);
+	int noDelay = 1;
+	setsockopt(writer, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+	connect(writer, (sockaddr*)&addr, sizeof addr);
+	int reader = accept(listener, NULL, NULL);
+	close(listener);
+
+	std::atomic<uint64_t> received(0);
+	std::thread readThread([reader, &received]() {
+		char frame[CommNode::DGRAM_SIZE];
+		int have = 0;
+		ssize_t n;
+		while ((n = recv(reader, frame + have, sizeof frame - have, 0)) > 0) {
+			have += n;
+			if (have == CommNode::DGRAM_SIZE) {
+				have = 0;
+				received++;
+			}
+		}
+	});
+
+	char frame[CommNode::DGRAM_SIZE];
+	memset(frame, 0, sizeof frame);
+	memset(frame, 'x', CommNode::MAX_MESSAGE);
+	uint64_t sent = 0;
+	for (auto _ : state) {
+		if (send(writer, frame, sizeof frame, MSG_NOSIGNAL) != sizeof frame) {
+			state.SkipWithError("Loopback write failed");
+			break;
+		}
+		sent++;
+	}
+	while (received < sent)
+		std::this_thread::yield();
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * CommNode::DGRAM_SIZE);
+
+	close(writer);
+	readThread.join();
+	close(reader);
+}
+BENCHMARK(BM_LoopbackTcp)->UseRealTime();
+
+/**
+ * Same as BENCHMARK_MAIN(), but the log goes to a scratch file that is
+ * removed when we're done
+ */
+int main(int argc, char** argv) {
+	boost::filesystem::path logDir = boost::filesystem::temp_directory_path() /
+		boost::filesystem::unique_path("commnode-bench-%%%%%%%%");
+	cnLog->init((logDir / "bench.log").string());
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+
+	queueNode = CommNodeBench::createNode();
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	delete queueNode;
+
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(logDir, ec);
+	return 0;
+}
@@ -0,0 +1,644 @@
+#include "BulkTransfer.h"
+#include "Checksum.h"
+#include "Metrics.h"
+#include "CommNodeLog.h"
+#include <random>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <boost/filesystem.hpp>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+static const uint32_t BULK_MAGIC = 0x4b4c4243;		//"CBLK"
+static const uint32_t BULK_VERSION = 1;
+static const uint32_t PROGRESS_MAGIC = 0x47525043;	//"CPRG"
+static const uint32_t MAX_NAME_LEN = 255;
+//How long a sender waits for the receiver to accept the connection
+static const int CONNECT_TIMEOUT_SECS = 5;
+//Bytes received between syncing the part file and recording our progress
+static const uint64_t PROGRESS_SYNC_BYTES = 64 * 1024 * 1024;
+
+enum BulkStatus : uint32_t {
+	STATUS_OK = 0,
+	STATUS_REFUSED = 1,					//Bad request or the file is already being written
+	STATUS_FAILED = 2						//The transfer ended before the whole file arrived
+};
+
+/**
+ * The first thing a sender writes, followed by nameLen bytes of file name
+ */
+struct BulkHello {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t id;
+	uint64_t size;
+	uint32_t chunkSize;
+	uint32_t nameLen;
+};
+
+/**
+ * Sent by the receiver after the hello, with the offset to resume from, and
+ * after the last chunk
+ */
+struct BulkReply {
+	uint32_t magic;
+	uint32_t status;
+	uint64_t offset;
+};
+
+/**
+ * Precedes the data of every chunk. A chunk with len 0 ends the transfer.
+ */
+struct ChunkHeader {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t checksum;						//xxh64 of the chunk data
+};
+
+/**
+ * Contents of the "<name>.part.progress" file next to a partial file
+ */
+struct ProgressRecord {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t id;
+	uint64_t size;
+	uint64_t verified;						//Bytes from the start known to be good
+	uint64_t checksum;						//fnv1a64 of the fields above
+};
+
+struct BulkTransfer::SendArgs {
+	BulkTransfer* bulk;
+	uint64_t id;
+	std::string ip;
+	int port;
+	std::string path;
+	std::string name;
+	DoneCallback done;
+};
+
+struct BulkTransfer::ReceiveArgs {
+	BulkTransfer* bulk;
+	int fd;
+};
+
+/**
+ * Blocking helpers for sockets with a send/receive timeout. A timeout just
+ * gives us a chance to give up if the node is stopping.
+ */
+static bool readFull(int fd, void* buf, size_t len,
+		const std::atomic<bool>& running) {
+	char* p = static_cast<char*>(buf);
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, MSG_WAITALL);
+		if (n == 0)
+			return false;
+		if (n < 0) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+					running)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool writeFull(int fd, const void* buf, size_t len, int flags,
+		const std::atomic<bool>& running) {
+	const char* p = static_cast<const char*>(buf);
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, flags | MSG_NOSIGNAL);
+		if (n < 0) {
+			if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+					running)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void setTimeouts(int fd, int ms) {
+	timeval tv;
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+static uint64_t progressChecksum(const ProgressRecord& r) {
+	return fnv1a64(&r, offsetof(ProgressRecord, checksum));
+}
+
+/**
+ * Constructor
+ */
+BulkTransfer::BulkTransfer(const std::string& dir) : receiveDir(dir),
+		listenerFD(-1), port(0), running(false), accepting(false),
+		activeTransfers(0) {
+}
+
+BulkTransfer::~BulkTransfer() {
+	stop();
+	if (listenerFD >= 0)
+		close(listenerFD);
+}
+
+void BulkTransfer::listen(int p) {
+	listenerFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listenerFD < 0)
+		cnLog->exitWithError("Unable to create bulk transfer socket");
+
+	int enable = 1;
+	setsockopt(listenerFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(p);
+
+	int ret = bind(listenerFD, (sockaddr*)&addr, sizeof addr);
+	if (ret < 0 && errno == EADDRINUSE && p != 0) {
+		cnLog->warning("Bulk port " + std::to_string(p) +
+			" is in use, binding to a random port");
+		addr.sin_port = 0;
+		ret = bind(listenerFD, (sockaddr*)&addr, sizeof addr);
+	}
+	if (ret < 0)
+		cnLog->exitWithError("Unable to bind bulk transfer socket");
+
+	if (::listen(listenerFD, 16) < 0)
+		cnLog->exitWithError("Unable to listen on bulk transfer socket");
+
+	adopt(listenerFD);
+}
+
+void BulkTransfer::adopt(int fd) {
+	listenerFD = fd;
+
+	sockaddr_in addr;
+	socklen_t len = sizeof addr;
+	if (getsockname(listenerFD, (sockaddr*)&addr, &len) < 0)
+		cnLog->exitWithError("Error getting bulk socket details");
+	port = ntohs(addr.sin_port);
+}
+
+void BulkTransfer::start() {
+	running = true;
+	if (accepting)
+		return;
+
+	accepting = true;
+	int ret = pthread_create(&acceptThread, NULL, &BulkTransfer::handleAccept,
+		this);
+	if (ret)
+		cnLog->exitWithError("Error creating bulk transfer thread");
+
+	cnLog->debug("Accepting bulk transfers on port " + std::to_string(port));
+}
+
+void BulkTransfer::stopAccepting() {
+	if (!accepting)
+		return;
+
+	accepting = false;
+	pthread_join(acceptThread, NULL);
+}
+
+void BulkTransfer::stop() {
+	stopAccepting();
+	running = false;
+
+	//Transfer threads notice the flag within POLL_MS
+	while (activeTransfers > 0)
+		usleep(1000);
+}
+
+void BulkTransfer::startThread(void* (*fn)(void*), void* args) {
+	activeTransfers++;
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, fn, args);
+	if (ret) {
+		activeTransfers--;
+		cnLog->exitWithError("Error creating bulk transfer thread");
+	}
+	pthread_detach(thread);
+}
+
+void* BulkTransfer::handleAccept() {
+	while (accepting) {
+		//Poll with a timeout so stopAccepting() doesn't hang on accept
+		pollfd pfd;
+		pfd.fd = listenerFD;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, POLL_MS) <= 0)
+			continue;
+
+		int fd = accept4(listenerFD, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		ReceiveArgs* args = new ReceiveArgs;
+		args->bulk = this;
+		args->fd = fd;
+		startThread(&BulkTransfer::handleReceive, args);
+	}
+	return NULL;
+}
+
+void* BulkTransfer::handleReceive(void* p) {
+	ReceiveArgs* params = static_cast<ReceiveArgs*>(p);
+	ReceiveArgs args = *params;
+	delete params;
+
+	args.bulk->receive(args.fd);
+	close(args.fd);
+	args.bulk->activeTransfers--;
+	return NULL;
+}
+
+/**
+ * Receives one transfer, or the rest of one that was interrupted
+ */
+void BulkTransfer::receive(int fd) {
+	setTimeouts(fd, POLL_MS);
+
+	BulkHello hello;
+	char name[MAX_NAME_LEN + 1];
+	if (!readFull(fd, &hello, sizeof hello, running) ||
+			hello.magic != BULK_MAGIC || hello.version != BULK_VERSION ||
+			hello.nameLen == 0 || hello.nameLen > MAX_NAME_LEN ||
+			hello.chunkSize == 0 ||
+			!readFull(fd, name, hello.nameLen, running)) {
+		cnLog->debug("Dropping malformed bulk transfer request");
+		return;
+	}
+	name[hello.nameLen] = '\0';
+
+	BulkReply reply;
+	reply.magic = BULK_MAGIC;
+	reply.status = STATUS_REFUSED;
+	reply.offset = 0;
+
+	//Senders only pick the file name, never the directory
+	std::string fileName = boost::filesystem::path(name).filename().string();
+	if (fileName.empty() || fileName == "." || fileName == ".." ||
+			fileName.find('/') != std::string::npos) {
+		cnLog->debug("Refusing bulk transfer with bad name: " + fileName);
+		writeFull(fd, &reply, sizeof reply, 0, running);
+		return;
+	}
+
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(receiveDir, ec);
+	const std::string finalPath = receiveDir + "/" + fileName;
+	const std::string partPath = finalPath + ".part";
+	const std::string progressPath = partPath + ".progress";
+
+	int fileFD = open(partPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	int progressFD = open(progressPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+		0644);
+
+	//Only one connection may write a file; a sender that reconnects before
+	//the old connection is torn down is told to try again
+	if (fileFD < 0 || progressFD < 0 || flock(fileFD, LOCK_EX | LOCK_NB) < 0) {
+		cnLog->debug("Bulk transfer of " + fileName + " is busy or unwritable");
+		writeFull(fd, &reply, sizeof reply, 0, running);
+		if (fileFD >= 0)
+			close(fileFD);
+		if (progressFD >= 0)
+			close(progressFD);
+		return;
+	}
+
+	ProgressRecord progress;
+	if (pread(progressFD, &progress, sizeof progress, 0) != sizeof progress ||
+			progress.magic != PROGRESS_MAGIC ||
+			progress.checksum != progressChecksum(progress) ||
+			progress.id != hello.id || progress.size != hello.size ||
+			progress.verified > hello.size) {
+		memset(&progress, 0, sizeof progress);
+		progress.magic = PROGRESS_MAGIC;
+		progress.id = hello.id;
+		progress.size = hello.size;
+	}
+
+	//Set the length first, since fallocate never shrinks a part file left by
+	//a larger transfer of the same name. Then reserve the blocks up front:
+	//running out of space while writing through the mapping would raise
+	//SIGBUS instead of returning an error. An empty file has none to reserve.
+	int ret = ftruncate(fileFD, hello.size);
+	if (ret == 0 && hello.size > 0) {
+		ret = fallocate(fileFD, 0, 0, hello.size);
+		if (ret < 0 && errno == EOPNOTSUPP)
+			ret = 0;
+	}
+
+	char* map = NULL;
+	if (ret == 0 && hello.size > 0) {
+		map = (char*)mmap(NULL, hello.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fileFD, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		else
+			madvise(map, hello.size, MADV_SEQUENTIAL);
+	}
+
+	if (ret < 0 || (hello.size > 0 && map == NULL)) {
+		cnLog->error("Unable to allocate " + std::to_string(hello.size) +
+			" bytes for " + fileName);
+		writeFull(fd, &reply, sizeof reply, 0, running);
+		close(fileFD);
+		close(progressFD);
+		return;
+	}
+
+	reply.status = STATUS_OK;
+	reply.offset = progress.verified;
+	bool ok = writeFull(fd, &reply, sizeof reply, 0, running);
+	if (progress.verified > 0) {
+		cnLog->debug("Resuming bulk transfer of " + fileName + " at byte " +
+			std::to_string(progress.verified));
+	}
+
+	//The progress file may only cover data that is on disk. Otherwise a
+	//resume after a power loss would skip chunks that never got there.
+	uint64_t synced = progress.verified;
+	auto saveProgress = [&]() {
+		if (progress.verified == synced)
+			return true;
+		uint64_t start = synced - synced % getpagesize();
+		if (msync(map + start, progress.verified - start, MS_SYNC) < 0)
+			return false;
+		progress.checksum = progressChecksum(progress);
+		if (pwrite(progressFD, &progress, sizeof progress, 0) !=
+				sizeof progress)
+			return false;
+		synced = progress.verified;
+		return true;
+	};
+
+	bool complete = false;
+	while (ok && running) {
+		ChunkHeader chunk;
+		if (!readFull(fd, &chunk, sizeof chunk, running))
+			break;
+
+		if (chunk.len == 0) {
+			complete = progress.verified == hello.size;
+			break;
+		}
+
+		if (chunk.offset != progress.verified || chunk.len > hello.chunkSize ||
+				chunk.len > hello.size - chunk.offset) {
+			cnLog->debug("Out of order chunk in bulk transfer of " + fileName);
+			break;
+		}
+
+#ifdef MADV_POPULATE_WRITE
+		//Fault the chunk's pages in with one call instead of one fault per page
+		if (chunk.offset % getpagesize() == 0)
+			madvise(map + chunk.offset, chunk.len, MADV_POPULATE_WRITE);
+#endif
+		if (!readFull(fd, map + chunk.offset, chunk.len, running))
+			break;
+		Metrics::increment(Counter::BulkBytesReceived, chunk.len);
+
+		//Closing the connection makes the sender reconnect and resend from
+		//the last good chunk
+		if (xxh64(map + chunk.offset, chunk.len) != chunk.checksum) {
+			Metrics::increment(Counter::BulkChunksRejected);
+			cnLog->error("Checksum mismatch at byte " +
+				std::to_string(chunk.offset) + " of " + fileName);
+			break;
+		}
+
+		progress.verified += chunk.len;
+		if (progress.verified - synced >= PROGRESS_SYNC_BYTES && !saveProgress())
+			break;
+	}
+
+	//A transfer that was cut resumes from here
+	if (!complete && !saveProgress())
+		progress.verified = synced;
+	if (map != NULL)
+		munmap(map, hello.size);
+
+	reply.status = STATUS_FAILED;
+	reply.offset = progress.verified;
+	if (complete && fsync(fileFD) == 0 &&
+			rename(partPath.c_str(), finalPath.c_str()) == 0) {
+		unlink(progressPath.c_str());
+		reply.status = STATUS_OK;
+		Metrics::increment(Counter::BulkTransfersCompleted);
+		cnLog->debug("Received " + fileName + " (" +
+			std::to_string(hello.size) + " bytes)");
+	}
+	writeFull(fd, &reply, sizeof reply, 0, running);
+
+	close(progressFD);
+	close(fileFD);
+}
+
+uint64_t BulkTransfer::sendFile(const std::string& ip, int p,
+		const std::string& path, const std::string& name, DoneCallback done) {
+	static std::random_device rd;
+	uint64_t id = ((uint64_t)rd() << 32) | rd();
+
+	SendArgs* args = new SendArgs;
+	args->bulk = this;
+	args->id = id;
+	args->ip = ip;
+	args->port = p;
+	args->path = path;
+	args->name = name.empty() ?
+		boost::filesystem::path(path).filename().string() : name;
+	args->done = done;
+
+	startThread(&BulkTransfer::handleSend, args);
+	return id;
+}
+
+/**
+ * Sends one file, reconnecting after failures
+ */
+void* BulkTransfer::handleSend(void* p) {
+	SendArgs* args = static_cast<SendArgs*>(p);
+	BulkTransfer* bulk = args->bulk;
+	bool ok = false;
+
+	int fileFD = open(args->path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fileFD < 0 || fstat(fileFD, &st) < 0) {
+		cnLog->error("Unable to open " + args->path + " for sending");
+	} else {
+		posix_fadvise(fileFD, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		for (int attempt = 1; attempt <= MAX_ATTEMPTS && bulk->running;
+				attempt++) {
+			ok = bulk->sendAttempt(args->id, args->ip, args->port, fileFD,
+				st.st_size, args->name);
+			if (ok)
+				break;
+
+			cnLog->debug("Bulk transfer of " + args->name + " interrupted, " +
+				"attempt " + std::to_string(attempt) + " of " +
+				std::to_string(MAX_ATTEMPTS));
+
+			//Back off a little longer each time
+			for (int waited = 0; waited < attempt * 1000 && bulk->running;
+					waited += 100)
+				usleep(100000);
+		}
+	}
+
+	if (fileFD >= 0)
+		close(fileFD);
+
+	if (ok) {
+		Metrics::increment(Counter::BulkTransfersCompleted);
+		cnLog->debug("Sent " + args->path + " to " + args->ip);
+	} else {
+		Metrics::increment(Counter::BulkTransfersFailed);
+		cnLog->error("Giving up on sending " + args->path + " to " + args->ip);
+	}
+
+	if (args->done)
+		args->done(args->id, ok);
+
+	delete args;
+	bulk->activeTransfers--;
+	return NULL;
+}
+
+/**
+ * Makes one connection and sends everything the receiver doesn't have yet.
+ * Returns true once the receiver confirms it has the whole file.
+ */
+bool BulkTransfer::sendAttempt(uint64_t id, const std::string& ip, int p,
+		int fileFD, uint64_t size, const std::string& name) {
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sock < 0)
+		return false;
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(p);
+	if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1) {
+		close(sock);
+		return false;
+	}
+
+	//SO_SNDTIMEO also bounds connect()
+	setTimeouts(sock, CONNECT_TIMEOUT_SECS * 1000);
+	if (connect(sock, (sockaddr*)&addr, sizeof addr) < 0) {
+		close(sock);
+		return false;
+	}
+	setTimeouts(sock, POLL_MS);
+
+	BulkHello hello;
+	memset(&hello, 0, sizeof hello);
+	hello.magic = BULK_MAGIC;
+	hello.version = BULK_VERSION;
+	hello.id = id;
+	hello.size = size;
+	hello.chunkSize = CHUNK_SIZE;
+	hello.nameLen = name.size() > MAX_NAME_LEN ? MAX_NAME_LEN : name.size();
+
+	BulkReply reply;
+	if (!writeFull(sock, &hello, sizeof hello, MSG_MORE, running) ||
+			!writeFull(sock, name.data(), hello.nameLen, 0, running) ||
+			!readFull(sock, &reply, sizeof reply, running) ||
+			reply.magic != BULK_MAGIC || reply.status != STATUS_OK ||
+			reply.offset > size) {
+		close(sock);
+		return false;
+	}
+
+	//The mapping is only read to checksum each chunk just before sendfile()
+	//sends the same, now cached, pages
+	char* map = NULL;
+	if (size > 0) {
+		map = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fileFD, 0);
+		if (map == MAP_FAILED) {
+			close(sock);
+			return false;
+		}
+		madvise(map, size, MADV_SEQUENTIAL);
+	}
+
+	bool ok = true;
+	uint64_t offset = reply.offset;
+	while (ok && offset < size) {
+		if (!running) {
+			ok = false;
+			break;
+		}
+
+		ChunkHeader chunk;
+		memset(&chunk, 0, sizeof chunk);
+		chunk.offset = offset;
+		chunk.len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+		chunk.checksum = xxh64(map + offset, chunk.len);
+
+		if (!writeFull(sock, &chunk, sizeof chunk, MSG_MORE, running)) {
+			ok = false;
+			break;
+		}
+
+		off_t pos = offset;
+		size_t left = chunk.len;
+		while (left > 0) {
+			ssize_t n = sendfile(sock, fileFD, &pos, left);
+			if (n < 0) {
+				if ((errno == EAGAIN || errno == EINTR) && running)
+					continue;
+				ok = false;
+				break;
+			}
+			if (n == 0) {
+				//The file shrank underneath us
+				ok = false;
+				break;
+			}
+			left -= n;
+			Metrics::increment(Counter::BulkBytesSent, n);
+		}
+		offset += chunk.len;
+	}
+
+	if (map != NULL)
+		munmap(map, size);
+
+	if (ok) {
+		ChunkHeader end;
+		memset(&end, 0, sizeof end);
+		end.offset = size;
+		ok = writeFull(sock, &end, sizeof end, 0, running) &&
+			readFull(sock, &reply, sizeof reply, running) &&
+			reply.magic == BULK_MAGIC && reply.status == STATUS_OK;
+	}
+
+	close(sock);
+	return ok;
+}
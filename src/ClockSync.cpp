@@ -0,0 +1,119 @@
+#include "ClockSync.h"
+#include <time.h>
+#include <string.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+int64_t ClockSync::now() {
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Software receive stamps are taken when the packet reaches the network
+ * stack, in CLOCK_REALTIME. Hardware stamps would be better still, but they
+ * come from the NIC's own clock, which is only comparable with ours when
+ * something like phc2sys keeps the two in step, so they aren't requested.
+ */
+bool ClockSync::enableTimestamps(int fd) {
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		sizeof flags) == 0;
+}
+
+int64_t ClockSync::receiveTime(msghdr* msg) {
+	for (cmsghdr* c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+
+		scm_timestamping stamps;
+		memcpy(&stamps, CMSG_DATA(c), sizeof stamps);
+		if (stamps.ts[0].tv_sec != 0 || stamps.ts[0].tv_nsec != 0)
+			return (int64_t)stamps.ts[0].tv_sec * 1000000000LL +
+				stamps.ts[0].tv_nsec;
+	}
+	return now();
+}
+
+void ClockSync::addSample(int64_t t1, int64_t t2, int64_t t3, int64_t t4) {
+	Sample& s = window[next];
+	s.at = t4;
+	s.offset = ((t2 - t1) + (t3 - t4)) / 2;
+	s.delay = (t4 - t1) - (t3 - t2);
+	//Only possible if one of the clocks was stepped mid exchange
+	if (s.delay < 0)
+		s.delay = 0;
+
+	next = (next + 1) % WINDOW;
+	if (count < WINDOW)
+		count++;
+
+	updateDrift();
+
+	int64_t offset = getOffset(t4);
+	roundTrip = s.delay;
+	forward = (t2 - t1) - offset;
+	reverse = (t4 - t3) + offset;
+}
+
+/**
+ * The exchange with the shortest delay has the least room for asymmetry, so
+ * its offset is the one we trust
+ */
+const ClockSync::Sample* ClockSync::best() const {
+	const Sample* b = NULL;
+	for (int i = 0; i < count; i++) {
+		if (b == NULL || window[i].delay < b->delay)
+			b = &window[i];
+	}
+	return b;
+}
+
+int64_t ClockSync::getOffset(int64_t t) const {
+	const Sample* b = best();
+	if (b == NULL)
+		return 0;
+	return b->offset + (int64_t)(drift * (double)(t - b->at));
+}
+
+/**
+ * Fits a line through the offsets in the window. Exchanges that took much
+ * longer than the quickest one are left out, since their offsets are mostly
+ * queueing noise.
+ */
+void ClockSync::updateDrift() {
+	int64_t minDelay = best()->delay;
+
+	double n = 0, meanT = 0, meanO = 0;
+	int64_t base = window[(next + WINDOW - 1) % WINDOW].at;
+	for (int i = 0; i < count; i++) {
+		if (window[i].delay > 2 * minDelay + 1000000)
+			continue;
+		n++;
+		meanT += (double)(window[i].at - base);
+		meanO += (double)window[i].offset;
+	}
+	if (n < 2)
+		return;
+	meanT /= n;
+	meanO /= n;
+
+	double cov = 0, var = 0;
+	for (int i = 0; i < count; i++) {
+		if (window[i].delay > 2 * minDelay + 1000000)
+			continue;
+		double dt = (double)(window[i].at - base) - meanT;
+		cov += dt * ((double)window[i].offset - meanO);
+		var += dt * dt;
+	}
+	if (var <= 0)
+		return;
+
+	double d = cov / var;
+	if (d > MAX_DRIFT)
+		d = MAX_DRIFT;
+	else if (d < -MAX_DRIFT)
+		d = -MAX_DRIFT;
+	drift = d;
+}
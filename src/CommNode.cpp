@@ -1,28 +1,187 @@
 #include "CommNode.h"
-#include <boost/uuid/uuid_io.hpp>
 #include "CommNodeLog.h"
+#include "NodeHost.h"
 #include <chrono>
 #include <ctime>
+#include <algorithm>
+#include <climits>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 
 //This external variable holds the instance to the logger used by all files
 extern CommNodeLog* cnLog;
 
 //Helper functions. Implementation at bottom of file
-static in_addr_t getBroadcastIp();
-static bool fromLocalMachine(std::string ip);
+static void toRecord(NeighborInfo* n, SnapshotRecord& r);
+static void fromRecord(const SnapshotRecord& r, NeighborInfo* n);
 
 //Static variable for stopping conversations
 const char* CommNode::NO_RESPONSE = "";
+const char* CommNode::PING = "ping";
+const char* CommNode::PONG = "pong ";
+
+static_assert(SendQueue::FRAME_SIZE == CommNode::DGRAM_SIZE,
+	"Send queues hold whole frames");
+
+//IP_TOS for each traffic class when markDscp is on: CS6 (network control),
+//EF (expedited forwarding) and AF11 (high throughput)
+static const int DSCP_TOS[] = { 48 << 2, 46 << 2, 10 << 2 };
+static const char* CLASS_NAMES[] = { "control", "latency", "bulk" };
+
+thread_local CommNode* CommNode::currentNode = NULL;
 
 /**
  * Constructor
  */
-CommNode::CommNode(boost::uuids::uuid id, int port) {
-	neighbors = new map<std::string, NeighborInfo*>();
-	localNeighbors = new map<std::string, NeighborInfo*>();
-
-	udpPortNumber = port;
+CommNode::CommNode(const NodeId& id, const NodeConfig& config, NodeHost* h) :
+		xferMutex(Histogram::XferMutexWait), mapMutex(Histogram::MapMutexWait),
+		host(h), ownPool(h != NULL ? NULL : 
+			new WorkerPool(config.workerThreads, config.workerCpus)),
+		pool(h != NULL ? h->getPool() : *ownPool), bulk(config.transferDir), 
+		ownInterfaces(h != NULL ? NULL : new InterfaceManager(config.interfaces)),
+		interfaces(h != NULL ? h->getInterfaces() : *ownInterfaces),
+		topology(config.maxDegree, config.randomLinks),
+		duplicates((int64_t)config.heartbeatIntervalSecs * 1000000000LL / 2),
+		ingestLimit(config.ingestRate, config.ingestBurst),
+		relayLimit(config.relayRate, config.relayBurst),
+		heartbeats((int64_t)config.heartbeatMinMs * 1000000LL,
+			(int64_t)config.heartbeatMaxSecs * 1000000000LL,
+			config.heartbeatBudget), shareMatrix(config.latencyMatrix), 
+		matrix(id), interfaceGeneration(0) {
+	neighbors = new NeighborMap();
+	localNeighbors = new NeighborMap();
+
+	udpPortNumber = config.udpPort;
+	preferredTcpPort = config.tcpPort;
+	preferredBulkPort = config.bulkPort;
+	statusDir = config.statusDir;
+	markDscp = config.markDscp;
+	running = false;
+	pendingTasks = 0;
+	activeTasks = 0;
+	skipTasks = false;
+	waitingForTasks = false;
 	uuid = id; 
+	uuidStr = id.toString();
+	memberTimeout = (int64_t)config.heartbeatIntervalSecs * 
+		MEMBER_TIMEOUT_BEATS * 1000000000LL;
+	//Starting from the clock keeps a restarted node's heartbeats from 
+	//looking like copies of its old ones
+	heartbeatSeq = ClockSync::now();
+
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFD < 0)
+		cnLog->exitWithError("Unable to create epoll instance");
+	wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFD < 0)
+		cnLog->exitWithError("Unable to create I/O wakeup descriptor");
+
+	for (int i = 0; i < DISCOVERY_STRANDS; i++)
+		discoveryStrands.push_back(pool.createStrand());
+	eventStrand = pool.createStrand();
+	if (host != NULL) {
+		for (int i = 0; i < DISCOVERY_STRANDS; i++)
+			hostedStrands.push_back(pool.createStrand());
+		gaugeLabel = "node=\"" + uuidStr + "\"";
+	}
+
+	Metrics::registerGauge("neighbors", "Neighbors in the neighbor table", 
+		[this]() {
+			std::lock_guard<InstrumentedMutex> lock(mapMutex);
+			return (double)neighbors->size();
+		}, gaugeLabel);
+	Metrics::registerGauge("neighbors_connected", 
+		"Neighbors we have a connection to", [this]() {
+			std::lock_guard<InstrumentedMutex> lock(mapMutex);
+			int connected = 0;
+			for (auto& it : *neighbors) {
+				if (neighborPool.get(it.second)->socketFD >= 0)
+					connected++;
+			}
+			return (double)connected;
+		}, gaugeLabel);
+	Metrics::registerGauge("neighbor_slabs", 
+		"Slabs of neighbor records allocated", [this]() {
+			std::lock_guard<InstrumentedMutex> lock(mapMutex);
+			return (double)neighborPool.getSlabs();
+		}, gaugeLabel);
+	Metrics::registerGauge("transfer_queue_depth", 
+		"Queued frames waiting to be written", [this]() {
+			std::lock_guard<InstrumentedMutex> lock(xferMutex);
+			size_t depth = 0;
+			for (auto& it : sendQueues) {
+				for (int c = 0; c < static_cast<int>(TrafficClass::COUNT); c++)
+					depth += it.second.depth(static_cast<TrafficClass>(c));
+			}
+			return (double)depth;
+		}, gaugeLabel);
+	for (int c = 0; c < static_cast<int>(TrafficClass::COUNT); c++) {
+		TrafficClass cls = static_cast<TrafficClass>(c);
+		Metrics::registerGauge(std::string("send_queue_depth_") + CLASS_NAMES[c],
+			std::string("Queued ") + CLASS_NAMES[c] + " frames waiting to be written",
+			[this, cls]() {
+				std::lock_guard<InstrumentedMutex> lock(xferMutex);
+				size_t depth = 0;
+				for (auto& it : sendQueues)
+					depth += it.second.depth(cls);
+				return (double)depth;
+			}, gaugeLabel);
+	}
+	Metrics::registerGauge("bulk_transfers_active", 
+		"Bulk transfers being sent or received", [this]() {
+			return (double)bulk.getActive();
+		}, gaugeLabel);
+	Metrics::registerGauge("heartbeat_interval_seconds", 
+		"Time between our last heartbeat and the next", [this]() {
+			return heartbeats.getInterval() / 1e9;
+		}, gaugeLabel);
+	Metrics::registerGauge("latency_matrix_rows", 
+		"Nodes whose links we know of", [this]() {
+			std::lock_guard<std::mutex> lock(matrixMutex);
+			return (double)matrix.getRows();
+		}, gaugeLabel);
+	Metrics::registerGauge("latency_matrix_entries", 
+		"Links in the cluster-wide latency matrix", [this]() {
+			std::lock_guard<std::mutex> lock(matrixMutex);
+			return (double)matrix.getEntries();
+		}, gaugeLabel);
+
+	//The host reports the pool it lends us
+	if (host == NULL) {
+		Metrics::registerGauge("worker_queue_depth", 
+			"Tasks waiting for a worker thread", [this]() {
+				return (double)pool.getQueued();
+			});
+	}
+}
+
+/**
+ * Destructor
+ */
+CommNode::~CommNode() {
+	//Tasks skipped by a stop() from one of our handlers still refer to us
+	if (host != NULL)
+		waitForTasks();
+	Metrics::unregisterGauge("neighbors", gaugeLabel);
+	Metrics::unregisterGauge("neighbors_connected", gaugeLabel);
+	Metrics::unregisterGauge("neighbor_slabs", gaugeLabel);
+	Metrics::unregisterGauge("transfer_queue_depth", gaugeLabel);
+	for (int c = 0; c < static_cast<int>(TrafficClass::COUNT); c++) {
+		Metrics::unregisterGauge(std::string("send_queue_depth_") + 
+			CLASS_NAMES[c], gaugeLabel);
+	}
+	Metrics::unregisterGauge("bulk_transfers_active", gaugeLabel);
+	Metrics::unregisterGauge("heartbeat_interval_seconds", gaugeLabel);
+	Metrics::unregisterGauge("latency_matrix_rows", gaugeLabel);
+	Metrics::unregisterGauge("latency_matrix_entries", gaugeLabel);
+	if (host == NULL)
+		Metrics::unregisterGauge("worker_queue_depth");
+	close(epollFD);
+	close(wakeFD);
+	delete neighbors;
+	delete localNeighbors;
 }
 
 /*
@@ -30,10 +189,21 @@ CommNode::CommNode(boost::uuids::uuid id, int port) {
  */
 void CommNode::start() {
 	running = true;
+	skipTasks = false;
 	
-	initBroadcastListener();
-	initBroadcastServer();
+	//A hosted node uses the host's threads and discovery sockets, which are
+	//already running
+	if (host != NULL) {
+		isListening = false;
+		udpBroadcastFD = host->getBroadcastFD();
+	} else {
+		pool.start();
+		interfaces.start();
+		initBroadcastListener();
+		initBroadcastServer();
+	}
 	initTCPListener();
+	bulk.listen(preferredBulkPort);
 
 	//We only want to start the udp listener if we sucessfully bound
 	//the listener socket
@@ -41,7 +211,64 @@ void CommNode::start() {
 		startBroadcastListener();
 	}
 
-	startTCPListener();
+	if (host != NULL) {
+		startIO();
+		host->attach(this);
+	} else {
+		startTCPListener();
+	}
+	bulk.start();
+}
+
+/**
+ * Hands a task to a strand or to the pool, counted as ours
+ */
+void CommNode::post(WorkerPool::Strand& strand, WorkerPool::Task task) {
+	pendingTasks++;
+	strand.post([this, task]() { runTask(task); });
+}
+
+void CommNode::submit(WorkerPool::Task task) {
+	pendingTasks++;
+	pool.submit([this, task]() { runTask(task); });
+}
+
+void CommNode::runTask(const WorkerPool::Task& task) {
+	//Counted before skipTasks is read, so a stop() that sets it either sees
+	//us running or we see that it's set
+	activeTasks++;
+	if (!skipTasks) {
+		CommNode* outer = currentNode;
+		currentNode = this;
+		task();
+		currentNode = outer;
+	}
+
+	//The waiter may free us as soon as it sees the counts, so they change
+	//under the lock and releasing it is the last thing we do
+	std::lock_guard<std::mutex> lock(taskMutex);
+	activeTasks--;
+	pendingTasks--;
+	if (waitingForTasks)
+		tasksDone.notify_all();
+}
+
+/**
+ * Waits until the workers are done with our tasks. A node stopped from one
+ * of its own handlers can't wait for the tasks queued behind that handler,
+ * so it waits for the others that are running and the rest are skipped;
+ * the destructor waits for those to be taken off the queues.
+ */
+void CommNode::waitForTasks() {
+	std::unique_lock<std::mutex> lock(taskMutex);
+	waitingForTasks = true;
+	if (currentNode == this) {
+		skipTasks = true;
+		tasksDone.wait(lock, [this]() { return activeTasks <= 1; });
+	} else {
+		tasksDone.wait(lock, [this]() { return pendingTasks == 0; });
+	}
+	waitingForTasks = false;
 }
 
 /**
@@ -52,35 +279,69 @@ void CommNode::stop() {
   //handlers
 	running = false;
 
-	//Wait for both the UDP and TCP listeners to stop
-	pthread_join(tcpThread, NULL);
-	pthread_join(udpThread, NULL);
+	//Wait for both the UDP and TCP listeners to stop. A hosted node's I/O
+	//runs on the host's thread, which leaves us alone once we're detached.
+	if (host != NULL) {
+		host->detach(this);
+		stopIO();
+	} else {
+		pthread_join(tcpThread, NULL);
+		pthread_join(udpThread, NULL);
+		interfaces.stop();
+	}
 
-	//Close all sockets
-	close(udpListenerFD);
+	//Let the workers finish what the I/O threads gave them before the sockets
+	//go away. The host's pool keeps running for the other nodes, so we only
+	//wait for our own tasks.
+	if (host != NULL)
+		waitForTasks();
+	else
+		pool.stop();
+
+	//Interrupted transfers resume when the sender reconnects after a restart
+	bulk.stop();
+
+	//Persist what we know so the next start can dial peers immediately
+	saveSnapshot(true);
+
+	//Close all sockets. The discovery sockets of a hosted node are the host's.
+	if (host == NULL) {
+		close(udpListenerFD);
+		close(udpBroadcastFD);
+	}
 	close(tcpListenerFD);
 	
-	for (auto it : *neighbors) {
-		close(it.second->socketFD);
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	for (auto& it : *neighbors) {
+		NeighborInfo* n = neighborPool.get(it.second);
+		if (n->socketFD >= 0)
+			close(n->socketFD);
 	}
 
 	//Empty neighbor containers
+	for (auto& it : *neighbors)
+		neighborPool.release(it.second);
 	neighbors->clear();
 	localNeighbors->clear();
 }
 
 /**
- * Sends a heartbeat and runs various upkeep code
+ * Pings neighbors and runs various upkeep code. Heartbeats are sent by the
+ * I/O thread on their own schedule.
  */
 void CommNode::update() {
-	sendHeartbeat();
+	TraceSpan span("timer.update");
+	//Links opened here are pinged below, so they are measured by next time
+	rebalance();
 
 	//Run metrics on a separate thread and wait for it to finish
 	pthread_t metricsThread;
 	pthread_create(&metricsThread, NULL, &runMetrics, this);
 	pthread_join(metricsThread, NULL);
 
+	gossipMatrix();
 	printNeighbors();
+	saveSnapshot(false);
 	cnLog->debug("Still alive..." + std::to_string(neighbors->size()) + " " + 
 		std::to_string(localNeighbors->size()));
 }
@@ -123,34 +384,23 @@ void CommNode::initBroadcastListener() {
 	} else {
 		//Bind was successful, set flag to show we are listening
 		isListening = true;
+
+		//Wake up periodically so stop() can join this thread
+		timeval tv;
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		setsockopt(udpListenerFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
 	}
 	freeaddrinfo(resInfo);
 }
 
 /**
- * Initializes the broadcast socket FD and creates the broadcast address object.
- * On a fixed interval, this server will broadcast a UDP packet on a specified
- * port number.
+ * Initializes the broadcast socket FD. On a fixed interval, this server will 
+ * broadcast a UDP packet on a specified port number to the broadcast address
+ * of every interface the InterfaceManager reports.
  */
 void CommNode::initBroadcastServer() {
-	addrinfo hints, *resInfo;
-
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
-	
-	char ipStr[INET_ADDRSTRLEN];
-	in_addr_t brd = getBroadcastIp();
-	inet_ntop(hints.ai_family, &brd, ipStr, INET_ADDRSTRLEN);
-	
-	int res = getaddrinfo(ipStr, std::to_string(udpPortNumber).c_str(), 
-		&hints, &resInfo);
-	if (res != 0)
-		cnLog->exitWithError("Error getting UDP addr info: " +
-			std::string(gai_strerror(res)));
-	
-	udpBroadcastFD = socket(resInfo->ai_family, resInfo->ai_socktype, 
-		resInfo->ai_protocol);
+	udpBroadcastFD = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (udpBroadcastFD < 0)
 		cnLog->exitWithError("Unable to create UDP socket file descriptor");
 
@@ -160,14 +410,11 @@ void CommNode::initBroadcastServer() {
 	if (ret < 0)
 		cnLog->exitWithError("Error setting options for broadcast socket");
 
-	//Saving this sockaddr for later so we don't have to look it up again
-	broadcastLen = sizeof broadcastAddr;
-	memset(&broadcastAddr, 0, broadcastLen);
-	broadcastAddr.sin_family = resInfo->ai_family;
-	broadcastAddr.sin_addr = ((sockaddr_in*)resInfo->ai_addr)->
-		sin_addr;
-	broadcastAddr.sin_port = ((sockaddr_in*)resInfo->ai_addr)->sin_port;
-	freeaddrinfo(resInfo);
+	//Heartbeats are network control, the same as our control frames
+	int tos = DSCP_TOS[static_cast<int>(TrafficClass::Control)];
+	if (markDscp && setsockopt(udpBroadcastFD, IPPROTO_IP, IP_TOS, &tos, 
+			sizeof tos) < 0)
+		cnLog->warning("Unable to mark heartbeats with a DSCP");
 }
 
 /**
@@ -197,116 +444,412 @@ void* CommNode::handleBroadcast() {
 
 		int ret = recvfrom(udpListenerFD, udpDgram, DGRAM_SIZE, 0, 
 			(sockaddr*)&origin, &originSize);
-		if (ret < 0)
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
 			cnLog->exitWithError("Error receiving UDP packet");
+		}
+		handleDatagram(udpDgram, ret, origin);
+	}
+	return NULL;
+}
 
-		//Before doing any processing, forward the message
-		forwardToLocalNeighbors(udpDgram, DGRAM_SIZE);
+/**
+ * Checks a datagram from the discovery socket against the limits and the
+ * duplicates, relays it to the neighbors on this host and queues it for
+ * handling. Returns false if it was dropped. Only called by the thread
+ * receiving broadcasts, ours or the host's.
+ * @param dgram a zero padded frame
+ * @param len bytes received
+ */
+bool CommNode::handleDatagram(char* dgram, int len, 
+		const sockaddr_in& origin) {
+	Metrics::increment(Counter::DatagramsReceived);
+	Tracer::instant("udp.receive", len);
+	int64_t now = ClockSync::now();
+	TrafficCapture::record(TrafficCapture::UdpIn, origin.sin_addr.s_addr,
+		now, dgram, len);
+
+	//A flooding or looping sender must not be amplified onto every node 
+	//on this host, so limits and duplicates are checked before relaying
+	if (!ingestLimit.allow(origin.sin_addr.s_addr, now)) {
+		Metrics::increment(Counter::DatagramsRateLimited);
+		return false;
+	}
+	if (duplicates.check(duplicateKey(dgram, len), now)) {
+		Metrics::increment(Counter::DatagramsDuplicate);
+		return false;
+	}
 
-		//The format for broadcast dgrams is "command args1 arg2 .. argn"
-		std::string broadcastMsg(udpDgram);
-		std::vector<std::string> splitStrs;
-		boost::split(splitStrs, broadcastMsg, boost::is_any_of("\t "));
+	//Before doing any processing, forward the message
+	if (relayLimit.allow(origin.sin_addr.s_addr, now))
+		forwardToLocalNeighbors(dgram);
+	else
+		Metrics::increment(Counter::RelaysRateLimited);
 
-		if (splitStrs.size() < 2) {
-			cnLog->error("Malformed broadcast message, too few arguments");
-		} else {	
-			//Message format should be "add uuid tcpport"
-			if (splitStrs[0] == "add" && splitStrs.size() >= 3) {
-				std::string neighbor = splitStrs[1];
-				boost::algorithm::trim(neighbor);
+	postHeartbeat(dgram, len, origin);
+	return true;
+}
 
-				std::string myself = boost::uuids::to_string(uuid);
-		
-				//Ignore messages originating from this node
-				if (myself.compare(neighbor) == 0) {
-					continue;
-				}
+/**
+ * Hands a discovery datagram to a worker. Heartbeats from one sender stay
+ * in order; the rest run in parallel.
+ */
+void CommNode::postHeartbeat(const char* dgram, int len, 
+		const sockaddr_in& origin) {
+	std::string msg(dgram, strnlen(dgram, std::min(len, (int)DGRAM_SIZE)));
+	int strand = ntohl(origin.sin_addr.s_addr) % DISCOVERY_STRANDS;
+	post(*discoveryStrands[strand], [this, msg, origin]() {
+		handleHeartbeat(msg.c_str(), origin);
+	});
+}
 
-				if (neighbors->count(neighbor) == 0) {
-					char ip[INET_ADDRSTRLEN];
-					inet_ntop(AF_INET, &(origin.sin_addr), ip, INET_ADDRSTRLEN);
+/**
+ * Identifies a datagram for duplicate suppression. Heartbeats are keyed on
+ * sender and sequence number; anything else, including heartbeats from 
+ * older nodes, on its contents.
+ */
+uint64_t CommNode::duplicateKey(const char* dgram, size_t len) {
+	len = strnlen(dgram, len);
+
+	//"add uuid tcpport bulkport seq [gapms]". The sequence number is the 5th
+	//field; the gap after it differs between heartbeats only by jitter.
+	NodeId sender;
+	const char* id = dgram + 4;
+	const char* idEnd = len > 4 ? (const char*)memchr(id, ' ', len - 4) : NULL;
+	const char* seq = NULL;
+	if (idEnd != NULL) {
+		const char* end = dgram + len;
+		const char* field = idEnd;
+		//Skip tcpport and bulkport
+		for (int i = 0; i < 2 && field != NULL; i++)
+			field = (const char*)memchr(field + 1, ' ', end - field - 1);
+		if (field != NULL && field + 1 < end)
+			seq = field + 1;
+	}
+	if (seq != NULL && memcmp(dgram, "add ", 4) == 0 &&
+			NodeId::parse(id, idEnd - id, sender)) {
+		uint64_t key = sender.hash() ^ strtoull(seq, NULL, 10);
+		//splitmix64 finalizer, so nearby sequence numbers spread out
+		key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+		return key ^ (key >> 31);
+	}
 
-					int portNum;
-					std::stringstream convert(splitStrs[2]);
-					convert >> portNum;
+	//FNV-1a
+	uint64_t key = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < len; i++)
+		key = (key ^ (unsigned char)dgram[i]) * 0x100000001B3ULL;
+	return key;
+}
 
-					addNeighborAsync(neighbor, std::string(ip), portNum);
-				}
+/**
+ * Parses a discovery datagram and adds the sender if it's a new neighbor
+ * @param dgram the NUL terminated datagram
+ * @param origin the address it was received from
+ */
+void CommNode::handleHeartbeat(const char* dgram, const sockaddr_in& origin) {
+	//The format for broadcast dgrams is "command args1 arg2 .. argn"
+	TraceSpan parseSpan("heartbeat.parse");
+	std::string broadcastMsg(dgram);
+	std::vector<std::string> splitStrs;
+	boost::split(splitStrs, broadcastMsg, boost::is_any_of("\t "));
+
+	if (splitStrs.size() < 2) {
+		Metrics::increment(Counter::ParseFailures);
+		cnLog->error("Malformed broadcast message, too few arguments");
+	} else {	
+		//Message format should be "add uuid tcpport [bulkport [seq [gapms]]]"
+		if (splitStrs[0] == "add" && splitStrs.size() >= 3) {
+			NodeId neighbor;
+			if (!NodeId::parse(boost::algorithm::trim_copy(splitStrs[1]), 
+					neighbor)) {
+				Metrics::increment(Counter::ParseFailures);
+				cnLog->error("Malformed broadcast message, bad node id");
+				return;
+			}
+	
+			//Ignore messages originating from this node
+			if (neighbor == uuid) {
+				return;
 			}
+
+			char ip[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &(origin.sin_addr), ip, INET_ADDRSTRLEN);
+
+			int portNum;
+			std::stringstream convert(splitStrs[2]);
+			convert >> portNum;
+
+			//Older nodes don't have a bulk port
+			int bulkPort = 0;
+			if (splitStrs.size() >= 4)
+				bulkPort = atoi(splitStrs[3].c_str());
+
+			//This also picks up a new address, bulk port or heartbeat gap from a
+			//neighbor we already know
+			addNeighborAsync(neighbor, std::string(ip), portNum, -1, bulkPort,
+				parseHeartbeatGap(splitStrs));
 		}
 	}
-	return NULL;
 }
 
 /**
- * Lets us modify the transfer queue from multiple threads without overwriting
- * each other
+ * Queues a frame for fd in its traffic class and, unless another thread is
+ * already writing fd's queue, has a worker write the queue out. A write can
+ * wait on a slow neighbor for up to a connect timeout, so it never happens
+ * on the caller's thread, which may hold locks. frame is read up to its
+ * first zero byte, and never past DGRAM_SIZE bytes. Returns false if fd
+ * isn't a neighbor connection or the frame's class is full.
+ */
+bool CommNode::queueFrame(int fd, const char* frame) {
+	TraceSpan span("enqueue", fd);
+	{
+		std::lock_guard<InstrumentedMutex> lock(xferMutex);
+		auto it = sendQueues.find(fd);
+		if (it == sendQueues.end() || it->second.closing)
+			return false;
+
+		SendQueue& q = it->second;
+		if (!q.push(frame, SendQueue::classify(frame), ClockSync::now())) {
+			Metrics::increment(Counter::SendQueueFull);
+			return false;
+		}
+		if (q.writing || q.held)
+			return true;
+		q.writing = true;
+	}
+
+	submit([this, fd]() { writeQueued(fd); });
+	return true;
+}
+
+/**
+ * Pads msg with zeros to a full frame and queues it
+ */
+bool CommNode::queueFrame(int fd, const std::string& msg) {
+	char frame[DGRAM_SIZE];
+	memset(frame, 0, DGRAM_SIZE);
+	memcpy(frame, msg.data(), std::min(msg.size(), (size_t)DGRAM_SIZE - 1));
+	return queueFrame(fd, frame);
+}
+
+/**
+ * Writes fd's queue out, most urgent frame first, until it is empty. Only
+ * the thread that set writing calls this, so the writes to one socket never
+ * interleave and frames queued meanwhile by other threads go out with ours.
  */
-void CommNode::modifyXferQueueAsync(int fd, std::string msg) {
-	std::lock_guard<std::mutex> lock(xferMutex);
-	transferQueue[fd] = msg;
+void CommNode::writeQueued(int fd) {
+	SendQueue* q;
+	SendQueue::Frame f;
+	while (true) {
+		{
+			std::lock_guard<InstrumentedMutex> lock(xferMutex);
+			//Only erased while nobody is writing it
+			q = &sendQueues[fd];
+			if (q->closing) {
+				sendQueues.erase(fd);
+				break;
+			}
+			if (!q->pop(f)) {
+				q->writing = false;
+				return;
+			}
+		}
+
+		int cls = static_cast<int>(f.cls);
+		if (markDscp && q->tos != DSCP_TOS[cls]) {
+			q->tos = DSCP_TOS[cls];
+			setsockopt(fd, IPPROTO_IP, IP_TOS, &q->tos, sizeof q->tos);
+		}
+
+		//Stamp pings and pongs as late as we can so queueing stays out of the
+		//delay
+		int64_t now = ClockSync::now();
+		Metrics::record(static_cast<Histogram>(
+			static_cast<int>(Histogram::SendQueueControl) + cls), now - f.queued);
+		bool ok;
+		{
+			TraceSpan writeSpan("write", fd);
+			if (strncmp(f.data, PING, DGRAM_SIZE) == 0)
+				ok = writeFrame(fd, std::string(PING) + " " + std::to_string(now));
+			else if (strncmp(f.data, PONG, strlen(PONG)) == 0)
+				ok = writeFrame(fd, std::string(f.data, strnlen(f.data, DGRAM_SIZE)) +
+					" " + std::to_string(now));
+			else
+				ok = writeFrame(fd, f.data);
+		}
+
+		if (ok) {
+			Metrics::increment(Counter::MessagesSent);
+			Metrics::increment(Counter::BytesWritten, DGRAM_SIZE);
+			continue;
+		}
+
+		//A socket that took nothing for a connect timeout won't take the rest
+		//either. The I/O thread drops the connection once it fails.
+		std::lock_guard<InstrumentedMutex> lock(xferMutex);
+		size_t dropped = q->clear();
+		cnLog->error("Error writing to socket " + std::to_string(fd) + 
+			", dropped " + std::to_string(dropped) + " queued frames");
+	}
+
+	//The connection closed while we were writing, and left the socket to us
+	close(fd);
 }
 
 /**
  * Adds a new neighbor to the map. Mutex prevents sockets from being 
- * opened twice on accident
+ * opened twice on accident. A new neighbor is only dialed while we have
+ * fewer links than the topology allows; otherwise it stays passive until a
+ * rebalance picks it. For a neighbor we already know, we note that it is 
+ * still around, pick up its bulk port (which changes whenever it restarts)
+ * and take over the connection if it dialed us.
  */
-void CommNode::addNeighborAsync(std::string id, std::string ip, int port,
-		int fd) {
-	std::lock_guard<std::mutex> lock(mapMutex);
-	if (neighbors->count(id) != 0) return;
+void CommNode::addNeighborAsync(const NodeId& id, std::string ip, int port,
+		int fd, int bulkPort, int64_t heartbeatGap) {
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	auto known = neighbors->find(id);
+	if (known != neighbors->end()) {
+		NeighborInfo* n = neighborPool.get(known->second);
+		n->lastSeen = ClockSync::now();
+		if (bulkPort != 0)
+			n->bulkPort = bulkPort;
+		if (heartbeatGap != 0)
+			n->heartbeatGap = heartbeatGap;
+
+		//A heartbeat from a new address, e.g. after a DHCP renewal. Its link
+		//fails on its own if the old address is gone.
+		if (fd < 0 && (n->ip != ip || n->port != port)) {
+			cnLog->debug("Neighbor " + id.toString() + " moved to " + ip + ":" +
+				std::to_string(port));
+			n->ip = ip;
+			n->port = port;
+			heartbeats.noteChurn();
+		}
+		if (fd >= 0 && fd != n->socketFD)
+			adoptConnection(n, fd);
+		return;
+	}
 
-	NeighborInfo *n = new NeighborInfo();
+	NeighborHandle h = neighborPool.allocate();
+	NeighborInfo* n = neighborPool.get(h);
+	if (n == NULL) {
+		cnLog->error("Neighbor table is full, ignoring " + id.toString());
+		return;
+	}
 	n->uuid = id;
 	n->ip = ip;
 	n->port = port;
+	n->bulkPort = bulkPort;
+	n->lastSeen = ClockSync::now();
+	n->heartbeatGap = heartbeatGap;
 
-	auto res = neighbors->insert(
-		std::pair<std::string, NeighborInfo*>(id, n));
+	auto res = neighbors->insert(std::make_pair(id, h));
 	if (!res.second) {
 		cnLog->exitWithError("Error inserting into map");
 	}
 	
 	// See if this neighbor is running on our local machine, if 
 	// so add them to the localNeighbors map
-	bool fromLocal = fromLocalMachine(n->ip);
+	in_addr_t addr = inet_addr(n->ip.c_str());
+	bool fromLocal = interfaces.isLocal(addr);
 	int cnt = localNeighbors->count(id);
 
 	if (fromLocal && cnt == 0) {
-		res = localNeighbors->insert(
-			std::pair<std::string, NeighborInfo*>(id, n));
+		res = localNeighbors->insert(std::make_pair(id, h));
 		if (!res.second) {
 			cnLog->exitWithError("Unable to add to localNeighbors");
 		}
 	}
 	
-	cnLog->debug("Added neighbor " + n->uuid + " at address " + 
+	Metrics::increment(Counter::NeighborsAdded);
+	cnLog->debug("Added neighbor " + n->uuid.toString() + " at address " + 
 		n->ip + ":" + std::to_string(n->port));
+	notifyMembership(id, true);
+	heartbeats.noteChurn();
 
   //If the optional parameter was passed in, then we've already connected 
-  //a socket	
-	if (fd == -1)
-		connectToNeighbor(n);
-	else
+  //a socket. Neighbors on this host are always connected so we can relay
+  //broadcasts to them.
+	if (fd != -1)
 		n->socketFD = fd;
+	else if (fromLocal || topology.wantsMore(countConnected()))
+		connectToNeighbor(n);
 
 	n = NULL;
 }
 
 /**
- * Sends a UDP packet to the broadcast address
+ * Called by the I/O thread on every pass. Sends a heartbeat if the
+ * scheduler says one is due, treating a change to our own addresses as
+ * churn.
+ */
+void CommNode::heartbeatIfDue() {
+	unsigned long generation = interfaces.getGeneration();
+	if (generation != interfaceGeneration) {
+		interfaceGeneration = generation;
+		heartbeats.noteChurn();
+	}
+
+	int members;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		members = neighbors->size() + 1;
+	}
+
+	int64_t now = ClockSync::now();
+	if (heartbeats.due(now, members))
+		sendHeartbeat(heartbeats.sent(now, members));
+}
+
+/**
+ * Reads the gap to the sender's next heartbeat, in milliseconds on the wire,
+ * from the fields of an add message. Returns 0 if the sender is too old to
+ * announce it.
+ */
+int64_t CommNode::parseHeartbeatGap(const std::vector<std::string>& fields) {
+	if (fields.size() < 6)
+		return 0;
+	return std::max(atoll(fields[5].c_str()), 0LL) * 1000000LL;
+}
+
+/**
+ * Sends a UDP packet to the broadcast address of each configured interface.
+ * A failure on one interface (e.g. while DHCP is renewing its address) is 
+ * logged and the others are still tried. gap is how long until the next
+ * one, so receivers know how long to wait before forgetting us.
  */
-void CommNode::sendHeartbeat() {
+void CommNode::sendHeartbeat(int64_t gap) {
+	TraceSpan span("heartbeat.send");
 	char buff[DGRAM_SIZE];
 	memset(buff, 0, DGRAM_SIZE);
-	sprintf(buff, "add %s %d", boost::uuids::to_string(uuid).c_str(), 
-		tcpPortNumber);
-	
-	int ret = sendto(udpBroadcastFD, buff, DGRAM_SIZE, 0, 
-		(sockaddr*)&broadcastAddr, broadcastLen);
-	if (ret < 0) {
-		cnLog->exitWithError("Error sending to broadcast socket");
+	sprintf(buff, "add %s %d %d %llu %lld", uuidStr.c_str(), 
+		tcpPortNumber, bulk.getPort(), (unsigned long long)heartbeatSeq++,
+		(long long)(gap / 1000000));
+
+	std::vector<InterfaceAddr> domains = interfaces.getBroadcastDomains();
+	if (domains.empty()) {
+		cnLog->warning("No broadcast interfaces available for heartbeat");
+		return;
+	}
+
+	for (auto& it : domains) {
+		sockaddr_in dest;
+		memset(&dest, 0, sizeof dest);
+		dest.sin_family = AF_INET;
+		dest.sin_addr.s_addr = it.broadcast;
+		dest.sin_port = htons(udpPortNumber);
+
+		int ret = sendto(udpBroadcastFD, buff, DGRAM_SIZE, 0, 
+			(sockaddr*)&dest, sizeof dest);
+		if (ret < 0) {
+			cnLog->error("Error sending heartbeat on " + it.name);
+		} else {
+			Metrics::increment(Counter::HeartbeatsSent);
+			TrafficCapture::record(TrafficCapture::UdpOut, it.broadcast,
+				ClockSync::now(), buff, DGRAM_SIZE);
+		}
 	}
 }
 
@@ -321,8 +864,9 @@ void CommNode::startTCPListener() {
 }
 
 /**
- * Initializes a TCP socket and binds it to a random port. This socket will
- * listen for connect() attempts and accept them
+ * Initializes a TCP socket and binds it to the preferred port, or a random
+ * one if that isn't set or is taken. This socket will listen for connect() 
+ * attempts and accept them
  */
 void CommNode::initTCPListener() {
 	addrinfo hints, *resInfo;
@@ -332,7 +876,8 @@ void CommNode::initTCPListener() {
   hints.ai_flags = AI_PASSIVE;
 	hints.ai_protocol = IPPROTO_TCP;
 	
-	int ret = getaddrinfo(NULL, "0", &hints, &resInfo);
+	int ret = getaddrinfo(NULL, std::to_string(preferredTcpPort).c_str(), 
+		&hints, &resInfo);
 	if (ret != 0)
 		cnLog->exitWithError("Error getting TCP addr info: " +
 			std::string(gai_strerror(ret)));
@@ -357,6 +902,12 @@ void CommNode::initTCPListener() {
 	}
 	
 	ret = bind(tcpListenerFD, resInfo->ai_addr, resInfo->ai_addrlen);
+	if (ret < 0 && errno == EADDRINUSE && preferredTcpPort != 0) {
+		cnLog->warning("Port " + std::to_string(preferredTcpPort) + 
+			" is in use, binding to a random port");
+		((sockaddr_in*)resInfo->ai_addr)->sin_port = 0;
+		ret = bind(tcpListenerFD, resInfo->ai_addr, resInfo->ai_addrlen);
+	}
 	if (ret < 0) {
 		cnLog->exitWithError("Error binding socket to listener address");
 	}
@@ -380,10 +931,15 @@ void CommNode::initTCPListener() {
 }
 
 /**
- * Creates a new TCP socket and connects it to the neighbor. Also starts 
- * a new IO thread for the socket
+ * Creates a new TCP socket and connects it to the neighbor. The I/O thread
+ * sends the handshake once the connect finishes. A node that isn't running
+ * (e.g. one fed a capture by commNodeReplay) leaves neighbors passive, and
+ * so does a node for neighbors in the same host, which it reaches in memory.
  */
 void CommNode::connectToNeighbor(NeighborInfo *n) {
+	if (!running || (host != NULL && host->isHosted(n->uuid)))
+		return;
+
 	addrinfo hints, *resInfo;
 
 	hints.ai_family = AF_INET;
@@ -414,300 +970,1497 @@ void CommNode::connectToNeighbor(NeighborInfo *n) {
 		if (errno != EINPROGRESS)
 			cnLog->error("Error connecting to TCP socket: ");
 	}
+	freeaddrinfo(resInfo);
 
-	pthread_t thread;
-	std::pair<int, CommNode*> arg(n->socketFD, this);
-	pthread_create(&thread, NULL, &incomingMessageHandler, &arg);
+	n->outbound = true;
+	addConnection(n->socketFD, true);
 }
 
 /**
- * Polls all of this node's TCP sockets and spawns a new message handler for
- * the new socket
+ * Takes over a connection a known neighbor opened to us. Called with 
+ * mapMutex held.
  */
-void* CommNode::handleTCP() {
-	cnLog->debug("Listening for TCP connections with socket " + 
-		std::to_string(tcpListenerFD) + " on port number: " + 
-		std::to_string(tcpPortNumber));
+void CommNode::adoptConnection(NeighborInfo* n, int fd) {
+	//Accepted sockets share the listener's port, ours get an ephemeral one
+	sockaddr_in local;
+	socklen_t localLen = sizeof local;
+	bool outbound = getsockname(fd, (sockaddr*)&local, &localLen) == 0 &&
+		ntohs(local.sin_port) != tcpPortNumber;
 
-	sockaddr_in newNeighbor;
-	unsigned int newNeighborLen = sizeof newNeighbor;
-	
-	while (running) {
-		int newSock = accept(tcpListenerFD, (sockaddr*)&newNeighbor, 
-		 &newNeighborLen);
-		if (newSock < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				continue;
-			}
-			cnLog->exitWithError("Unable to accept TCP connection");
-		}
+	if (n->socketFD < 0) {
+		n->socketFD = fd;
+		n->outbound = outbound;
+		return;
+	}
 
-		pthread_t newThread;
-		std::pair<int, CommNode*> arg(newSock, this);
-		pthread_create(&newThread, NULL, &incomingMessageHandler,
-			&arg);
+	//When both of us dialed at once, each side keeps the connection opened 
+	//by the node with the lower id, so we agree on which one to close. If 
+	//it's the same direction, the neighbor reconnected and the new one wins.
+	bool keepNew = true;
+	if (outbound != n->outbound)
+		keepNew = outbound == (uuid < n->uuid);
+	int drop = keepNew ? n->socketFD.load() : fd;
+	if (keepNew) {
+		n->socketFD = fd;
+		n->outbound = outbound;
 	}
 
-	return NULL;
+	//The I/O thread sees the hangup and closes it
+	shutdown(drop, SHUT_RDWR);
 }
 
 /**
- * Formats neighbor information for printing and writes to a file.
+ * Turns the neighbor using this socket into a passive member. If it is 
+ * still around we keep hearing its heartbeats and a rebalance may connect
+ * to it again; if not, expireNeighbors() forgets it.
  */
-void CommNode::printNeighbors() {
-	std::stringstream ss;
-
-	ss << " NEIGHBOR UUID | ADDRESS | LATENCY (ms) | BANDWIDTH (kbps)" << endl << 
-		"------------------------------------------------------------------------"
-		<< endl;
-
-	for (auto it : *neighbors) {
-		ss << it.second->uuid << "|" << 
-			it.second->ip << ":" << it.second->port << "|" << it.second->latency << 
-			"ms |" << it.second->bandwidth << "kbps"<< endl;
+void CommNode::disconnectNeighbor(int fd) {
+	{
+		//A new connection on this socket starts from whole rows
+		std::lock_guard<std::mutex> lock(matrixMutex);
+		matrix.dropLink(fd);
 	}
 
-	std::string filename = std::string(getenv("INSTALL_DIRECTORY")) + 
-		"/nodestatus_" + boost::uuids::to_string(uuid) + ".txt";
-	std::ofstream out;
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
 
-	out.open(filename, std::ofstream::out | std::ofstream::trunc);
-	out << ss.rdbuf();
-	out.close();
+	for (auto& it : *neighbors) {
+		NeighborInfo* n = neighborPool.get(it.second);
+		if (n->socketFD == fd) {
+			cnLog->debug("Disconnected from neighbor " + it.first.toString());
+			n->socketFD = -1;
+			n->outbound = false;
+			return;
+		}
+	}
 }
 
 /**
- * This method forwards the given string to all local neighbors by default. 
- * If an id is passed, then the message is only forwarded to that CN
+ * Links that count towards the degree. Called with mapMutex held.
  */
-void CommNode::forwardToLocalNeighbors(char* msg, unsigned long int sz, 
-		std::string id) {
-	if (id.length() != 0) {
-		write((*localNeighbors)[id]->socketFD, msg, sz);
-	} else {
-		for (auto it : *localNeighbors) {
-			int ret = write(it.second->socketFD, msg, sz);
-			if (ret < 0) {
-				cnLog->exitWithError("Unable to write to socket: " + 
-					std::to_string(it.second->socketFD));
-			}
-		}
+int CommNode::countConnected() {
+	int count = 0;
+	for (auto& it : *neighbors) {
+		if (neighborPool.get(it.second)->socketFD >= 0 && 
+				localNeighbors->count(it.first) == 0)
+			count++;
 	}
+	return count;
 }
 
 /**
- * Helper function that handles parsing a TCP recv string, performs necessary
- * logic and returns an appropriate response or NO_RESPONSE if none is
- * required.
+ * Forgets passive neighbors we haven't heard from in a while
  */
-std::string CommNode::createTCPResponse(int sockFD, char* buf, 
-		long unsigned int sz) {
-	std::string str(buf);
-	std::vector<std::string> splits;
-
-	boost::split(splits, str, boost::is_any_of("\t "));
-
-	if (splits[0] == "ping") {
-		return "pong " + splits[1];
-	} else if (splits[0] == "pong") {
-		auto stop = std::chrono::system_clock::now();
-		typedef std::chrono::system_clock::period period_t;
-		auto dur = stop.time_since_epoch();
-
-		//Time is currently in nanoseconds. Divide by 1 million to get millis
-		long int milliDur = dur.count() / 1000000;
-
-		//Get time difference in milliseconds and store it in that neighbor's 
-		//latency info
-		long int start = stol(splits[1], NULL, 0);
-
-		for (auto& it : *neighbors) {
-			if (it.second->socketFD == sockFD) {
-				it.second->latency = milliDur - start;
-	
-				float scalar;
-				if (it.second->latency == 0) {
-					scalar = 0.0f;
-				} else {
-					scalar = 1.0f / (float)(it.second->latency);
-				}
-				float bandwidth = (float)DGRAM_SIZE * scalar;
-				it.second->bandwidth = bandwidth;
-				return NO_RESPONSE;
-			}
-		}
-		cnLog->debug("Unable to find neighbor with socketFD = " + 
-			std::to_string(sockFD));
-		return NO_RESPONSE;
-	} else if (splits[0] == "get") {
-		if (splits[1] == "uuid") {
-			return "uuid " + boost::uuids::to_string(uuid);
+void CommNode::expireNeighbors() {
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	int64_t now = ClockSync::now();
+
+	for (auto it = neighbors->begin(); it != neighbors->end(); ) {
+		//Neighbors that slowed their heartbeats down told us by how much
+		NeighborInfo* n = neighborPool.get(it->second);
+		int64_t timeout = std::max(memberTimeout, 
+			n->heartbeatGap * MEMBER_TIMEOUT_BEATS);
+		if (n->socketFD >= 0 || now - n->lastSeen < timeout) {
+			++it;
+			continue;
 		}
-	} else if (splits[0] == "uuid") {
-		auto it = neighbors->find(splits[1]);
-		sockaddr_in peer;
-		unsigned int peerLen = sizeof peer;
-		getpeername(sockFD, (sockaddr*)&peer, &peerLen);
-			
-		char ip[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &(peer.sin_addr.s_addr), ip, INET_ADDRSTRLEN);
-		int port = ntohs(peer.sin_port);
-
-		addNeighborAsync(splits[1], std::string(ip), port, sockFD);
-		return NO_RESPONSE;
-	} else if (splits[0] == "add") {
-		std::string neighbor = splits[1];
-		boost::algorithm::trim(neighbor);
 
-		std::string myself = boost::uuids::to_string(uuid);
-		
-		//Ignore messages originating from this node
-		if (myself.compare(neighbor) == 0) {
-			return NO_RESPONSE;
+		Metrics::increment(Counter::NeighborsRemoved);
+		cnLog->debug("Removing neighbor " + it->first.toString());
+		notifyMembership(it->first, false);
+		heartbeats.noteChurn();
+		{
+			std::lock_guard<std::mutex> matrixLock(matrixMutex);
+			matrix.forget(LatencyMatrix::key(it->first));
 		}
-
-		if (neighbors->count(neighbor) == 0) {
-			char ip[INET_ADDRSTRLEN];
-			sockaddr_in peer;
-			unsigned int peerLen = sizeof peer;
-			getpeername(sockFD, (sockaddr*)&peer, &peerLen);
-			
-			inet_ntop(AF_INET, &(peer.sin_addr), ip, INET_ADDRSTRLEN);
-
-			int portNum;
-			std::stringstream convert(splits[2]);
-			convert >> portNum;
-
-			addNeighborAsync(neighbor, std::string(ip), portNum, sockFD);
-		}				
-		return NO_RESPONSE;
+		localNeighbors->erase(it->first);
+		neighborPool.release(it->second);
+		it = neighbors->erase(it);
 	}
-	cnLog->debug("Invalid TCP request: " + str);
-	return NO_RESPONSE;
-}
 
+	//Returns the memory of neighbors released since the last heartbeat
+	neighborPool.reclaim();
+}
 
 /**
- * Gathers information about neighboring nodes
+ * Asks the topology which links to open and close, and does it
  */
-void* CommNode::runMetrics() {
-	using namespace boost::posix_time;
+void CommNode::rebalance() {
+	TraceSpan span("timer.rebalance");
+	expireNeighbors();
 
-	//Run metrics on each neighbor
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	std::vector<Topology::Peer> peers;
+	peers.reserve(neighbors->size());
 	for (auto& it : *neighbors) {
-		auto stop = std::chrono::system_clock::now();
-		typedef std::chrono::system_clock::period period_t;
-		auto dur = stop.time_since_epoch();
+		//Nodes in the same host don't need a link
+		if (host != NULL && host->isHosted(it.first))
+			continue;
+		NeighborInfo* n = neighborPool.get(it.second);
+		Topology::Peer p;
+		p.id = it.first;
+		p.connected = n->socketFD >= 0;
+		p.outbound = n->outbound;
+		p.pinned = localNeighbors->count(it.first) != 0;
+		p.roundTrip = n->roundTrip;
+		peers.push_back(p);
+	}
 
-		//duration is in nanoseconds. Divide by 1 million to get millis
-		long int milliDur = dur.count() / 1000000;	
+	Topology::Plan plan = topology.rebalance(peers);
 
-		//Write a short message to the neighbor's TCP socket and await response
-		char msg[128];
-		sprintf(msg, "%s %ld", "ping", milliDur);
-		modifyXferQueueAsync(it.second->socketFD, std::string(msg));
+	for (auto& id : plan.connect) {
+		auto it = neighbors->find(id);
+		if (it == neighbors->end())
+			continue;
+		NeighborInfo* n = neighborPool.get(it->second);
+		if (n->socketFD < 0)
+			connectToNeighbor(n);
 	}
-	return NULL;
-}
-
-/** 
- * Gets LAN broadcast IP from ifaddrs
- */
-static in_addr_t getBroadcastIp() {
-	ifaddrs* allAddrs = NULL;
-	getifaddrs(&allAddrs);
 
-	for (ifaddrs* it = allAddrs; it != NULL; it = it->ifa_next) {
-		//If the ifaddr isn't IPv4 or if 
-		//it is the loopback interface then continue
-		if (it->ifa_addr->sa_family != AF_INET ||
-				strcmp(it->ifa_name, "lo") == 0)
+	for (auto& id : plan.drop) {
+		auto it = neighbors->find(id);
+		if (it == neighbors->end())
+			continue;
+		NeighborInfo* n = neighborPool.get(it->second);
+		if (n->socketFD < 0)
 			continue;
 
-		sockaddr_in* brd = (sockaddr_in*)(it->ifa_ifu.ifu_broadaddr);
-		freeifaddrs(allAddrs);
-		
-		return brd->sin_addr.s_addr;
+		//The I/O thread sees the hangup and closes the socket
+		Metrics::increment(Counter::LinksDropped);
+		shutdown(n->socketFD, SHUT_RDWR);
+		n->socketFD = -1;
+		n->outbound = false;
 	}
-	
-	if (allAddrs != NULL)
-		freeifaddrs(allAddrs);
-	return 0;
-}
 
-static bool fromLocalMachine(std::string ip) {
-	ifaddrs* allAddrs = NULL;
-	getifaddrs(&allAddrs);
+	if (!plan.connect.empty() || !plan.drop.empty()) {
+		cnLog->debug("Rebalanced links: " + std::to_string(plan.connect.size()) +
+			" opened, " + std::to_string(plan.drop.size()) + " closed");
+	}
+}
 
-	for (ifaddrs* it = allAddrs; it != NULL; it = it->ifa_next) {
-		if (!it->ifa_addr) {
+/**
+ * Adds every neighbor from a previous run, dialing the quickest ones until
+ * the topology has enough links. The connects are non-blocking, so all of 
+ * them are in flight at once. The rest become passive members, and are 
+ * forgotten if we don't hear from them.
+ */
+void CommNode::dialKnownNeighbors(const std::vector<SnapshotRecord>& snap) {
+	cnLog->debug("Dialing " + std::to_string(snap.size()) + 
+		" neighbors from snapshot");
+
+	//Unmeasured neighbors go last
+	std::vector<SnapshotRecord> known(snap);
+	std::stable_sort(known.begin(), known.end(), 
+		[](const SnapshotRecord& a, const SnapshotRecord& b) {
+			return (a.latency > 0 ? a.latency : INT_MAX) < 
+				(b.latency > 0 ? b.latency : INT_MAX);
+		});
+
+	for (auto& it : known) {
+		NeighborInfo record;
+		fromRecord(it, &record);
+		if (record.uuid == uuid)
 			continue;
+
+		addNeighborAsync(record.uuid, record.ip, record.port, -1, 
+			record.bulkPort);
+
+		//Keep the last known metrics until the first new sample arrives
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		auto found = neighbors->find(record.uuid);
+		if (found != neighbors->end()) {
+			NeighborInfo* n = neighborPool.get(found->second);
+			n->latency = record.latency;
+			n->bandwidth = record.bandwidth;
+			if (record.latency > 0)
+				n->roundTrip = (int64_t)record.latency * 1000000;
 		}
+	}
+}
 
-		if (it->ifa_addr->sa_family == AF_INET) {
-			in_addr_t ipNum = ((sockaddr_in*)it->ifa_addr)->sin_addr.s_addr;
-			char ipStr[INET_ADDRSTRLEN];
+/**
+ * Copies the neighbor table into the snapshot file
+ */
+void CommNode::saveSnapshot(bool sync) {
+	if (snapshot == NULL)
+		return;
 
-			inet_ntop(AF_INET, &ipNum, ipStr, INET_ADDRSTRLEN);
-			if (!ip.compare(string(ipStr))) {
-				return true;
+	std::vector<SnapshotRecord> records;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		records.reserve(neighbors->size());
+
+		for (auto& it : *neighbors) {
+			SnapshotRecord r;
+			toRecord(neighborPool.get(it.second), r);
+			records.push_back(r);
+		}
+	}
+	snapshot->save(uuid, tcpPortNumber, records, sync);
+}
+
+/**
+ * Stops the listener and I/O threads and waits for the workers to go idle,
+ * but leaves every socket open so they can be handed to another process.
+ */
+void CommNode::quiesce() {
+	running = false;
+
+	pthread_join(tcpThread, NULL);
+	if (isListening)
+		pthread_join(udpThread, NULL);
+
+	//Transfers in progress are cut when this process exits and resume 
+	//against the new one
+	bulk.stopAccepting();
+
+	//Nothing new reaches the workers once the I/O threads are gone
+	pool.waitIdle();
+}
+
+/**
+ * Undoes quiesce() when a handoff fails
+ */
+void CommNode::restartThreads() {
+	running = true;
 
+	if (isListening)
+		startBroadcastListener();
+	startTCPListener();
+	bulk.start();
+
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	for (auto& it : *neighbors) {
+		NeighborInfo* n = neighborPool.get(it.second);
+		if (n->socketFD >= 0)
+			addConnection(n->socketFD, false);
+	}
+}
+
+bool CommNode::handOff(int sock) {
+	//Our threads and discovery sockets belong to the host
+	if (host != NULL) {
+		cnLog->error("Hosted nodes can't be handed off for an upgrade");
+		return false;
+	}
+
+	cnLog->debug("Handing off sockets for upgrade");
+	quiesce();
+
+	HandoffState state;
+	std::vector<int> fds;
+
+	uuid.toBytes(state.uuid);
+	state.udpPort = udpPortNumber;
+	state.tcpPort = tcpPortNumber;
+
+	state.udpListenerIndex = -1;
+	if (isListening) {
+		state.udpListenerIndex = fds.size();
+		fds.push_back(udpListenerFD);
+	}
+	state.udpBroadcastIndex = fds.size();
+	fds.push_back(udpBroadcastFD);
+	state.tcpListenerIndex = fds.size();
+	fds.push_back(tcpListenerFD);
+	state.bulkListenerIndex = fds.size();
+	fds.push_back(bulk.getListenerFD());
+
+	state.snapshotIndex = -1;
+	if (snapshot != NULL && snapshot->isOpen()) {
+		saveSnapshot(true);
+		state.snapshotIndex = fds.size();
+		state.snapshotPath = snapshot->getPath();
+		fds.push_back(snapshot->getFD());
+	}
+
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		std::lock_guard<InstrumentedMutex> xferLock(xferMutex);
+
+		for (auto& it : *neighbors) {
+			NeighborInfo* info = neighborPool.get(it.second);
+			HandoffNeighbor n;
+			toRecord(info, n.record);
+			n.local = localNeighbors->count(it.first) != 0;
+			n.outbound = info->outbound;
+			n.socketIndex = -1;
+			if (info->socketFD < 0) {
+				state.neighbors.push_back(n);
+				continue;
 			}
+			n.socketIndex = fds.size();
+			fds.push_back(info->socketFD);
+
+			auto pending = sendQueues.find(info->socketFD);
+			if (pending != sendQueues.end())
+				n.pending = pending->second.pending();
+			auto partial = partialFrames.find(info->socketFD);
+			if (partial != partialFrames.end())
+				n.partial = partial->second;
+			state.neighbors.push_back(n);
 		}
-		
 	}
 
-	return false;
+	//The new process writes a single byte once it has resumed service
+	char ack = 0;
+	bool ok = UpgradeHandoff::send(sock, state, fds) && 
+		read(sock, &ack, 1) == 1 && ack == 'R';
+
+	if (!ok) {
+		cnLog->error("Upgrade handoff failed, resuming service");
+		restartThreads();
+		return false;
+	}
+
+	cnLog->debug("Handed off " + std::to_string(fds.size()) + " sockets");
+	return true;
 }
 
 /**
- * Handle incoming TCP messages
- * @param i an index in the fds array of file descriptors
+ * Takes over the sockets and neighbors of the process we're replacing. This 
+ * is called instead of start().
  */
-void* CommNode::incomingMessageHandler(int i) {
-	//Write to remote node with the get command specifying uuid
-	std::string msg("get uuid");
-	int ret = write(i, msg.c_str(), DGRAM_SIZE);
-	if (ret < 0) {
-		cnLog->exitWithError("Error writing to new socket number " + 
-			std::to_string(i));
+void CommNode::resume(const HandoffState& state, const std::vector<int>& fds) {
+	auto fdAt = [&fds](int index) {
+		if (index < 0 || index >= (int)fds.size())
+			cnLog->exitWithError("Invalid descriptor index in handoff state");
+		return fds[index];
+	};
+
+	running = true;
+	pool.start();
+	interfaces.start();
+
+	udpPortNumber = state.udpPort;
+	tcpPortNumber = state.tcpPort;
+	isListening = state.udpListenerIndex >= 0;
+	if (isListening)
+		udpListenerFD = fdAt(state.udpListenerIndex);
+	udpBroadcastFD = fdAt(state.udpBroadcastIndex);
+	tcpListenerFD = fdAt(state.tcpListenerIndex);
+	if (state.bulkListenerIndex >= 0)
+		bulk.adopt(fdAt(state.bulkListenerIndex));
+	else
+		bulk.listen(preferredBulkPort);
+
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		std::lock_guard<InstrumentedMutex> xferLock(xferMutex);
+
+		for (auto& it : state.neighbors) {
+			NeighborHandle h = neighborPool.allocate();
+			NeighborInfo* n = neighborPool.get(h);
+			if (n == NULL)
+				cnLog->exitWithError("Neighbor table is full");
+			fromRecord(it.record, n);
+			n->lastSeen = ClockSync::now();
+			if (n->latency > 0)
+				n->roundTrip = (int64_t)n->latency * 1000000;
+			if (it.socketIndex >= 0) {
+				n->socketFD = fdAt(it.socketIndex);
+				n->outbound = it.outbound;
+			}
+
+			(*neighbors)[n->uuid] = h;
+			if (it.local)
+				(*localNeighbors)[n->uuid] = h;
+			if (n->socketFD < 0)
+				continue;
+			//Older processes hand over a single unpadded message
+			SendQueue& q = sendQueues[n->socketFD];
+			std::string pending = it.pending;
+			if (pending.size() % DGRAM_SIZE != 0)
+				pending.resize(pending.size() + DGRAM_SIZE - 
+					pending.size() % DGRAM_SIZE, '\0');
+			for (size_t off = 0; off < pending.size(); off += DGRAM_SIZE) {
+				q.push(&pending[off], SendQueue::classify(&pending[off]), 
+					ClockSync::now());
+			}
+			if (!it.partial.empty())
+				partialFrames[n->socketFD] = it.partial;
+		}
+	}
+
+	cnLog->debug("Resumed with " + std::to_string(state.neighbors.size()) + 
+		" neighbors on TCP port " + std::to_string(tcpPortNumber));
+
+	if (isListening)
+		startBroadcastListener();
+	startTCPListener();
+	bulk.start();
+
+	std::vector<int> pending;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors) {
+			NeighborInfo* n = neighborPool.get(it.second);
+			if (n->socketFD >= 0)
+				addConnection(n->socketFD, false);
+		}
+
+		std::lock_guard<InstrumentedMutex> xferLock(xferMutex);
+		for (auto& it : sendQueues) {
+			if (!it.second.empty()) {
+				it.second.writing = true;
+				pending.push_back(it.first);
+			}
+		}
+	}
+
+	//Whatever the old process hadn't written yet
+	for (int fd : pending)
+		submit([this, fd]() { writeQueued(fd); });
+}
+
+/**
+ * The I/O thread. Accepts connections, finishes outgoing connects, and reads
+ * frames off every neighbor socket, handing each one to the strand of its 
+ * connection. Handling and replying happen on the worker pool.
+ */
+void* CommNode::handleTCP() {
+	startIO();
+	while (running)
+		pollIO(IO_POLL_MS);
+	stopIO();
+	return NULL;
+}
+
+/**
+ * Starts watching the TCP listener. Called before the first pollIO(), by
+ * the I/O thread or before the node is attached to its host.
+ */
+void CommNode::startIO() {
+	cnLog->debug("Listening for TCP connections with socket " + 
+		std::to_string(tcpListenerFD) + " on port number: " + 
+		std::to_string(tcpPortNumber));
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = tcpListenerFD;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, tcpListenerFD, &ev) < 0)
+		cnLog->exitWithError("Unable to watch TCP listener");
+	ev.data.fd = wakeFD;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeFD, &ev) < 0)
+		cnLog->exitWithError("Unable to watch I/O wakeup descriptor");
+}
+
+/**
+ * One pass of the I/O thread. Waits up to timeoutMs for socket events and
+ * handles them, then expires connects and sends a heartbeat if one is due.
+ * A host, which waits on epollFD itself, passes 0.
+ */
+void CommNode::pollIO(int timeoutMs) {
+	registerConnections();
+
+	epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(epollFD, events, MAX_EVENTS, timeoutMs);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		cnLog->exitWithError("Error waiting for socket events");
+	}
+
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (fd == tcpListenerFD) {
+			acceptConnections();
+			continue;
+		}
+		if (fd == wakeFD) {
+			uint64_t count;
+			if (read(wakeFD, &count, sizeof count) < 0 && errno != EAGAIN)
+				cnLog->error("Error reading I/O wakeup descriptor");
+			continue;
+		}
+
+		//May have been closed earlier in this batch
+		auto it = connections.find(fd);
+		if (it == connections.end())
+			continue;
+
+		if (it->second->connecting)
+			finishConnect(it->second);
+		else
+			readConnection(it->second);
+	}
+
+	expireConnects();
+	heartbeatIfDue();
+}
+
+/**
+ * Stops watching every socket once the last pollIO() has returned
+ */
+void CommNode::stopIO() {
+	//Sockets stay open for stop() to close or for the next process to take
+	//over. A partly read frame is kept for whichever I/O thread comes next.
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, tcpListenerFD, NULL);
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, wakeFD, NULL);
+	for (auto& it : connections) {
+		Connection* c = it.second;
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, c->fd, NULL);
+		if (c->have > 0) {
+			std::lock_guard<InstrumentedMutex> lock(xferMutex);
+			partialFrames[c->fd] = std::string(c->frame, c->have);
+		}
+		delete c;
 	}
+	connections.clear();
+}
+
+/**
+ * Hands a socket to the I/O thread
+ * @param handshake true if we still have to ask the other side for its uuid.
+ * This is sent once the socket is writable, so it works for connects that 
+ * are still in progress.
+ */
+void CommNode::addConnection(int fd, bool handshake) {
+	{
+		//A connection we already have, e.g. after a failed handoff, keeps its
+		//queue as it is
+		std::lock_guard<InstrumentedMutex> lock(xferMutex);
+		if (sendQueues.count(fd) == 0)
+			sendQueues[fd].held = handshake;
+	}
+	{
+		std::lock_guard<std::mutex> lock(connMutex);
+		newConnections.push_back(std::make_pair(fd, handshake));
+	}
+	wakeIO();
+}
 
-	while(running) {
-		char buffer[DGRAM_SIZE];
-		int nbytes = read(i, &buffer, DGRAM_SIZE);
+/**
+ * Interrupts epoll_wait, e.g. because a message was queued
+ */
+void CommNode::wakeIO() {
+	uint64_t one = 1;
+	if (write(wakeFD, &one, sizeof one) < 0 && errno != EAGAIN)
+		cnLog->error("Unable to wake the I/O thread");
+}
+
+/**
+ * Starts watching the sockets passed to addConnection()
+ */
+void CommNode::registerConnections() {
+	std::vector<std::pair<int, bool>> added;
+	{
+		std::lock_guard<std::mutex> lock(connMutex);
+		added.swap(newConnections);
+	}
+
+	for (auto& it : added) {
+		//Already watched, e.g. added again after a failed handoff
+		if (connections.count(it.first) != 0)
+			continue;
+
+		Connection* c = new Connection();
+		c->fd = it.first;
+		c->connecting = it.second;
+		c->deadline = std::chrono::steady_clock::now() + 
+			std::chrono::milliseconds((int)CONNECT_TIMEOUT_MS);
+		c->have = takePartialFrame(c->fd, c->frame);
+		c->strand = pool.createStrand();
+		connections[c->fd] = c;
+
+		if (TrafficCapture::isEnabled()) {
+			sockaddr_in peer;
+			memset(&peer, 0, sizeof peer);
+			socklen_t peerLen = sizeof peer;
+			char ip[INET_ADDRSTRLEN] = "";
+			if (getpeername(c->fd, (sockaddr*)&peer, &peerLen) == 0)
+				inet_ntop(AF_INET, &peer.sin_addr, ip, INET_ADDRSTRLEN);
+			std::string addr = std::string(ip) + ":" + 
+				std::to_string(ntohs(peer.sin_port));
+			TrafficCapture::record(TrafficCapture::Open, c->fd, ClockSync::now(),
+				addr.data(), addr.size());
+		}
+
+		//Frames are small and latency is what we measure, so don't let Nagle
+		//hold them back waiting for an ack
+		int noDelay = 1;
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+		int unsent = UNSENT_LIMIT;
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unsent, sizeof unsent);
+		if (!ClockSync::enableTimestamps(c->fd))
+			cnLog->debug("No kernel receive timestamps on socket " + 
+				std::to_string(c->fd));
+
+		//Sockets from an older process may still be blocking
+		int flags = fcntl(c->fd, F_GETFL, 0);
+		if (flags >= 0 && !(flags & O_NONBLOCK))
+			fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof ev);
+		ev.events = c->connecting ? EPOLLOUT : EPOLLIN;
+		ev.data.fd = c->fd;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+			cnLog->error("Unable to watch socket " + std::to_string(c->fd));
+			closeConnection(c);
+		}
+	}
+}
+
+/**
+ * Accepts every pending connection on the non-blocking listener
+ */
+void CommNode::acceptConnections() {
+	while (true) {
+		int newSock = accept4(tcpListenerFD, NULL, NULL, 
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newSock < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+					errno == ECONNABORTED)
+				return;
+			cnLog->exitWithError("Unable to accept TCP connection");
+		}
+
+		addConnection(newSock, true);
+	}
+}
+
+/**
+ * Called once a connecting socket is writable. Sends the handshake and 
+ * starts reading, or drops the neighbor if the connect failed.
+ */
+void CommNode::finishConnect(Connection* c) {
+	int err = 0;
+	socklen_t len = sizeof err;
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		cnLog->debug("Unable to connect socket " + std::to_string(c->fd));
+		closeConnection(c);
+		return;
+	}
+
+	//Write to remote node with the get command specifying uuid. Nothing else
+	//is written while the queue is held, so it goes first.
+	if (!writeFrame(c->fd, std::string("get uuid"))) {
+		cnLog->error("Error writing to new socket number " + 
+			std::to_string(c->fd));
+		closeConnection(c);
+		return;
+	}
+
+	//Frames queued while we were connecting
+	bool queued = false;
+	{
+		std::lock_guard<InstrumentedMutex> lock(xferMutex);
+		SendQueue& q = sendQueues[c->fd];
+		q.held = false;
+		if (!q.empty() && !q.writing)
+			queued = q.writing = true;
+	}
+	if (queued) {
+		int fd = c->fd;
+		post(*c->strand, [this, fd]() { writeQueued(fd); });
+	}
+
+	c->connecting = false;
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = c->fd;
+	if (epoll_ctl(epollFD, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+		cnLog->error("Unable to watch socket " + std::to_string(c->fd));
+		closeConnection(c);
+	}
+}
+
+/**
+ * Reads what is available on a socket and posts each whole frame to the
+ * connection's strand. TCP doesn't keep our frame boundaries, so a read can
+ * return part of a frame, or the end of one and the start of the next.
+ */
+void CommNode::readConnection(Connection* c) {
+	//Don't let one busy socket starve the others
+	for (int frames = 0; frames < MAX_EVENTS; ) {
+		//The kernel's receive timestamp comes along as control data
+		iovec iov;
+		iov.iov_base = c->frame + c->have;
+		iov.iov_len = DGRAM_SIZE - c->have;
+		char control[CMSG_SPACE(sizeof(timespec) * 3)];
+		msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+
+		int nbytes = recvmsg(c->fd, &msg, 0);
 		//Bytes received less than or equal to 0. Either the client hung up
 		//or there was an error
 		if (nbytes <= 0) {
 			if (nbytes == 0) {
-				cnLog->debug("Socket hung up: " + std::to_string(i));
-			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				continue;
+				cnLog->debug("Socket hung up: " + std::to_string(c->fd));
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK || 
+					errno == EINTR) {
+				return;
 			} else {
 				cnLog->error("Error reading from socket " + 
-					std::to_string(i));
+					std::to_string(c->fd));
+			}
+			closeConnection(c);
+			return;
+		}
+
+		Metrics::increment(Counter::BytesRead, nbytes);
+		c->have += nbytes;
+		if (c->have < DGRAM_SIZE)
+			continue;
+
+		//A frame counts as received when its last byte arrives
+		int64_t received = ClockSync::receiveTime(&msg);
+		c->have = 0;
+		frames++;
+		Metrics::increment(Counter::MessagesReceived);
+		Tracer::instant("tcp.receive", c->fd);
+		TrafficCapture::record(TrafficCapture::TcpIn, c->fd, received, c->frame,
+			DGRAM_SIZE);
+
+		int fd = c->fd;
+		std::string frame(c->frame, DGRAM_SIZE);
+		post(*c->strand, [this, fd, frame, received]() { 
+			handleFrame(fd, frame, received); 
+		});
+	}
+}
+
+/**
+ * Stops watching a socket. Frames already posted are still handled; the 
+ * neighbor is removed and the socket closed after them, on the same strand.
+ */
+void CommNode::closeConnection(Connection* c) {
+	int fd = c->fd;
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL);
+	connections.erase(fd);
+	TrafficCapture::record(TrafficCapture::Close, fd, ClockSync::now(), NULL, 0);
+
+	post(*c->strand, [this, fd]() {
+		disconnectNeighbor(fd);
+		{
+			//A thread still writing the queue closes the socket when it's done
+			std::lock_guard<InstrumentedMutex> lock(xferMutex);
+			auto it = sendQueues.find(fd);
+			if (it != sendQueues.end() && it->second.writing) {
+				it->second.closing = true;
+				return;
 			}
-			close(i);
-			break;
+			if (it != sendQueues.end())
+				sendQueues.erase(it);
+		}
+		close(fd);
+	});
+	delete c;
+}
+
+/**
+ * Drops neighbors that haven't accepted our connection in time
+ */
+void CommNode::expireConnects() {
+	auto now = std::chrono::steady_clock::now();
+	std::vector<Connection*> expired;
+	for (auto& it : connections) {
+		if (it.second->connecting && it.second->deadline < now)
+			expired.push_back(it.second);
+	}
+
+	for (auto c : expired) {
+		cnLog->debug("Unable to connect socket " + std::to_string(c->fd));
+		closeConnection(c);
+	}
+}
+
+/**
+ * Handles one frame on a worker and writes the reply, if there is one
+ */
+void CommNode::handleFrame(int fd, const std::string& frame, 
+		int64_t received) {
+	//Senders pad frames with zeros, but don't trust them to
+	char buf[DGRAM_SIZE + 1];
+	memcpy(buf, frame.data(), DGRAM_SIZE);
+	buf[DGRAM_SIZE] = '\0';
+
+	std::string resp = createTCPResponse(fd, buf, received);
+	if (resp.compare(NO_RESPONSE) && !queueFrame(fd, resp))
+		cnLog->error("Unable to queue a reply for socket " + std::to_string(fd));
+}
+
+/**
+ * Formats neighbor information for printing and writes to a file.
+ */
+void CommNode::printNeighbors() {
+	if (statusDir.empty())
+		return;
+
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	std::stringstream ss;
+
+	ss << " NEIGHBOR UUID | ADDRESS | LINK | LATENCY (ms) | BANDWIDTH (kbps) | " <<
+		"CLOCK OFFSET (ms) | DRIFT (ppm) | DELAY OUT/IN (ms)" << endl << 
+		"------------------------------------------------------------------------"
+		<< endl;
+
+	int64_t now = ClockSync::now();
+	for (auto& it : *neighbors) {
+		NeighborInfo* n = neighborPool.get(it.second);
+		//Nodes in our host are reached in memory rather than over a link
+		const char* link = n->socketFD >= 0 ? (n->outbound ? "out" : "in") :
+			host != NULL && host->isHosted(n->uuid) ? "hosted" : "passive";
+		ss << n->uuid.toString() << "|" << n->ip << ":" << n->port << "|" << 
+			link << "|" << n->latency << "ms |" << n->bandwidth << "kbps";
+
+		//Neighbors running older versions don't give us their timestamps
+		const ClockSync& clock = n->clock;
+		if (clock.getSamples() > 0) {
+			ss << "|" << clock.getOffset(now) / 1e6 << "ms |" << 
+				clock.getDriftPpm() << "ppm |" << clock.getForward() / 1e6 << 
+				"/" << clock.getReverse() / 1e6 << "ms";
+		}
+		ss << endl;
+	}
+
+	std::string filename = statusDir + "/nodestatus_" + uuidStr + ".txt";
+	std::ofstream out;
+
+	out.open(filename, std::ofstream::out | std::ofstream::trunc);
+	out << ss.rdbuf();
+	out.close();
+}
+
+/**
+ * This method forwards the given string to all local neighbors by default. 
+ * If an id is passed, then the message is only forwarded to that CN. The 
+ * map lock is only held while picking the neighbors, not during the writes.
+ */
+void CommNode::forwardToLocalNeighbors(char* msg, const NodeId& id) {
+	TraceSpan span("relay");
+	std::vector<NeighborHandle> targets;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		if (!id.isNil()) {
+			auto it = localNeighbors->find(id);
+			if (it != localNeighbors->end())
+				targets.push_back(it->second);
 		} else {
-			std::string resp = createTCPResponse(i, buffer, DGRAM_SIZE);
-			if (resp.compare(NO_RESPONSE)) {
-				nbytes = write(i, resp.c_str(), DGRAM_SIZE);
-				if (nbytes < 0) {
-					cnLog->error("Error writing to socket ");
+			targets.reserve(localNeighbors->size());
+			for (auto& it : *localNeighbors)
+				targets.push_back(it.second);
+		}
+	}
+
+	//A neighbor removed since then comes back NULL
+	NeighborPool::Guard guard(neighborPool);
+	for (auto& it : targets) {
+		NeighborInfo* n = neighborPool.get(it);
+		int fd = n == NULL ? -1 : n->socketFD.load();
+		if (fd < 0)
+			continue;
+
+		//Relayed heartbeats are control frames, so they go out ahead of any
+		//application messages waiting for the same neighbor
+		if (!queueFrame(fd, msg)) {
+			cnLog->error("Unable to relay to socket " + std::to_string(fd));
+			continue;
+		}
+		Metrics::increment(Counter::DatagramsRelayed);
+	}
+}
+
+/**
+ * Helper function that handles parsing a TCP recv string, performs necessary
+ * logic and returns an appropriate response or NO_RESPONSE if none is
+ * required.
+ */
+std::string CommNode::createTCPResponse(int sockFD, char* buf, 
+		int64_t received) {
+	TraceSpan span("dispatch", sockFD);
+	if (received == 0)
+		received = ClockSync::now();
+
+	std::string str(buf);
+	std::vector<std::string> splits;
+
+	boost::split(splits, str, boost::is_any_of("\t "));
+
+	if (splits[0] == "ping" && splits.size() >= 2) {
+		//Echo the sender's timestamp and add when we got it. When we answered
+		//is added as the pong is written.
+		return PONG + splits[1] + " " + std::to_string(received);
+	} else if (splits[0] == "pong" && splits.size() >= 2) {
+		//Older nodes only echo our timestamp, which still gives a round trip
+		int64_t t1 = strtoll(splits[1].c_str(), NULL, 10);
+		bool full = splits.size() >= 4;
+		int64_t t2 = full ? strtoll(splits[2].c_str(), NULL, 10) : 0;
+		int64_t t3 = full ? strtoll(splits[3].c_str(), NULL, 10) : 0;
+
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors) {
+			NeighborInfo* n = neighborPool.get(it.second);
+			if (n->socketFD == sockFD) {
+				int64_t roundTrip = received - t1;
+				if (full) {
+					ClockSync& clock = n->clock;
+					clock.addSample(t1, t2, t3, received);
+					roundTrip = clock.getRoundTrip();
+					Metrics::record(Histogram::DelayOut, 
+						std::max(clock.getForward(), (int64_t)0));
+					Metrics::record(Histogram::DelayIn, 
+						std::max(clock.getReverse(), (int64_t)0));
 				}
+				roundTrip = std::max(roundTrip, (int64_t)0);
+				Metrics::record(Histogram::RoundTrip, roundTrip);
+				n->roundTrip = roundTrip;
+				n->latency = roundTrip / 1000000;
+	
+				float scalar;
+				if (n->latency == 0) {
+					scalar = 0.0f;
+				} else {
+					scalar = 1.0f / (float)(n->latency);
+				}
+				float bandwidth = (float)DGRAM_SIZE * scalar;
+				n->bandwidth = bandwidth;
+				return NO_RESPONSE;
 			}
+		}
+		cnLog->debug("Unable to find neighbor with socketFD = " + 
+			std::to_string(sockFD));
+		return NO_RESPONSE;
+	} else if (splits[0] == "get") {
+		if (splits[1] == "uuid") {
+			return "uuid " + uuidStr + " " + 
+				std::to_string(tcpPortNumber) + " " + 
+				std::to_string(bulk.getPort());
+		}
+	} else if (splits[0] == "uuid") {
+		sockaddr_in peer;
+		unsigned int peerLen = sizeof peer;
+		getpeername(sockFD, (sockaddr*)&peer, &peerLen);
+			
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &(peer.sin_addr.s_addr), ip, INET_ADDRSTRLEN);
 
-			if (transferQueue[i].compare(NO_RESPONSE)) {
-				int bytes_available;
-				ioctl(i, FIONREAD, &bytes_available);
-				nbytes = write(i, transferQueue[i].c_str(), DGRAM_SIZE);
-				if (nbytes < 0) {
-					cnLog->error("Error writing queued message");
-				}
-				modifyXferQueueAsync(i, NO_RESPONSE);
+		//Newer nodes send their listening port so we can dial them again after
+		//a restart. Older ones only give us the connection's source port.
+		int port = ntohs(peer.sin_port);
+		if (splits.size() >= 3) {
+			std::stringstream convert(splits[2]);
+			convert >> port;
+		}
+		int bulkPort = splits.size() >= 4 ? atoi(splits[3].c_str()) : 0;
+
+		NodeId id;
+		if (splits.size() < 2 || !NodeId::parse(splits[1], id)) {
+			Metrics::increment(Counter::ParseFailures);
+			cnLog->debug("Invalid node id in TCP request: " + str);
+			return NO_RESPONSE;
+		}
+		addNeighborAsync(id, std::string(ip), port, sockFD, bulkPort);
+		return NO_RESPONSE;
+	} else if (splits[0] == "add") {
+		NodeId neighbor;
+		if (splits.size() < 3 || !NodeId::parse(
+				boost::algorithm::trim_copy(splits[1]), neighbor)) {
+			Metrics::increment(Counter::ParseFailures);
+			cnLog->debug("Invalid node id in TCP request: " + str);
+			return NO_RESPONSE;
+		}
+		
+		//Ignore messages originating from this node
+		if (neighbor == uuid) {
+			return NO_RESPONSE;
+		}
+
+		int64_t gap = parseHeartbeatGap(splits);
+		bool known;
+		{
+			std::lock_guard<InstrumentedMutex> lock(mapMutex);
+			auto it = neighbors->find(neighbor);
+			known = it != neighbors->end();
+			if (known) {
+				NeighborInfo* n = neighborPool.get(it->second);
+				n->lastSeen = ClockSync::now();
+				if (gap != 0)
+					n->heartbeatGap = gap;
 			}
 		}
+
+		if (!known) {
+			char ip[INET_ADDRSTRLEN];
+			sockaddr_in peer;
+			unsigned int peerLen = sizeof peer;
+			getpeername(sockFD, (sockaddr*)&peer, &peerLen);
+			
+			inet_ntop(AF_INET, &(peer.sin_addr), ip, INET_ADDRSTRLEN);
+
+			int portNum;
+			std::stringstream convert(splits[2]);
+			convert >> portNum;
+			int bulkPort = splits.size() >= 4 ? atoi(splits[3].c_str()) : 0;
+
+			//This is a heartbeat relayed by a neighbor on the same host, so 
+			//the socket it came in on belongs to the relay
+			addNeighborAsync(neighbor, std::string(ip), portNum, -1, bulkPort,
+				gap);
+		}				
+		return NO_RESPONSE;
+	} else if (splits[0] == "lat") {
+		if (!shareMatrix)
+			return NO_RESPONSE;
+		std::lock_guard<std::mutex> lock(matrixMutex);
+		if (!matrix.apply(buf)) {
+			Metrics::increment(Counter::ParseFailures);
+			cnLog->debug("Invalid latency matrix update: " + str);
+		}
+		return NO_RESPONSE;
+	} else if (splits[0] == "msg" && splits.size() >= 2) {
+		//The payload is everything after the topic, spaces included
+		size_t start = std::min(str.size(), splits[1].size() + 5);
+		deliverMessage(sockFD, splits[1], str.substr(start));
+		return NO_RESPONSE;
 	}
+	Metrics::increment(Counter::ParseFailures);
+	cnLog->debug("Invalid TCP request: " + str);
+	return NO_RESPONSE;
+}
+
+
+/**
+ * Gathers information about neighboring nodes
+ */
+void* CommNode::runMetrics() {
+	using namespace boost::posix_time;
+	TraceSpan span("timer.metrics");
+	std::vector<int> links;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors) {
+			int fd = neighborPool.get(it.second)->socketFD;
+			if (fd >= 0)
+				links.push_back(fd);
+		}
+	}
+
+	//Write a short message to each neighbor's TCP socket and await response.
+	//The send time is filled in when the message is actually written.
+	for (int fd : links)
+		queueFrame(fd, std::string(PING));
 	return NULL;
 }
+
+/**
+ * Puts the links we measure into our row of the latency matrix and sends
+ * each neighbor we have a link to the rows that changed since it last heard
+ * from us. A neighbor whose queue is full gets whole rows next time.
+ */
+void CommNode::gossipMatrix() {
+	if (!shareMatrix)
+		return;
+	TraceSpan span("timer.matrix");
+
+	std::vector<LatencyMatrix::Sample> samples;
+	std::vector<int> links;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors) {
+			NeighborInfo* n = neighborPool.get(it.second);
+			if (n->socketFD < 0)
+				continue;
+			links.push_back(n->socketFD);
+			if (n->roundTrip >= 0) {
+				samples.push_back({ LatencyMatrix::key(it.first), n->roundTrip, 
+					n->bandwidth });
+			}
+		}
+	}
+
+	std::vector<std::pair<int, std::vector<std::string>>> deltas;
+	{
+		std::lock_guard<std::mutex> lock(matrixMutex);
+		matrix.setLocal(samples, ClockSync::now());
+		for (int fd : links)
+			deltas.emplace_back(fd, matrix.deltasFor(fd));
+	}
+
+	for (auto& it : deltas) {
+		for (auto& frame : it.second) {
+			if (!queueFrame(it.first, frame.data())) {
+				std::lock_guard<std::mutex> lock(matrixMutex);
+				matrix.dropLink(it.first);
+				break;
+			}
+			Metrics::increment(Counter::MatrixFramesSent);
+		}
+	}
+}
+
+/**
+ * Writes one whole frame. Neighbor sockets are non-blocking, so if the send
+ * buffer is full we wait for room, but only as long as a connect may take.
+ * Callers make sure nobody else writes to fd meanwhile (see writeQueued).
+ */
+bool CommNode::writeFrame(int fd, const char* frame) {
+	int written = 0;
+
+	while (written < DGRAM_SIZE) {
+		int n = ::send(fd, frame + written, DGRAM_SIZE - written, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+
+			pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) <= 0)
+				return false;
+			continue;
+		}
+		written += n;
+	}
+	TrafficCapture::record(TrafficCapture::TcpOut, fd, ClockSync::now(), frame,
+		DGRAM_SIZE);
+	return true;
+}
+
+/**
+ * Pads msg with zeros to a full frame and writes it
+ */
+bool CommNode::writeFrame(int fd, const std::string& msg) {
+	char frame[DGRAM_SIZE];
+	memset(frame, 0, DGRAM_SIZE);
+	memcpy(frame, msg.data(), std::min(msg.size(), (size_t)DGRAM_SIZE - 1));
+	return writeFrame(fd, frame);
+}
+
+/**
+ * Copies out the start of a frame an earlier I/O thread had read from fd, and
+ * returns its length
+ */
+int CommNode::takePartialFrame(int fd, char* frame) {
+	std::lock_guard<InstrumentedMutex> lock(xferMutex);
+	auto it = partialFrames.find(fd);
+	if (it == partialFrames.end())
+		return 0;
+
+	int len = std::min(it->second.size(), (size_t)DGRAM_SIZE);
+	memcpy(frame, it->second.data(), len);
+	partialFrames.erase(it);
+	return len;
+}
+
+/**
+ * Looks up the neighbor's address and bulk port and starts the transfer
+ */
+uint64_t CommNode::sendFile(const NodeId& neighborId, 
+		const std::string& path, const std::string& name, 
+		BulkTransfer::DoneCallback done) {
+	std::string ip;
+	int port = 0;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		auto it = neighbors->find(neighborId);
+		if (it != neighbors->end()) {
+			NeighborInfo* n = neighborPool.get(it->second);
+			ip = n->ip;
+			port = n->bulkPort;
+		}
+	}
+
+	if (port == 0) {
+		cnLog->error("No bulk transfer port known for " + 
+			neighborId.toString());
+		return 0;
+	}
+	return bulk.sendFile(ip, port, path, name, done);
+}
+
+/**
+ * Writes a message to one neighbor. Returns false if the message doesn't 
+ * fit in a frame, the neighbor is unknown, we have no link to it or the 
+ * write fails.
+ */
+bool CommNode::send(const NodeId& to, const std::string& topic, 
+		const std::string& payload) {
+	char frame[DGRAM_SIZE];
+	if (!formatMessage(topic, payload, frame))
+		return false;
+
+	if (host != NULL && host->deliver(uuid, to, topic, payload)) {
+		Metrics::increment(Counter::AppMessagesSent);
+		return true;
+	}
+
+	NeighborHandle h;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		auto it = neighbors->find(to);
+		if (it == neighbors->end())
+			return false;
+		h = it->second;
+	}
+
+	NeighborPool::Guard guard(neighborPool);
+	NeighborInfo* n = neighborPool.get(h);
+	int fd = n == NULL ? -1 : n->socketFD.load();
+	if (fd < 0 || !queueFrame(fd, frame))
+		return false;
+
+	Metrics::increment(Counter::AppMessagesSent);
+	return true;
+}
+
+/**
+ * Writes a message to every neighbor we have a link to, and hands it to
+ * every other node in our host. Returns how many nodes it went to.
+ */
+int CommNode::publish(const std::string& topic, const std::string& payload) {
+	char frame[DGRAM_SIZE];
+	if (!formatMessage(topic, payload, frame))
+		return 0;
+
+	std::vector<NeighborHandle> targets;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		targets.reserve(neighbors->size());
+		for (auto& it : *neighbors) {
+			if (neighborPool.get(it.second)->socketFD >= 0)
+				targets.push_back(it.second);
+		}
+	}
+
+	int sent = 0;
+	NeighborPool::Guard guard(neighborPool);
+	for (auto& it : targets) {
+		NeighborInfo* n = neighborPool.get(it);
+		int fd = n == NULL ? -1 : n->socketFD.load();
+		if (fd < 0 || !queueFrame(fd, frame))
+			continue;
+
+		Metrics::increment(Counter::AppMessagesSent);
+		sent++;
+	}
+
+	if (host != NULL) {
+		int handed = host->deliverAll(uuid, topic, payload);
+		Metrics::increment(Counter::AppMessagesSent, handed);
+		sent += handed;
+	}
+	return sent;
+}
+
+bool CommNode::hasRoom(const NodeId& to) {
+	std::vector<int> fds;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		if (to.isNil()) {
+			for (auto& it : *neighbors)
+				fds.push_back(neighborPool.get(it.second)->socketFD);
+		} else {
+			auto it = neighbors->find(to);
+			if (it != neighbors->end())
+				fds.push_back(neighborPool.get(it->second)->socketFD);
+		}
+	}
+
+	//Unlinked neighbors have no queue, and nodes in our host take messages
+	//in memory
+	std::lock_guard<InstrumentedMutex> lock(xferMutex);
+	for (int fd : fds) {
+		auto it = sendQueues.find(fd);
+		if (it != sendQueues.end() &&
+				it->second.depth(TrafficClass::Bulk) >= SendQueue::BULK_LIMIT)
+			return false;
+	}
+	return true;
+}
+
+void CommNode::subscribe(const std::string& topic, MessageHandler handler) {
+	std::lock_guard<std::mutex> lock(handlerMutex);
+	subscriptions[topic] = handler;
+}
+
+void CommNode::unsubscribe(const std::string& topic) {
+	std::lock_guard<std::mutex> lock(handlerMutex);
+	subscriptions.erase(topic);
+}
+
+void CommNode::setMembershipHandler(MembershipHandler handler) {
+	std::lock_guard<std::mutex> lock(handlerMutex);
+	membershipHandler = handler;
+}
+
+/**
+ * Ids in the neighbor table, or only those we can send to. Nodes in our
+ * host count as linked.
+ */
+std::vector<NodeId> CommNode::getMembers(bool linkedOnly) {
+	std::lock_guard<InstrumentedMutex> lock(mapMutex);
+	std::vector<NodeId> members;
+	members.reserve(neighbors->size());
+	for (auto& it : *neighbors) {
+		if (!linkedOnly || neighborPool.get(it.second)->socketFD >= 0 ||
+				(host != NULL && host->isHosted(it.first)))
+			members.push_back(it.first);
+	}
+	return members;
+}
+
+/**
+ * Names the rows and entries of the latency matrix after the members they
+ * belong to. Links to nodes we haven't heard of are left out.
+ */
+std::vector<CommNode::LinkMetrics> CommNode::getLatencyMatrix() {
+	std::vector<LatencyMatrix::Cell> cells;
+	{
+		std::lock_guard<std::mutex> lock(matrixMutex);
+		cells = matrix.getCells();
+	}
+
+	std::unordered_map<uint64_t, NodeId> ids;
+	ids[LatencyMatrix::key(uuid)] = uuid;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors)
+			ids[LatencyMatrix::key(it.first)] = it.first;
+	}
+
+	std::vector<LinkMetrics> links;
+	links.reserve(cells.size());
+	for (auto& c : cells) {
+		auto from = ids.find(c.from);
+		auto to = ids.find(c.to);
+		if (from == ids.end() || to == ids.end())
+			continue;
+		links.push_back({ from->second, to->second, c.latencyMs, 
+			c.bandwidthKbps });
+	}
+	return links;
+}
+
+/**
+ * Builds the frame "msg <topic> <payload>". Topics can't be empty or hold 
+ * whitespace, and neither can hold a NUL, which would end the frame early.
+ */
+bool CommNode::formatMessage(const std::string& topic, 
+		const std::string& payload, char* frame) {
+	if (topic.empty() || topic.size() + payload.size() > MAX_MESSAGE ||
+			topic.find_first_of(std::string(" \t\0", 3)) != std::string::npos ||
+			payload.find('\0') != std::string::npos)
+		return false;
+
+	memset(frame, 0, DGRAM_SIZE);
+	std::string msg = "msg " + topic + " " + payload;
+	memcpy(frame, msg.data(), msg.size());
+	return true;
+}
+
+/**
+ * Hands a message to the subscriber of its topic, if there is one. Runs on
+ * the strand of the connection it came in on.
+ */
+void CommNode::deliverMessage(int fd, const std::string& topic, 
+		const std::string& payload) {
+	{
+		std::lock_guard<std::mutex> lock(handlerMutex);
+		if (subscriptions.count(topic) == 0)
+			return;
+	}
+
+	NodeId from;
+	{
+		std::lock_guard<InstrumentedMutex> lock(mapMutex);
+		for (auto& it : *neighbors) {
+			if (neighborPool.get(it.second)->socketFD == fd) {
+				from = it.first;
+				break;
+			}
+		}
+	}
+
+	//e.g. a message written before the handshake told us who sent it
+	if (from.isNil()) {
+		cnLog->debug("Dropping message from unknown socket " + 
+			std::to_string(fd));
+		return;
+	}
+	deliverMessage(from, topic, payload);
+}
+
+void CommNode::deliverMessage(const NodeId& from, const std::string& topic, 
+		const std::string& payload) {
+	MessageHandler handler;
+	{
+		std::lock_guard<std::mutex> lock(handlerMutex);
+		auto it = subscriptions.find(topic);
+		if (it == subscriptions.end())
+			return;
+		handler = it->second;
+	}
+
+	Metrics::increment(Counter::AppMessagesDelivered);
+	handler(from, payload);
+}
+
+/**
+ * Takes a message from a node in our host. It is handled on a worker like
+ * one that came in over a link, in order with the others from the sender.
+ */
+void CommNode::deliverHosted(const NodeId& from, const std::string& topic,
+		const std::string& payload) {
+	Metrics::increment(Counter::MessagesHandedOff);
+	post(*hostedStrands[from.hash() % DISCOVERY_STRANDS],
+		[this, from, topic, payload]() {
+			deliverMessage(from, topic, payload);
+		});
+}
+
+/**
+ * Tells the membership handler about a neighbor from the event strand, so 
+ * the handler can call back into the node. Called with mapMutex held.
+ */
+void CommNode::notifyMembership(const NodeId& id, bool joined) {
+	{
+		std::lock_guard<std::mutex> lock(handlerMutex);
+		if (!membershipHandler)
+			return;
+	}
+
+	post(*eventStrand, [this, id, joined]() {
+		MembershipHandler handler;
+		{
+			std::lock_guard<std::mutex> lock(handlerMutex);
+			handler = membershipHandler;
+		}
+		if (handler)
+			handler(id, joined);
+	});
+}
+
+/**
+ * Converts between a neighbor and its persisted form
+ */
+static void toRecord(NeighborInfo* n, SnapshotRecord& r) {
+	memset(&r, 0, sizeof r);
+
+	n->uuid.toBytes(r.uuid);
+	r.ip = inet_addr(n->ip.c_str());
+	r.port = n->port;
+	r.bulkPort = n->bulkPort;
+	r.latency = n->latency;
+	r.bandwidth = n->bandwidth;
+}
+
+static void fromRecord(const SnapshotRecord& r, NeighborInfo* n) {
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &r.ip, ip, INET_ADDRSTRLEN);
+
+	n->uuid = NodeId::fromBytes(r.uuid);
+	n->ip = std::string(ip);
+	n->port = r.port;
+	n->bulkPort = r.bulkPort;
+	n->latency = r.latency;
+	n->bandwidth = r.bandwidth;
+}
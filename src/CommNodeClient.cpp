@@ -0,0 +1,203 @@
+#include "CommNodeClient.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+/**
+ * Constructor
+ */
+CommNodeClient::CommNodeClient() : fd(-1), shared(NULL), toNodeBell(-1),
+		fromNodeBell(-1) {
+}
+
+CommNodeClient::~CommNodeClient() {
+	close();
+}
+
+bool CommNodeClient::connect(const std::string& path) {
+	close();
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path)
+		return false;
+	strcpy(addr.sun_path, path.c_str());
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0 || ::connect(fd, (sockaddr*)&addr, sizeof addr) < 0) {
+		close();
+		return false;
+	}
+
+	//The region, the doorbell we ring and the one the daemon rings
+	std::string reply;
+	std::vector<int> fds;
+	if (!request("attach", reply, &fds) || reply != "ok" || fds.size() != 3) {
+		for (int it : fds)
+			::close(it);
+		close();
+		return false;
+	}
+
+	void* map = mmap(NULL, sizeof(ClientShared), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fds[0], 0);
+	::close(fds[0]);
+	toNodeBell = fds[1];
+	fromNodeBell = fds[2];
+	if (map == MAP_FAILED) {
+		close();
+		return false;
+	}
+
+	shared = static_cast<ClientShared*>(map);
+	if (shared->magic != ClientShared::MAGIC ||
+			shared->version != ClientShared::VERSION) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void CommNodeClient::close() {
+	if (shared != NULL)
+		munmap(shared, sizeof(ClientShared));
+	if (fd >= 0)
+		::close(fd);
+	if (toNodeBell >= 0)
+		::close(toNodeBell);
+	if (fromNodeBell >= 0)
+		::close(fromNodeBell);
+
+	shared = NULL;
+	fd = toNodeBell = fromNodeBell = -1;
+}
+
+bool CommNodeClient::getNodeId(NodeId& id) {
+	std::string reply;
+	return request("id", reply) && reply.compare(0, 3, "ok ") == 0 &&
+		NodeId::parse(reply.substr(3), id);
+}
+
+bool CommNodeClient::getMembers(std::vector<NodeId>& members,
+		bool linkedOnly) {
+	std::string reply;
+	if (!request(linkedOnly ? "links" : "members", reply) ||
+			reply.compare(0, 2, "ok") != 0)
+		return false;
+
+	members.clear();
+	std::stringstream ss(reply.substr(2));
+	std::string word;
+	while (ss >> word) {
+		NodeId id;
+		if (NodeId::parse(word, id))
+			members.push_back(id);
+	}
+	return true;
+}
+
+bool CommNodeClient::subscribe(const std::string& topic) {
+	std::string reply;
+	return request("subscribe " + topic, reply) && reply == "ok";
+}
+
+bool CommNodeClient::unsubscribe(const std::string& topic) {
+	std::string reply;
+	return request("unsubscribe " + topic, reply) && reply == "ok";
+}
+
+bool CommNodeClient::send(const NodeId& to, const std::string& topic,
+		const std::string& payload) {
+	if (shared == NULL || topic.empty() ||
+			topic.size() + payload.size() > CLIENT_MAX_MESSAGE)
+		return false;
+
+	ClientMessage m;
+	to.toBytes(m.peer);
+	m.topicLen = topic.size();
+	m.payloadLen = payload.size();
+	memcpy(m.data, topic.data(), topic.size());
+	memcpy(m.data + topic.size(), payload.data(), payload.size());
+
+	std::lock_guard<std::mutex> lock(sendMutex);
+	return shared->toNode.push(m, toNodeBell);
+}
+
+bool CommNodeClient::receive(Message& m, int timeoutMs) {
+	if (shared == NULL)
+		return false;
+
+	ClientMessage cm;
+	ClientRing& ring = shared->fromNode;
+	while (!ring.pop(cm)) {
+		if (!ring.wait(fromNodeBell, timeoutMs))
+			return false;
+	}
+
+	m.from = NodeId::fromBytes(cm.peer);
+	m.topic.assign(cm.data, cm.topicLen);
+	m.payload.assign(cm.data + cm.topicLen, cm.payloadLen);
+	return true;
+}
+
+/**
+ * Sends one request packet and reads the reply packet, with any
+ * descriptors passed along with it
+ */
+bool CommNodeClient::request(const std::string& req, std::string& reply,
+		std::vector<int>* fds) {
+	std::lock_guard<std::mutex> lock(requestMutex);
+	if (fd < 0 || ::send(fd, req.data(), req.size(), MSG_NOSIGNAL) < 0)
+		return false;
+
+	//Size the buffer to the reply, which can list every member
+	char peek;
+	ssize_t len;
+	do {
+		len = recv(fd, &peek, 1, MSG_PEEK | MSG_TRUNC);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return false;
+
+	std::vector<char> buf(len);
+	iovec iov;
+	iov.iov_base = buf.data();
+	iov.iov_len = buf.size();
+
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	do {
+		len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return false;
+
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+		for (size_t i = 0; i < n; i++) {
+			if (fds != NULL)
+				fds->push_back(received[i]);
+			else
+				::close(received[i]);
+		}
+	}
+
+	reply.assign(buf.data(), len);
+	return true;
+}
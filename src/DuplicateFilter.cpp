@@ -0,0 +1,45 @@
+#include "DuplicateFilter.h"
+#include <algorithm>
+
+//Tables are twice CAPACITY so probes stay short. Key 0 marks an empty slot.
+static const size_t SLOTS = DuplicateFilter::CAPACITY * 2;
+
+DuplicateFilter::DuplicateFilter(int64_t windowNanos) : current(SLOTS, 0), 
+		previous(SLOTS, 0), halfWindow(windowNanos / 2) {
+}
+
+bool DuplicateFilter::check(uint64_t key, int64_t now) {
+	if (key == 0)
+		key = 1;
+	if (now - rotated >= halfWindow || count >= CAPACITY)
+		rotate(now);
+
+	if (contains(current, key) || contains(previous, key))
+		return true;
+
+	size_t i = key & (SLOTS - 1);
+	while (current[i] != 0)
+		i = (i + 1) & (SLOTS - 1);
+	current[i] = key;
+	count++;
+	return false;
+}
+
+bool DuplicateFilter::contains(const std::vector<uint64_t>& table, 
+		uint64_t key) const {
+	for (size_t i = key & (SLOTS - 1); table[i] != 0; i = (i + 1) & (SLOTS - 1)) {
+		if (table[i] == key)
+			return true;
+	}
+	return false;
+}
+
+void DuplicateFilter::rotate(int64_t now) {
+	//If nothing arrived for a whole window, the older table is stale too
+	if (now - rotated >= 2 * halfWindow)
+		std::fill(current.begin(), current.end(), 0);
+	current.swap(previous);
+	std::fill(current.begin(), current.end(), 0);
+	count = 0;
+	rotated = now;
+}
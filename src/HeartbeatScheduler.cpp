@@ -0,0 +1,39 @@
+#include "HeartbeatScheduler.h"
+#include <algorithm>
+
+/**
+ * A new node starts out churned, so it is heard quickly
+ */
+HeartbeatScheduler::HeartbeatScheduler(int64_t minNanos, int64_t maxNanos,
+		double b) : churned(true), minInterval(std::max(minNanos, (int64_t)1)),
+		maxInterval(std::max(maxNanos, minInterval)), budget(b),
+		interval(minInterval), last(0), next(0), scheduled(minInterval),
+		rng(std::random_device()()) {
+}
+
+bool HeartbeatScheduler::due(int64_t now, int members) {
+	if (churned.exchange(false)) {
+		interval = minInterval;
+		next = std::min(next, last + std::max(minInterval,
+			budgetInterval(members)));
+	}
+	return now >= next;
+}
+
+int64_t HeartbeatScheduler::sent(int64_t now, int members) {
+	std::uniform_real_distribution<double> jitter(1 - JITTER, 1 + JITTER);
+	int64_t gap = (int64_t)(std::max(interval, budgetInterval(members)) *
+		jitter(rng));
+
+	last = now;
+	next = now + gap;
+	scheduled = gap;
+	interval = std::min(interval * 2, maxInterval);
+	return gap;
+}
+
+int64_t HeartbeatScheduler::budgetInterval(int members) const {
+	if (budget <= 0)
+		return 0;
+	return (int64_t)(members / budget * 1e9);
+}
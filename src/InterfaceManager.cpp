@@ -0,0 +1,311 @@
+#include "InterfaceManager.h"
+#include "CommNodeLog.h"
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+//Large enough for a full dump message batch from the kernel
+static const int NETLINK_BUF_SIZE = 16384;
+//Times a dump the kernel refuses is asked for before we give up
+static const int DUMP_ATTEMPTS = 3;
+//Wait after a netlink read error before reading again
+static const int READ_RETRY_SECS = 1;
+
+/**
+ * Constructor
+ */
+InterfaceManager::InterfaceManager(std::vector<std::string> wanted) :
+		wantedNames(wanted), snapshot(std::make_shared<Snapshot>()),
+		generation(0), running(false), netlinkFD(-1), dumpSeq(0),
+		dumping(false), dumpFailed(false) {
+}
+
+InterfaceManager::~InterfaceManager() {
+	stop();
+}
+
+/**
+ * Opens the rtnetlink socket, loads the current address table and starts the
+ * thread that applies address change events.
+ */
+void InterfaceManager::start() {
+	netlinkFD = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netlinkFD < 0)
+		cnLog->exitWithError("Unable to create netlink socket");
+
+	sockaddr_nl local;
+	memset(&local, 0, sizeof local);
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_IPV4_IFADDR;
+
+	if (bind(netlinkFD, (sockaddr*)&local, sizeof local) < 0)
+		cnLog->exitWithError("Unable to bind netlink socket");
+
+	//Wake up once a second so stop() doesn't have to wait on an event
+	timeval tv;
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(netlinkFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	//Load the initial table synchronously so callers have broadcast domains
+	//as soon as start() returns
+	char buf[NETLINK_BUF_SIZE];
+	for (int attempt = 1; ; attempt++) {
+		requestDump();
+		unsigned long gen = generation;
+		while (generation == gen && !dumpFailed) {
+			int len = recv(netlinkFD, buf, sizeof buf, 0);
+			if (len < 0) {
+				if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+					continue;
+				cnLog->exitWithError("Error reading initial interface table");
+			}
+			processMessages(buf, len);
+		}
+
+		if (!dumpFailed)
+			break;
+		if (attempt == DUMP_ATTEMPTS)
+			cnLog->exitWithError("Unable to load the initial interface table");
+	}
+
+	running = true;
+	int ret = pthread_create(&netlinkThread, NULL,
+		&InterfaceManager::handleNetlink, this);
+	if (ret)
+		cnLog->exitWithError("Error creating netlink thread");
+}
+
+void InterfaceManager::stop() {
+	if (!running)
+		return;
+
+	running = false;
+	pthread_join(netlinkThread, NULL);
+	close(netlinkFD);
+	netlinkFD = -1;
+}
+
+bool InterfaceManager::isLocal(in_addr_t addr) {
+	std::shared_ptr<const Snapshot> snap = std::atomic_load(&snapshot);
+	return snap->local.count(addr) != 0;
+}
+
+std::vector<InterfaceAddr> InterfaceManager::getBroadcastDomains() {
+	std::shared_ptr<const Snapshot> snap = std::atomic_load(&snapshot);
+	return snap->addrs;
+}
+
+/**
+ * Asks the kernel for every IPv4 address. The replies are parsed the same way
+ * as unsolicited events, starting from an empty table. The last complete
+ * table is kept in case the dump fails.
+ */
+void InterfaceManager::requestDump() {
+	struct {
+		nlmsghdr hdr;
+		ifaddrmsg msg;
+	} req;
+
+	memset(&req, 0, sizeof req);
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(ifaddrmsg));
+	req.hdr.nlmsg_type = RTM_GETADDR;
+	req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.hdr.nlmsg_seq = ++dumpSeq;
+	req.msg.ifa_family = AF_INET;
+
+	sockaddr_nl kernel;
+	memset(&kernel, 0, sizeof kernel);
+	kernel.nl_family = AF_NETLINK;
+
+	if (!dumping)
+		previous.swap(current);
+	current.clear();
+	dumping = true;
+	dumpFailed = false;
+	if (sendto(netlinkFD, &req, req.hdr.nlmsg_len, 0, (sockaddr*)&kernel,
+			sizeof kernel) < 0) {
+		cnLog->exitWithError("Unable to request interface dump");
+	}
+}
+
+/**
+ * Applies a batch of RTM_NEWADDR/RTM_DELADDR messages to the table. A new
+ * snapshot is published when the batch changed something, but never while a
+ * dump is only partially applied. A dump the kernel answers with an error
+ * sets dumpFailed and stays unfinished, so the last snapshot is kept until
+ * the caller asks again.
+ */
+void InterfaceManager::processMessages(char* buf, int len) {
+	bool changed = false;
+
+	for (nlmsghdr* nh = (nlmsghdr*)buf; NLMSG_OK(nh, (unsigned int)len);
+			nh = NLMSG_NEXT(nh, len)) {
+		//Errors come as NLMSG_ERROR, or as a negative status in NLMSG_DONE
+		int error = 0;
+		if (nh->nlmsg_type == NLMSG_ERROR &&
+				nh->nlmsg_len >= NLMSG_LENGTH(sizeof(nlmsgerr)))
+			error = ((nlmsgerr*)NLMSG_DATA(nh))->error;
+		else if (nh->nlmsg_type == NLMSG_DONE &&
+				nh->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+			error = *(int*)NLMSG_DATA(nh);
+
+		if (error != 0 && dumping && nh->nlmsg_seq == dumpSeq) {
+			cnLog->warning("Interface dump failed: " +
+				std::string(strerror(-error)));
+			dumpFailed = true;
+			continue;
+		}
+		if (nh->nlmsg_type == NLMSG_DONE && dumping && !dumpFailed) {
+			dumping = false;
+			changed = true;
+			continue;
+		}
+
+		if (nh->nlmsg_type != RTM_NEWADDR && nh->nlmsg_type != RTM_DELADDR)
+			continue;
+
+		ifaddrmsg* ifa = (ifaddrmsg*)NLMSG_DATA(nh);
+		if (ifa->ifa_family != AF_INET)
+			continue;
+
+		InterfaceAddr entry;
+		entry.index = ifa->ifa_index;
+		entry.addr = 0;
+		entry.broadcast = 0;
+
+		int attrLen = IFA_PAYLOAD(nh);
+		for (rtattr* rta = IFA_RTA(ifa); RTA_OK(rta, attrLen);
+				rta = RTA_NEXT(rta, attrLen)) {
+			if (rta->rta_type == IFA_LOCAL) {
+				memcpy(&entry.addr, RTA_DATA(rta), sizeof entry.addr);
+			} else if (rta->rta_type == IFA_ADDRESS && entry.addr == 0) {
+				memcpy(&entry.addr, RTA_DATA(rta), sizeof entry.addr);
+			} else if (rta->rta_type == IFA_BROADCAST) {
+				memcpy(&entry.broadcast, RTA_DATA(rta), sizeof entry.broadcast);
+			} else if (rta->rta_type == IFA_LABEL) {
+				entry.name = std::string((char*)RTA_DATA(rta));
+			}
+		}
+
+		if (entry.name.empty()) {
+			char name[IF_NAMESIZE];
+			if (if_indextoname(entry.index, name) != NULL)
+				entry.name = std::string(name);
+		}
+
+		auto it = std::find_if(current.begin(), current.end(),
+			[&entry](const InterfaceAddr& a) {
+				return a.index == entry.index && a.addr == entry.addr;
+			});
+
+		if (nh->nlmsg_type == RTM_DELADDR) {
+			if (it != current.end()) {
+				current.erase(it);
+				changed = true;
+			}
+		} else if (it == current.end()) {
+			current.push_back(entry);
+			changed = true;
+		} else if (it->broadcast != entry.broadcast) {
+			*it = entry;
+			changed = true;
+		}
+	}
+
+	if (changed && !dumping)
+		publish();
+}
+
+/**
+ * Builds a new read-only snapshot from the table and swaps it in
+ */
+void InterfaceManager::publish() {
+	std::shared_ptr<Snapshot> snap = std::make_shared<Snapshot>();
+
+	for (auto& it : current) {
+		snap->local.insert(it.addr);
+
+		if (it.broadcast != 0 && it.name != "lo" && isWanted(it.name))
+			snap->addrs.push_back(it);
+	}
+
+	std::atomic_store(&snapshot, std::shared_ptr<const Snapshot>(snap));
+	generation++;
+
+	std::stringstream ss;
+	ss << "Interface table updated, broadcasting on";
+	for (auto& it : snap->addrs) {
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &it.broadcast, ip, INET_ADDRSTRLEN);
+		ss << " " << it.name << "(" << ip << ")";
+	}
+	cnLog->debug(ss.str());
+}
+
+bool InterfaceManager::isWanted(const std::string& name) {
+	if (wantedNames.empty())
+		return true;
+
+	return std::find(wantedNames.begin(), wantedNames.end(), name) !=
+		wantedNames.end();
+}
+
+/**
+ * Applies address events until stop() is called. If the socket buffer
+ * overflows we lose events, so the table is reloaded from scratch. A reload
+ * the kernel refuses is asked for again a few times; after that we go back
+ * to the last complete table and apply events to it until the next overrun.
+ */
+void* InterfaceManager::handleNetlink() {
+	char buf[NETLINK_BUF_SIZE];
+	int attempts = 0;
+	bool readFailing = false;
+
+	while (running) {
+		int len = recv(netlinkFD, buf, sizeof buf, 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				continue;
+			} else if (errno == ENOBUFS) {
+				cnLog->warning("Netlink buffer overrun, reloading interfaces");
+				attempts = 1;
+				requestDump();
+				continue;
+			}
+
+			//Whatever broke the socket is unlikely to clear up right away
+			if (!readFailing) {
+				cnLog->error("Error reading from netlink socket: " +
+					std::string(strerror(errno)));
+			}
+			readFailing = true;
+			sleep(READ_RETRY_SECS);
+			continue;
+		}
+		readFailing = false;
+		processMessages(buf, len);
+
+		if (dumpFailed) {
+			dumpFailed = false;
+			if (attempts < DUMP_ATTEMPTS) {
+				attempts++;
+				requestDump();
+			} else {
+				cnLog->error("Unable to reload interfaces, keeping the last table");
+				current.swap(previous);
+				dumping = false;
+			}
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,290 @@
+#include "LatencyMatrix.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <stdlib.h>
+
+static const char DIGITS[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const int MAX_LEVEL = 63;
+//A step only changes once the value is this far past its middle, so a
+//value sitting on the boundary doesn't flap
+static const double HYSTERESIS = 0.75;
+
+static int digitValue(char c) {
+	const char* p = (const char*)memchr(DIGITS, c, 64);
+	return c == '\0' || p == NULL ? -1 : p - DIGITS;
+}
+
+static std::string toBase36(uint64_t v) {
+	char buf[16];
+	int i = sizeof buf;
+	do {
+		buf[--i] = "0123456789abcdefghijklmnopqrstuvwxyz"[v % 36];
+		v /= 36;
+	} while (v != 0);
+	return std::string(buf + i, sizeof buf - i);
+}
+
+LatencyMatrix::LatencyMatrix(const NodeId& id) : self(key(id)) {
+}
+
+uint64_t LatencyMatrix::key(const NodeId& id) {
+	return id.hash() & ((1ULL << (6 * KEY_CHARS)) - 1);
+}
+
+double LatencyMatrix::dequantize(int level, double min) {
+	return min * pow(STEP, level - 1);
+}
+
+/**
+ * The step value falls in, or current if it's still close to that
+ */
+int LatencyMatrix::level(double value, double min, int current) {
+	if (value <= min)
+		return 1;
+	double exact = 1 + log(value / min) / log(STEP);
+	if (current > 0 && fabs(exact - current) < HYSTERESIS)
+		return current;
+	return std::min((int)lround(exact), MAX_LEVEL);
+}
+
+bool LatencyMatrix::setLocal(const std::vector<Sample>& samples, int64_t now) {
+	Row& own = rows[self];
+	uint64_t next = std::max(own.version + 1, (uint64_t)(now / 1000000));
+	bool changed = false;
+
+	std::unordered_map<uint64_t, bool> seen;
+	for (auto& s : samples) {
+		if (s.roundTrip < 0 || s.to == self)
+			continue;
+		seen[s.to] = true;
+
+		auto it = own.entries.find(s.to);
+		int oldLatency = it == own.entries.end() ? 0 : it->second.latency;
+		int oldBandwidth = it == own.entries.end() ? 0 : it->second.bandwidth;
+		int latency = level(s.roundTrip / 1000.0, MIN_LATENCY_US, oldLatency);
+		int bandwidth = level(s.bandwidth, MIN_BANDWIDTH_KBPS, oldBandwidth);
+		if (latency == oldLatency && bandwidth == oldBandwidth)
+			continue;
+
+		Entry& e = own.entries[s.to];
+		e.latency = latency;
+		e.bandwidth = bandwidth;
+		e.changed = next;
+		changed = true;
+	}
+
+	//Links that went away stay as removals until every link has been told
+	for (auto& it : own.entries) {
+		if (it.second.latency != 0 && seen.count(it.first) == 0) {
+			it.second.latency = 0;
+			it.second.bandwidth = 0;
+			it.second.changed = next;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		own.version = next;
+	return changed;
+}
+
+bool LatencyMatrix::apply(const char* frame) {
+	size_t len = strnlen(frame, FRAME_SIZE);
+	if (len < 4 || memcmp(frame, "lat ", 4) != 0)
+		return false;
+
+	const char* p = frame + 4;
+	const char* end = frame + len;
+	while (p < end) {
+		if (*p == ' ') {
+			p++;
+			continue;
+		}
+		const char* segEnd = (const char*)memchr(p, ' ', end - p);
+		if (segEnd == NULL)
+			segEnd = end;
+
+		//<row>:<base>:<version>:<entries>
+		uint64_t row;
+		if (segEnd - p < KEY_CHARS + 1 || !parseKey(p, row) ||
+				p[KEY_CHARS] != ':')
+			return false;
+		char* next;
+		uint64_t base = strtoull(p + KEY_CHARS + 1, &next, 36);
+		if (next >= segEnd || *next != ':')
+			return false;
+		uint64_t version = strtoull(next + 1, &next, 36);
+		if (next >= segEnd || *next != ':')
+			return false;
+		const char* entries = next + 1;
+		if ((segEnd - entries) % ENTRY_CHARS != 0)
+			return false;
+		p = segEnd;
+
+		//Our own row only changes in setLocal(). A copy we're ahead of, or one
+		//that skips versions we haven't seen, is left alone.
+		if (row == self)
+			continue;
+		auto found = rows.find(row);
+		uint64_t have = found == rows.end() ? 0 : found->second.version;
+		if (version < have || (base != 0 && base > have))
+			continue;
+
+		//A whole row removes what it doesn't mention. They are kept as
+		//removals, so the neighbors we pass the row on to hear of them.
+		Row& r = found == rows.end() ? rows[row] : found->second;
+		if (base == 0) {
+			for (auto& it : r.entries) {
+				it.second.latency = 0;
+				it.second.bandwidth = 0;
+				it.second.changed = version;
+			}
+		}
+		r.version = version;
+		for (const char* e = entries; e < segEnd; e += ENTRY_CHARS) {
+			uint64_t to;
+			int latency = digitValue(e[KEY_CHARS]);
+			int bandwidth = digitValue(e[KEY_CHARS + 1]);
+			if (!parseKey(e, to) || latency < 0 || bandwidth < 0)
+				return false;
+
+			Entry& entry = r.entries[to];
+			entry.latency = latency;
+			entry.bandwidth = latency == 0 ? 0 : bandwidth;
+			entry.changed = version;
+		}
+	}
+	return true;
+}
+
+std::vector<std::string> LatencyMatrix::deltasFor(int link) {
+	std::vector<std::string> frames;
+	std::string frame = "lat";
+	auto flush = [&frames, &frame]() {
+		if (frame.size() > 3) {
+			frame.resize(FRAME_SIZE, '\0');
+			frames.push_back(frame);
+		}
+		frame = "lat";
+	};
+
+	std::unordered_map<uint64_t, uint64_t>& linkSent = sent[link];
+	for (auto& it : rows) {
+		Row& r = it.second;
+		uint64_t& have = linkSent[it.first];
+		if (r.version <= have)
+			continue;
+
+		//A whole row leaves out removals, since it replaces what they have
+		std::vector<std::pair<const uint64_t, Entry>*> changed;
+		for (auto& e : r.entries) {
+			if (e.second.changed > have && (have != 0 || e.second.latency != 0))
+				changed.push_back(&e);
+		}
+
+		uint64_t base = have;
+		size_t next = 0;
+		while (true) {
+			//Room for the header and at least one entry, or start a new frame
+			std::string header;
+			appendKey(header, it.first);
+			header += ":" + toBase36(base) + ":" + toBase36(r.version) + ":";
+			if (frame.size() + 1 + header.size() + ENTRY_CHARS > FRAME_SIZE - 1 &&
+					frame.size() > 3)
+				flush();
+
+			frame += " " + header;
+			size_t room = (FRAME_SIZE - 1 - frame.size()) / ENTRY_CHARS;
+			size_t fit = std::min(room, changed.size() - next);
+			for (size_t i = 0; i < fit; i++, next++) {
+				const Entry& e = changed[next]->second;
+				appendKey(frame, changed[next]->first);
+				frame += DIGITS[e.latency];
+				frame += DIGITS[e.bandwidth];
+			}
+			if (next == changed.size())
+				break;
+
+			//The rest only applies on top of what came before
+			flush();
+			base = r.version;
+		}
+
+		have = r.version;
+	}
+	flush();
+	return frames;
+}
+
+void LatencyMatrix::dropLink(int link) {
+	sent.erase(link);
+}
+
+/**
+ * Its row goes, and so do the entries for links to it. Removals are only
+ * kept while the node they refer to is around, so rows don't grow past the
+ * size of the cluster.
+ */
+void LatencyMatrix::forget(uint64_t node) {
+	rows.erase(node);
+	for (auto& it : rows)
+		it.second.entries.erase(node);
+	for (auto& it : sent)
+		it.second.erase(node);
+}
+
+bool LatencyMatrix::get(uint64_t from, uint64_t to, Cell& cell) const {
+	auto row = rows.find(from);
+	if (row == rows.end())
+		return false;
+	auto e = row->second.entries.find(to);
+	if (e == row->second.entries.end() || e->second.latency == 0)
+		return false;
+
+	cell.from = from;
+	cell.to = to;
+	cell.latencyMs = dequantize(e->second.latency, MIN_LATENCY_US) / 1000;
+	cell.bandwidthKbps = dequantize(e->second.bandwidth, MIN_BANDWIDTH_KBPS);
+	return true;
+}
+
+std::vector<LatencyMatrix::Cell> LatencyMatrix::getCells() const {
+	std::vector<Cell> cells;
+	for (auto& row : rows) {
+		for (auto& e : row.second.entries) {
+			Cell c;
+			if (get(row.first, e.first, c))
+				cells.push_back(c);
+		}
+	}
+	return cells;
+}
+
+size_t LatencyMatrix::getEntries() const {
+	size_t n = 0;
+	for (auto& row : rows) {
+		for (auto& e : row.second.entries) {
+			if (e.second.latency != 0)
+				n++;
+		}
+	}
+	return n;
+}
+
+void LatencyMatrix::appendKey(std::string& out, uint64_t key) {
+	for (int i = KEY_CHARS - 1; i >= 0; i--)
+		out += DIGITS[(key >> (6 * i)) & 63];
+}
+
+bool LatencyMatrix::parseKey(const char* in, uint64_t& key) {
+	key = 0;
+	for (int i = 0; i < KEY_CHARS; i++) {
+		int d = digitValue(in[i]);
+		if (d < 0)
+			return false;
+		key = (key << 6) | d;
+	}
+	return true;
+}
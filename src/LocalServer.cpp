@@ -0,0 +1,396 @@
+#include "LocalServer.h"
+#include "CommNodeLog.h"
+#include "Metrics.h"
+#include "UpgradeHandoff.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <boost/filesystem.hpp>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+static_assert(CLIENT_MAX_MESSAGE == CommNode::MAX_MESSAGE,
+	"A client message has to fit in a frame");
+
+//Requests are a word and a topic
+static const int REQUEST_SIZE = 256;
+//Socket events handled per epoll_wait
+static const int MAX_EVENTS = 64;
+//How often a stalled client's next message looks for room
+static const int STALL_RETRY_MS = 1;
+
+/**
+ * Constructor
+ */
+LocalServer::LocalServer(CommNode& n, const std::string& p) : node(n),
+		path(p), listenerFD(-1), epollFD(-1), wakeFD(-1), running(false),
+		received(0) {
+}
+
+LocalServer::~LocalServer() {
+	stop();
+}
+
+/**
+ * Binds the control socket, replacing any left behind by an earlier run,
+ * and starts the client thread
+ */
+bool LocalServer::start() {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path) {
+		cnLog->warning("Client socket path is too long: " + path);
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(
+		boost::filesystem::path(path).parent_path(), ec);
+	unlink(path.c_str());
+
+	listenerFD = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		0);
+	if (listenerFD < 0 || bind(listenerFD, (sockaddr*)&addr, sizeof addr) < 0 ||
+			listen(listenerFD, 16) < 0) {
+		cnLog->error("Unable to listen for clients on " + path);
+		if (listenerFD >= 0)
+			close(listenerFD);
+		listenerFD = -1;
+		return false;
+	}
+	chmod(path.c_str(), 0660);
+
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = listenerFD;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, listenerFD, &ev);
+	ev.data.fd = wakeFD;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeFD, &ev);
+
+	Metrics::registerGauge("local_clients",
+		"Programs attached through the client socket", [this]() {
+			return (double)getClients();
+		}, node.getGaugeLabel());
+
+	running = true;
+	int ret = pthread_create(&thread, NULL, &LocalServer::handleClients, this);
+	if (ret)
+		cnLog->exitWithError("Error creating client thread");
+
+	cnLog->debug("Serving clients on " + path);
+	return true;
+}
+
+void LocalServer::stop() {
+	if (!running)
+		return;
+
+	running = false;
+	uint64_t one = 1;
+	ssize_t ret = write(wakeFD, &one, sizeof one);
+	(void)ret;
+	pthread_join(thread, NULL);
+	Metrics::unregisterGauge("local_clients", node.getGaugeLabel());
+
+	std::vector<Client*> all;
+	for (auto& it : clients)
+		all.push_back(it.second.get());
+	for (auto c : all)
+		dropClient(c);
+
+	close(listenerFD);
+	close(epollFD);
+	close(wakeFD);
+	listenerFD = -1;
+	unlink(path.c_str());
+}
+
+int LocalServer::getClients() {
+	std::lock_guard<std::mutex> lock(clientMutex);
+	return clients.size();
+}
+
+void* LocalServer::handleClients() {
+	epoll_event events[MAX_EVENTS];
+
+	while (running) {
+		int n = epoll_wait(epollFD, events, MAX_EVENTS, 
+			stalled.empty() ? -1 : STALL_RETRY_MS);
+
+		//Their doorbells stay quiet until we're done with their rings
+		std::vector<int> retry(stalled.begin(), stalled.end());
+		for (int bell : retry) {
+			if (doorbells.count(bell) != 0)
+				drain(doorbells[bell]);
+		}
+
+		for (int i = 0; i < n && running; i++) {
+			int fd = events[i].data.fd;
+			if (fd == wakeFD)
+				continue;
+			if (fd == listenerFD) {
+				acceptClient();
+				continue;
+			}
+
+			//Only this thread changes the maps, so no lock is needed to read them
+			auto bell = doorbells.find(fd);
+			if (bell != doorbells.end()) {
+				drain(bell->second);
+				continue;
+			}
+
+			auto it = clients.find(fd);
+			if (it != clients.end() && !handleRequest(it->second.get()))
+				dropClient(it->second.get());
+		}
+	}
+	return NULL;
+}
+
+void LocalServer::acceptClient() {
+	int fd;
+	while ((fd = accept4(listenerFD, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		auto c = std::make_shared<Client>();
+		c->fd = fd;
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev);
+
+		std::lock_guard<std::mutex> lock(clientMutex);
+		clients[fd] = c;
+	}
+}
+
+/**
+ * Answers one request. Returns false once the client has gone.
+ */
+bool LocalServer::handleRequest(Client* c) {
+	char req[REQUEST_SIZE];
+	ssize_t len = recv(c->fd, req, sizeof req - 1, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	if (len <= 0)
+		return false;
+	req[len] = '\0';
+
+	std::string str(req);
+	std::string word = str.substr(0, str.find(' '));
+	std::string arg = str.find(' ') == std::string::npos ? "" :
+		str.substr(str.find(' ') + 1);
+
+	std::string reply;
+	int fds[3];
+	int numFDs = 0;
+	if (word == "attach") {
+		reply = attach(c, fds);
+		numFDs = reply == "ok" ? 3 : 0;
+	} else if (word == "id") {
+		reply = "ok " + node.getUUID().toString();
+	} else if (word == "members" || word == "links") {
+		reply = "ok";
+		for (auto& id : node.getMembers(word == "links"))
+			reply += " " + id.toString();
+	} else if (word == "subscribe" && !arg.empty()) {
+		subscribe(c, arg);
+		reply = "ok";
+	} else if (word == "unsubscribe" && !arg.empty()) {
+		unsubscribe(c, arg);
+		reply = "ok";
+	} else {
+		reply = "error unknown request";
+	}
+
+	bool ok = UpgradeHandoff::sendFds(c->fd, fds, numFDs, reply.data(),
+		reply.size());
+	if (numFDs > 0) {
+		//The client has its own copy of the region now
+		close(fds[0]);
+	}
+	return ok;
+}
+
+/**
+ * Creates the client's shared memory and doorbells. On success fds holds
+ * the region, the doorbell the client rings and the one we ring.
+ */
+std::string LocalServer::attach(Client* c, int* fds) {
+	if (c->shared != NULL)
+		return "error already attached";
+
+	int memFD = memfd_create("commnode-client", MFD_CLOEXEC);
+	if (memFD < 0 || ftruncate(memFD, sizeof(ClientShared)) < 0) {
+		if (memFD >= 0)
+			close(memFD);
+		cnLog->error("Unable to create client shared memory");
+		return "error no shared memory";
+	}
+
+	void* map = mmap(NULL, sizeof(ClientShared), PROT_READ | PROT_WRITE,
+		MAP_SHARED, memFD, 0);
+	if (map == MAP_FAILED) {
+		close(memFD);
+		cnLog->error("Unable to map client shared memory");
+		return "error no shared memory";
+	}
+
+	ClientShared* shared = static_cast<ClientShared*>(map);
+	shared->init();
+	int toNode = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int fromNode = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = toNode;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, toNode, &ev);
+
+	{
+		std::lock_guard<std::mutex> lock(clientMutex);
+		c->shared = shared;
+		c->toNodeBell = toNode;
+		c->fromNodeBell = fromNode;
+		doorbells[toNode] = c;
+	}
+
+	//We're asleep until the client rings
+	shared->toNode.prepareWait();
+
+	fds[0] = memFD;
+	fds[1] = toNode;
+	fds[2] = fromNode;
+	return "ok";
+}
+
+/**
+ * Sends everything on the client's ring, then goes back to sleep on its
+ * doorbell. A client that outruns a neighbor waits in its ring, as it would
+ * for a socket, rather than having its messages refused: the message stays
+ * put until the neighbor has room, or for at most a connect timeout, and
+ * the other clients carry on meanwhile.
+ */
+void LocalServer::drain(Client* c) {
+	uint64_t count;
+	ssize_t ret = read(c->toNodeBell, &count, sizeof count);
+	(void)ret;
+
+	ClientRing& ring = c->shared->toNode;
+	const ClientMessage* m;
+	do {
+		while ((m = ring.front()) != NULL) {
+			NodeId to = NodeId::fromBytes(m->peer);
+			if (!node.hasRoom(to)) {
+				int64_t now = ClockSync::now();
+				if (c->stalledSince == 0)
+					c->stalledSince = now;
+				if (now - c->stalledSince < 
+						(int64_t)CommNode::CONNECT_TIMEOUT_MS * 1000000) {
+					stalled.insert(c->toNodeBell);
+					return;
+				}
+			}
+			c->stalledSince = 0;
+			stalled.erase(c->toNodeBell);
+
+			received++;
+			if (m->topicLen != 0 &&
+					m->topicLen + m->payloadLen <= CLIENT_MAX_MESSAGE) {
+				std::string topic(m->data, m->topicLen);
+				std::string payload(m->data + m->topicLen, m->payloadLen);
+				if (to.isNil())
+					node.publish(topic, payload);
+				else
+					node.send(to, topic, payload);
+			}
+			ring.popFront();
+		}
+	} while (!ring.prepareWait());
+}
+
+void LocalServer::dropClient(Client* c) {
+	while (!c->topics.empty())
+		unsubscribe(c, *c->topics.begin());
+
+	std::shared_ptr<Client> keep;
+	{
+		std::lock_guard<std::mutex> lock(clientMutex);
+		keep = clients[c->fd];
+		clients.erase(c->fd);
+		doorbells.erase(c->toNodeBell);
+	}
+	stalled.erase(c->toNodeBell);
+
+	//Closing a descriptor takes it out of the epoll set
+	close(c->fd);
+	if (c->shared != NULL) {
+		munmap(c->shared, sizeof(ClientShared));
+		close(c->toNodeBell);
+		close(c->fromNodeBell);
+	}
+}
+
+void LocalServer::subscribe(Client* c, const std::string& topic) {
+	std::lock_guard<std::mutex> lock(clientMutex);
+	if (!c->topics.insert(topic).second)
+		return;
+
+	if (subscribers[topic]++ == 0) {
+		node.subscribe(topic, [this, topic](const NodeId& from,
+				const std::string& payload) {
+			deliver(topic, from, payload);
+		});
+	}
+}
+
+void LocalServer::unsubscribe(Client* c, const std::string& topic) {
+	std::lock_guard<std::mutex> lock(clientMutex);
+	if (c->topics.erase(topic) == 0)
+		return;
+
+	if (--subscribers[topic] == 0) {
+		subscribers.erase(topic);
+		node.unsubscribe(topic);
+	}
+}
+
+/**
+ * Puts a message on the ring of every attached client subscribed to its
+ * topic. Runs on the node's workers; a client that doesn't keep up loses
+ * messages rather than holding them up.
+ */
+void LocalServer::deliver(const std::string& topic, const NodeId& from,
+		const std::string& payload) {
+	if (topic.size() + payload.size() > CLIENT_MAX_MESSAGE)
+		return;
+
+	ClientMessage m;
+	from.toBytes(m.peer);
+	m.topicLen = topic.size();
+	m.payloadLen = payload.size();
+	memcpy(m.data, topic.data(), topic.size());
+	memcpy(m.data + topic.size(), payload.data(), payload.size());
+
+	std::lock_guard<std::mutex> lock(clientMutex);
+	for (auto& it : clients) {
+		Client* c = it.second.get();
+		if (c->shared == NULL || c->topics.count(topic) == 0)
+			continue;
+		if (!c->shared->fromNode.push(m, c->fromNodeBell))
+			Metrics::increment(Counter::ClientMessagesDropped);
+	}
+}
@@ -0,0 +1,305 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+
+static const char* COUNTER_NAMES[] = {
+	"datagrams_received",
+	"datagrams_relayed",
+	"heartbeats_sent",
+	"parse_failures",
+	"messages_received",
+	"messages_sent",
+	"bytes_read",
+	"bytes_written",
+	"neighbors_added",
+	"neighbors_removed",
+	"bulk_bytes_sent",
+	"bulk_bytes_received",
+	"bulk_chunks_rejected",
+	"bulk_transfers_completed",
+	"bulk_transfers_failed",
+	"worker_tasks_executed",
+	"worker_tasks_stolen",
+	"links_dropped",
+	"datagrams_duplicate",
+	"datagrams_rate_limited",
+	"relays_rate_limited",
+	"app_messages_sent",
+	"app_messages_delivered",
+	"client_messages_dropped",
+	"send_queue_full",
+	"messages_handed_off",
+	"matrix_frames_sent"
+};
+
+static const char* COUNTER_HELP[] = {
+	"UDP datagrams received on the discovery port",
+	"Datagrams forwarded to neighbors on this host",
+	"Heartbeat datagrams sent",
+	"Messages that could not be parsed",
+	"TCP messages received from neighbors",
+	"TCP messages written to neighbors",
+	"Bytes read from neighbor sockets",
+	"Bytes written to neighbor sockets",
+	"Neighbors added to the neighbor table",
+	"Neighbors removed from the neighbor table",
+	"File bytes sent on bulk transfer connections",
+	"File bytes received on bulk transfer connections",
+	"Bulk transfer chunks that failed their checksum",
+	"Bulk transfers finished, sent or received",
+	"Bulk transfers given up on after every retry",
+	"Tasks run by the worker pool",
+	"Tasks a worker took from another worker's queue",
+	"Neighbor connections closed to keep the number of links bounded",
+	"Datagrams dropped because we had seen them recently",
+	"Datagrams dropped because their sender went over the ingest limit",
+	"Datagrams handled but not relayed because of the relay limit",
+	"Application messages sent to neighbors",
+	"Application messages handed to a subscriber",
+	"Messages for local clients dropped because their ring was full",
+	"Application messages dropped because a neighbor's send queue was full",
+	"Application messages delivered in memory to a node in this process",
+	"Latency matrix updates written to neighbors"
+};
+
+//Histogram name, its label (if any) and help text. Histograms that share a
+//name must be next to each other.
+static const char* HISTOGRAM_NAMES[][3] = {
+	{ "mutex_wait_seconds", "mutex=\"map\"", 
+		"Time spent waiting to acquire a lock" },
+	{ "mutex_wait_seconds", "mutex=\"xfer\"", 
+		"Time spent waiting to acquire a lock" },
+	{ "mutex_wait_seconds", "mutex=\"log\"", 
+		"Time spent waiting to acquire a lock" },
+	{ "neighbor_round_trip_seconds", "", 
+		"Round trip to neighbors, less the time they took to answer" },
+	{ "neighbor_delay_seconds", "direction=\"out\"", 
+		"One-way delay to and from neighbors, corrected for clock offset" },
+	{ "neighbor_delay_seconds", "direction=\"in\"", 
+		"One-way delay to and from neighbors, corrected for clock offset" },
+	{ "send_queue_seconds", "class=\"control\"", 
+		"Time frames waited in a neighbor's send queue" },
+	{ "send_queue_seconds", "class=\"latency\"", 
+		"Time frames waited in a neighbor's send queue" },
+	{ "send_queue_seconds", "class=\"bulk\"", 
+		"Time frames waited in a neighbor's send queue" }
+};
+
+static_assert(sizeof COUNTER_NAMES / sizeof COUNTER_NAMES[0] ==
+	static_cast<size_t>(Counter::COUNT), "Every counter needs a name");
+static_assert(sizeof COUNTER_HELP / sizeof COUNTER_HELP[0] ==
+	static_cast<size_t>(Counter::COUNT), "Every counter needs help text");
+static_assert(sizeof HISTOGRAM_NAMES / sizeof HISTOGRAM_NAMES[0] ==
+	static_cast<size_t>(Histogram::COUNT), "Every histogram needs a name");
+
+struct Metrics::Gauge {
+	std::string name;
+	std::string help;
+	std::string label;
+	std::function<double()> fn;
+};
+
+/**
+ * Shared state behind the shards. It's allocated once and never freed so
+ * detached threads can still return their shards while the process exits.
+ */
+struct Metrics::Registry {
+	std::mutex lock;
+	std::vector<Shard*> live;
+	std::vector<Shard*> free;
+	Shard* retired = NULL;					//Totals from threads that have exited
+	//Held while gauges are sampled, so a gauge is only unregistered once
+	//nobody is calling it and its owner can go away
+	std::mutex gaugeLock;
+	std::vector<Gauge> gauges;			//Guarded by gaugeLock
+};
+
+Metrics::Registry& Metrics::registry() {
+	static Registry* r = new Registry();
+	return *r;
+}
+
+Metrics::Shard* Metrics::acquireShard() {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.lock);
+
+	if (r.retired == NULL) {
+		Shard* total = new Shard();
+		memset((void*)total, 0, sizeof(Shard));
+		r.retired = total;
+	}
+
+	Shard* s;
+	if (!r.free.empty()) {
+		s = r.free.back();
+		r.free.pop_back();
+	} else {
+		s = new Shard();
+		memset((void*)s, 0, sizeof(Shard));
+	}
+	r.live.push_back(s);
+	return s;
+}
+
+/**
+ * Folds an exiting thread's values into the retired totals so they aren't
+ * lost, then makes the shard available to the next thread.
+ */
+void Metrics::releaseShard(Shard* s) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.lock);
+
+	addShard(*r.retired, *s);
+	memset((void*)s, 0, sizeof(Shard));
+
+	for (auto it = r.live.begin(); it != r.live.end(); ++it) {
+		if (*it == s) {
+			r.live.erase(it);
+			break;
+		}
+	}
+	r.free.push_back(s);
+}
+
+Metrics::ShardOwner::~ShardOwner() {
+	if (shard != NULL)
+		releaseShard(shard);
+}
+
+void Metrics::addShard(Shard& total, Shard& s) {
+	auto add = [](std::atomic<uint64_t>& to, std::atomic<uint64_t>& from) {
+		to.store(to.load(std::memory_order_relaxed) +
+			from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	};
+
+	for (int i = 0; i < static_cast<int>(Counter::COUNT); i++)
+		add(total.counters[i], s.counters[i]);
+
+	for (int i = 0; i < static_cast<int>(Histogram::COUNT); i++) {
+		for (int b = 0; b <= NUM_BUCKETS; b++)
+			add(total.histograms[i].buckets[b], s.histograms[i].buckets[b]);
+		add(total.histograms[i].sum, s.histograms[i].sum);
+	}
+}
+
+void Metrics::registerGauge(const std::string& name, const std::string& help,
+		std::function<double()> fn, const std::string& label) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.gaugeLock);
+
+	Gauge g;
+	g.name = name;
+	g.help = help;
+	g.label = label;
+	g.fn = fn;
+	r.gauges.push_back(g);
+}
+
+void Metrics::unregisterGauge(const std::string& name, 
+		const std::string& label) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.gaugeLock);
+
+	for (auto it = r.gauges.begin(); it != r.gauges.end(); ++it) {
+		if (it->name == name && it->label == label) {
+			r.gauges.erase(it);
+			return;
+		}
+	}
+}
+
+uint64_t Metrics::getCounter(Counter c) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.lock);
+
+	int i = static_cast<int>(c);
+	uint64_t total = r.retired == NULL ? 0 :
+		r.retired->counters[i].load();
+	for (auto s : r.live)
+		total += s->counters[i].load();
+	return total;
+}
+
+std::string Metrics::renderPrometheus() {
+	Shard* total = new Shard();
+	memset((void*)total, 0, sizeof(Shard));
+	Registry& r = registry();
+
+	{
+		std::lock_guard<std::mutex> lock(r.lock);
+
+		if (r.retired != NULL)
+			addShard(*total, *r.retired);
+		for (auto s : r.live)
+			addShard(*total, *s);
+	}
+
+	std::stringstream ss;
+
+	for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+		ss << "# HELP commnode_" << COUNTER_NAMES[i] << "_total " <<
+			COUNTER_HELP[i] << "\n";
+		ss << "# TYPE commnode_" << COUNTER_NAMES[i] << "_total counter\n";
+		ss << "commnode_" << COUNTER_NAMES[i] << "_total " <<
+			total->counters[i].load() << "\n";
+	}
+
+	//Gauges are sampled under gaugeLock rather than the registry lock, since
+	//they may take locks of their own and those may be held while counting.
+	//The samples of one name go together under one header.
+	{
+		std::lock_guard<std::mutex> lock(r.gaugeLock);
+		std::vector<const Gauge*> gauges;
+		for (auto& g : r.gauges)
+			gauges.push_back(&g);
+		std::stable_sort(gauges.begin(), gauges.end(), 
+			[](const Gauge* a, const Gauge* b) { return a->name < b->name; });
+		for (size_t i = 0; i < gauges.size(); i++) {
+			const Gauge& g = *gauges[i];
+			if (i == 0 || gauges[i - 1]->name != g.name) {
+				ss << "# HELP commnode_" << g.name << " " << g.help << "\n";
+				ss << "# TYPE commnode_" << g.name << " gauge\n";
+			}
+			ss << "commnode_" << g.name;
+			if (!g.label.empty())
+				ss << "{" << g.label << "}";
+			ss << " " << g.fn() << "\n";
+		}
+	}
+
+	const char* lastName = "";
+	for (int i = 0; i < static_cast<int>(Histogram::COUNT); i++) {
+		const char* name = HISTOGRAM_NAMES[i][0];
+		std::string label = HISTOGRAM_NAMES[i][1];
+		Shard::Hist& h = total->histograms[i];
+
+		if (strcmp(name, lastName) != 0) {
+			ss << "# HELP commnode_" << name << " " << 
+				HISTOGRAM_NAMES[i][2] << "\n";
+			ss << "# TYPE commnode_" << name << " histogram\n";
+			lastName = name;
+		}
+
+		std::string bucketLabel = label.empty() ? "" : label + ",";
+		std::string sumLabel = label.empty() ? "" : "{" + label + "}";
+
+		uint64_t cumulative = 0;
+		for (int b = 0; b < NUM_BUCKETS; b++) {
+			cumulative += h.buckets[b].load();
+			double le = (double)(1ULL << b) / 1e9;
+			ss << "commnode_" << name << "_bucket{" << bucketLabel <<
+				"le=\"" << le << "\"} " << cumulative << "\n";
+		}
+		cumulative += h.buckets[NUM_BUCKETS].load();
+		ss << "commnode_" << name << "_bucket{" << bucketLabel <<
+			"le=\"+Inf\"} " << cumulative << "\n";
+		ss << "commnode_" << name << "_sum" << sumLabel << " " <<
+			(double)h.sum.load() / 1e9 << "\n";
+		ss << "commnode_" << name << "_count" << sumLabel << " " <<
+			cumulative << "\n";
+	}
+
+	delete total;
+	return ss.str();
+}
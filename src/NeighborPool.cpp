@@ -0,0 +1,146 @@
+#include "NeighborPool.h"
+#include <new>
+
+NeighborPool::Guard::Guard(NeighborPool& p) : pool(p) {
+	//If the epoch moves on between reading it and registering, the count
+	//may already have been checked, so register again in the new one
+	while (true) {
+		epoch = pool.epoch.load();
+		pool.readers[epoch & 1]++;
+		if (pool.epoch.load() == epoch)
+			break;
+		pool.readers[epoch & 1]--;
+	}
+}
+
+NeighborPool::Guard::~Guard() {
+	pool.readers[epoch & 1]--;
+}
+
+NeighborPool::NeighborPool() : epoch(2) {
+	for (int i = 0; i < MAX_SLABS; i++)
+		directory[i] = NULL;
+	readers[0] = 0;
+	readers[1] = 0;
+}
+
+NeighborPool::~NeighborPool() {
+	for (int i = 0; i < MAX_SLABS; i++) {
+		Directory* d = directory[i];
+		if (d == NULL)
+			continue;
+
+		Slab* s = d->slab;
+		if (s != NULL) {
+			for (int slot = 0; slot < SLAB_SIZE; slot++) {
+				if ((d->freeSlots & (1ULL << slot)) == 0)
+					record(s, slot)->~NeighborInfo();
+			}
+			delete s;
+		}
+		delete d;
+	}
+}
+
+NeighborHandle NeighborPool::allocate() {
+	reclaim();
+
+	for (int i = firstFree; i < MAX_SLABS; i++) {
+		firstFree = i;
+		Directory* d = directory[i];
+		if (d == NULL) {
+			d = new Directory();
+			for (int slot = 0; slot < SLAB_SIZE; slot++)
+				d->generation[slot] = 1;
+			d->slab = NULL;
+			d->freeSlots = ~0ULL;
+			d->used = 0;
+			directory[i] = d;
+		}
+		if (d->freeSlots == 0)
+			continue;
+
+		if (d->slab == NULL) {
+			d->slab = new Slab;
+			slabs++;
+		}
+
+		uint32_t slot = __builtin_ctzll(d->freeSlots);
+		d->freeSlots &= ~(1ULL << slot);
+		d->used++;
+		live++;
+		new (record(d->slab, slot)) NeighborInfo();
+
+		NeighborHandle h;
+		h.index = i * SLAB_SIZE + slot;
+		h.generation = d->generation[slot];
+		return h;
+	}
+	return NeighborHandle();
+}
+
+void NeighborPool::release(NeighborHandle h) {
+	if (get(h) == NULL)
+		return;
+
+	//Readers that start after this can't reach the record
+	Directory* d = directory[h.index / SLAB_SIZE];
+	d->generation[h.index % SLAB_SIZE]++;
+	live--;
+
+	Released r;
+	r.index = h.index;
+	r.epoch = epoch;
+	released.push_back(r);
+	reclaim();
+}
+
+NeighborInfo* NeighborPool::get(NeighborHandle h) const {
+	if (h.index / SLAB_SIZE >= (uint32_t)MAX_SLABS)
+		return NULL;
+	Directory* d = directory[h.index / SLAB_SIZE];
+	if (d == NULL || d->generation[h.index % SLAB_SIZE] != h.generation)
+		return NULL;
+	Slab* s = d->slab;
+	return s == NULL ? NULL : record(s, h.index % SLAB_SIZE);
+}
+
+/**
+ * The epoch moves on when nobody is left in the one before it, which shares
+ * a counter with the next. A record released in epoch e has no readers left
+ * once the epoch reaches e + 2.
+ */
+void NeighborPool::reclaim() {
+	if (released.empty())
+		return;
+
+	uint64_t e = epoch;
+	if (readers[(e + 1) & 1] == 0) {
+		epoch = e + 1;
+		e++;
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < released.size(); i++) {
+		Released r = released[i];
+		if (r.epoch + 2 > e) {
+			released[kept++] = r;
+			continue;
+		}
+
+		Directory* d = directory[r.index / SLAB_SIZE];
+		uint32_t slot = r.index % SLAB_SIZE;
+		record(d->slab, slot)->~NeighborInfo();
+		d->freeSlots |= 1ULL << slot;
+		if ((int)(r.index / SLAB_SIZE) < firstFree)
+			firstFree = r.index / SLAB_SIZE;
+
+		//Slab 0 is kept so a node that only ever has a few neighbors doesn't
+		//allocate and free it over and over
+		if (--d->used == 0 && r.index >= (uint32_t)SLAB_SIZE) {
+			delete d->slab.exchange(NULL);
+			slabs--;
+		}
+	}
+	released.resize(kept);
+}
@@ -0,0 +1,159 @@
+#include "NeighborSnapshot.h"
+#include "Checksum.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <boost/filesystem.hpp>
+
+static const uint32_t SNAPSHOT_MAGIC = 0x4e534e43;	//"CNSN"
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sequence;						//Higher sequence wins between the banks
+	uint64_t savedAt;							//Unix time in milliseconds
+	unsigned char nodeId[16];
+	uint32_t count;
+	uint16_t tcpPort;							//Port our listener was bound to
+	uint16_t reserved;
+	uint64_t checksum;						//FNV-1a over the header up to here and records
+};
+
+struct SnapshotBank {
+	SnapshotHeader header;
+	SnapshotRecord records[NeighborSnapshot::MAX_RECORDS];
+};
+
+static uint64_t bankChecksum(const SnapshotBank* bank) {
+	uint64_t sum = fnv1a64(&bank->header, offsetof(SnapshotHeader, checksum));
+	return fnv1a64(bank->records, bank->header.count * sizeof(SnapshotRecord),
+		sum);
+}
+
+static bool bankValid(const SnapshotBank* bank) {
+	return bank->header.magic == SNAPSHOT_MAGIC &&
+		bank->header.version == SNAPSHOT_VERSION &&
+		bank->header.count <= NeighborSnapshot::MAX_RECORDS &&
+		bank->header.checksum == bankChecksum(bank);
+}
+
+/**
+ * Constructor
+ */
+NeighborSnapshot::NeighborSnapshot() : fd(-1), map(NULL), mapLen(0) {
+}
+
+NeighborSnapshot::~NeighborSnapshot() {
+	if (map != NULL)
+		munmap(map, mapLen);
+	if (fd >= 0)
+		close(fd);
+}
+
+bool NeighborSnapshot::open(const std::string& dir) {
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(dir, ec);
+	if (ec)
+		return false;
+
+	//Take the first slot nobody else holds. The lock lives as long as fd.
+	for (unsigned int i = 0; i < MAX_SLOTS && fd < 0; i++) {
+		std::string slotPath = dir + "/neighbors_" + std::to_string(i) + ".snap";
+		int slotFD = ::open(slotPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (slotFD < 0)
+			return false;
+
+		if (flock(slotFD, LOCK_EX | LOCK_NB) == 0) {
+			fd = slotFD;
+			path = slotPath;
+		} else {
+			close(slotFD);
+		}
+	}
+
+	if (fd < 0)
+		return false;
+
+	return mapSlot();
+}
+
+bool NeighborSnapshot::adopt(int slotFD, const std::string& slotPath) {
+	fd = slotFD;
+	path = slotPath;
+	return mapSlot();
+}
+
+bool NeighborSnapshot::mapSlot() {
+	mapLen = 2 * sizeof(SnapshotBank);
+	if (ftruncate(fd, mapLen) < 0)
+		return false;
+
+	void* m = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		return false;
+
+	map = m;
+	return true;
+}
+
+bool NeighborSnapshot::load(NodeId& nodeId,
+		unsigned short& tcpPort, std::vector<SnapshotRecord>& out) {
+	if (map == NULL)
+		return false;
+
+	SnapshotBank* banks = static_cast<SnapshotBank*>(map);
+	SnapshotBank* best = NULL;
+
+	for (int i = 0; i < 2; i++) {
+		if (!bankValid(&banks[i]))
+			continue;
+		if (best == NULL || banks[i].header.sequence > best->header.sequence)
+			best = &banks[i];
+	}
+
+	if (best == NULL)
+		return false;
+
+	nodeId = NodeId::fromBytes(best->header.nodeId);
+	tcpPort = best->header.tcpPort;
+	out.assign(best->records, best->records + best->header.count);
+	return true;
+}
+
+void NeighborSnapshot::save(const NodeId& nodeId,
+		unsigned short tcpPort, const std::vector<SnapshotRecord>& records,
+		bool sync) {
+	if (map == NULL)
+		return;
+
+	SnapshotBank* banks = static_cast<SnapshotBank*>(map);
+
+	//Overwrite whichever bank is older (or invalid) so the newest good copy
+	//survives if we die half way through
+	uint64_t seq0 = bankValid(&banks[0]) ? banks[0].header.sequence : 0;
+	uint64_t seq1 = bankValid(&banks[1]) ? banks[1].header.sequence : 0;
+	SnapshotBank* target = seq0 <= seq1 ? &banks[0] : &banks[1];
+
+	unsigned int count = records.size() < MAX_RECORDS ?
+		records.size() : MAX_RECORDS;
+
+	memcpy(target->records, records.data(), count * sizeof(SnapshotRecord));
+
+	SnapshotHeader& h = target->header;
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	h.sequence = (seq0 > seq1 ? seq0 : seq1) + 1;
+	h.savedAt = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	nodeId.toBytes(h.nodeId);
+	h.count = count;
+	h.tcpPort = tcpPort;
+	h.reserved = 0;
+	h.checksum = bankChecksum(target);
+
+	msync(map, mapLen, sync ? MS_SYNC : MS_ASYNC);
+}
@@ -0,0 +1,163 @@
+#include "Node.h"
+#include "CommNodeLog.h"
+#include <boost/uuid/uuid_generators.hpp>
+
+extern CommNodeLog* cnLog;
+
+Node::Node(const NodeConfig& c, const NodeId& nodeId) : config(c),
+		id(nodeId) {
+	load();
+}
+
+Node::Node(const NodeConfig& c, NodeHost& h, const NodeId& nodeId) : 
+		config(c), id(nodeId), host(&h) {
+	load();
+}
+
+/**
+ * Reads the snapshot now, since it may decide our identity, and creates the
+ * node
+ */
+void Node::load() {
+	if (!config.snapshotDir.empty()) {
+		snapshotOpen = snapshot.open(config.snapshotDir);
+
+		//A snapshot of some other identity is no use to us
+		NodeId saved;
+		unsigned short lastTcpPort = 0;
+		std::vector<SnapshotRecord> records;
+		if (snapshotOpen && snapshot.load(saved, lastTcpPort, records) &&
+				(id.isNil() || id == saved)) {
+			warmStart = true;
+			id = saved;
+			knownNeighbors.swap(records);
+			if (config.tcpPort == 0)
+				config.tcpPort = lastTcpPort;
+		}
+	}
+
+	if (id.isNil())
+		id = NodeId(boost::uuids::random_generator()());
+
+	node = new CommNode(id, config, host);
+	if (snapshotOpen)
+		node->setSnapshot(&snapshot);
+}
+
+Node::Node(const NodeConfig& c, const HandoffState& state,
+		const std::vector<int>& fds) : config(c), handedOver(true),
+		handoffState(state), handoffFDs(fds) {
+	id = NodeId::fromBytes(state.uuid);
+
+	int index = state.snapshotIndex;
+	snapshotOpen = index >= 0 && index < (int)fds.size() &&
+		snapshot.adopt(fds[index], state.snapshotPath);
+
+	node = new CommNode(id, config);
+	if (snapshotOpen)
+		node->setSnapshot(&snapshot);
+}
+
+/**
+ * Destructor. A node we handed to another process is left alone.
+ */
+Node::~Node() {
+	stop();
+	delete node;
+}
+
+bool Node::start() {
+	if (started)
+		return false;
+	started = true;
+
+	if (!config.snapshotDir.empty() && !snapshotOpen)
+		cnLog->warning("Unable to open a neighbor snapshot, warm restart disabled");
+	else if (warmStart)
+		cnLog->debug("Warm start from " + snapshot.getPath());
+
+	if (handedOver) {
+		node->resume(handoffState, handoffFDs);
+	} else {
+		node->start();
+		if (warmStart)
+			node->dialKnownNeighbors(knownNeighbors);
+	}
+
+	startMaintenance();
+	return true;
+}
+
+void Node::stop() {
+	if (!started)
+		return;
+	started = false;
+
+	stopMaintenance();
+	node->stop();
+}
+
+/**
+ * Heartbeats pause while the node is handed over, and pick up again if it
+ * fails
+ */
+bool Node::handOff(int sock) {
+	if (!started)
+		return false;
+
+	stopMaintenance();
+	if (!node->handOff(sock)) {
+		startMaintenance();
+		return false;
+	}
+
+	//The other process owns the sockets now, so stopping would close them
+	started = false;
+	return true;
+}
+
+void Node::setLogFile(const std::string& path) {
+	cnLog->init(path);
+}
+
+void Node::startMaintenance() {
+	if (host != NULL)
+		return;
+
+	maintaining = true;
+	int ret = pthread_create(&maintenanceThread, NULL, &Node::runMaintenance,
+		this);
+	if (ret)
+		cnLog->exitWithError("Error creating maintenance thread");
+}
+
+void Node::stopMaintenance() {
+	{
+		std::lock_guard<std::mutex> lock(maintenanceMutex);
+		if (!maintaining)
+			return;
+		maintaining = false;
+	}
+	maintenanceWake.notify_all();
+	pthread_join(maintenanceThread, NULL);
+}
+
+/**
+ * Pings neighbors and does the node's upkeep every heartbeat interval.
+ * Heartbeats themselves are sent on their own schedule.
+ */
+void* Node::runMaintenance() {
+	std::unique_lock<std::mutex> lock(maintenanceMutex);
+	while (maintaining) {
+		auto next = std::chrono::steady_clock::now() +
+			std::chrono::seconds(config.heartbeatIntervalSecs);
+		if (maintenanceWake.wait_until(lock, next, [this]() {
+				return !maintaining; }))
+			break;
+
+		lock.unlock();
+		node->update();
+		lock.lock();
+	}
+	return NULL;
+}
@@ -0,0 +1,355 @@
+#include "NodeHost.h"
+#include "CommNode.h"
+#include "CommNodeLog.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+/**
+ * Constructor
+ */
+NodeHost::NodeHost(const NodeConfig& c) : config(c), running(false),
+		pool(c.workerThreads, c.workerCpus), interfaces(c.interfaces),
+		udpListenerFD(-1), udpBroadcastFD(-1), listening(false) {
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFD < 0)
+		cnLog->exitWithError("Unable to create epoll instance");
+	wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFD < 0)
+		cnLog->exitWithError("Unable to create I/O wakeup descriptor");
+
+	Metrics::registerGauge("worker_queue_depth",
+		"Tasks waiting for a worker thread", [this]() {
+			return (double)pool.getQueued();
+		});
+	Metrics::registerGauge("hosted_nodes", "Nodes running in this process",
+		[this]() {
+			std::lock_guard<std::mutex> lock(nodeMutex);
+			return (double)nodes.size();
+		});
+}
+
+/**
+ * Destructor
+ */
+NodeHost::~NodeHost() {
+	stop();
+	Metrics::unregisterGauge("worker_queue_depth");
+	Metrics::unregisterGauge("hosted_nodes");
+	close(epollFD);
+	close(wakeFD);
+}
+
+/**
+ * Starts the shared threads and opens the discovery sockets
+ */
+void NodeHost::start() {
+	if (running)
+		return;
+	running = true;
+
+	pool.start();
+	interfaces.start();
+	initBroadcastListener();
+	initBroadcastServer();
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wakeFD;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeFD, &ev) < 0)
+		cnLog->exitWithError("Unable to watch I/O wakeup descriptor");
+	if (listening) {
+		ev.data.ptr = &udpListenerFD;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, udpListenerFD, &ev) < 0)
+			cnLog->exitWithError("Unable to watch the discovery socket");
+	}
+
+	int ret = pthread_create(&eventThread, NULL, &NodeHost::handleEvents, this);
+	if (ret)
+		cnLog->exitWithError("Error creating host event thread");
+	ret = pthread_create(&timerThread, NULL, &NodeHost::runTimers, this);
+	if (ret)
+		cnLog->exitWithError("Error creating host timer thread");
+}
+
+/**
+ * Stops the shared threads. Every hosted node should be stopped already.
+ */
+void NodeHost::stop() {
+	if (!running)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(nodeMutex);
+		if (!nodes.empty())
+			cnLog->warning("Stopping a host with " +
+				std::to_string(nodes.size()) + " nodes still running");
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(timerWaitMutex);
+		running = false;
+	}
+	timerWake.notify_all();
+	wake();
+	pthread_join(eventThread, NULL);
+	pthread_join(timerThread, NULL);
+
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, wakeFD, NULL);
+	if (listening) {
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, udpListenerFD, NULL);
+		close(udpListenerFD);
+	}
+	close(udpBroadcastFD);
+	interfaces.stop();
+	pool.stop();
+}
+
+/**
+ * Binds the discovery port. If another process has it, that node relays
+ * heartbeats to each of ours over TCP, the same as for a standalone node.
+ */
+void NodeHost::initBroadcastListener() {
+	udpListenerFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		IPPROTO_UDP);
+	if (udpListenerFD < 0)
+		cnLog->exitWithError("Unable to create UDP socket file descriptor");
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(config.udpPort);
+
+	if (bind(udpListenerFD, (sockaddr*)&addr, sizeof addr) < 0) {
+		if (errno != EADDRINUSE)
+			cnLog->exitWithError("Error binding to local port " +
+				std::to_string(config.udpPort));
+		cnLog->debug("Unable to bind to local port, waiting for master");
+		close(udpListenerFD);
+		udpListenerFD = -1;
+		listening = false;
+		return;
+	}
+	listening = true;
+}
+
+/**
+ * Opens the socket every hosted node sends its heartbeats on
+ */
+void NodeHost::initBroadcastServer() {
+	udpBroadcastFD = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (udpBroadcastFD < 0)
+		cnLog->exitWithError("Unable to create UDP socket file descriptor");
+
+	int enable = 1;
+	int ret = setsockopt(udpBroadcastFD, SOL_SOCKET, SO_BROADCAST,
+		&enable, sizeof enable);
+	if (ret < 0)
+		cnLog->exitWithError("Error setting options for broadcast socket");
+
+	//CS6, the class of heartbeats from a standalone node
+	int tos = 48 << 2;
+	if (config.markDscp && setsockopt(udpBroadcastFD, IPPROTO_IP, IP_TOS,
+			&tos, sizeof tos) < 0)
+		cnLog->warning("Unable to mark heartbeats with a DSCP");
+}
+
+void NodeHost::attach(CommNode* node) {
+	std::lock_guard<std::mutex> timers(timerMutex);
+	std::lock_guard<std::mutex> io(ioMutex);
+	std::lock_guard<std::mutex> lock(nodeMutex);
+
+	nodes.push_back(node);
+	byId[node->getUUID()] = node;
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = node;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, node->epollFD, &ev) < 0)
+		cnLog->error("Unable to watch the sockets of " + node->uuidStr);
+	cnLog->debug("Hosting node " + node->uuidStr);
+}
+
+void NodeHost::detach(CommNode* node) {
+	std::lock_guard<std::mutex> timers(timerMutex);
+	std::lock_guard<std::mutex> io(ioMutex);
+	std::lock_guard<std::mutex> lock(nodeMutex);
+
+	auto it = std::find(nodes.begin(), nodes.end(), node);
+	if (it == nodes.end())
+		return;
+	nodes.erase(it);
+	byId.erase(node->getUUID());
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, node->epollFD, NULL);
+}
+
+bool NodeHost::isHosted(const NodeId& id) {
+	std::lock_guard<std::mutex> lock(nodeMutex);
+	return byId.count(id) != 0;
+}
+
+std::vector<NodeId> NodeHost::getHosted() {
+	std::lock_guard<std::mutex> lock(nodeMutex);
+	std::vector<NodeId> ids;
+	ids.reserve(nodes.size());
+	for (auto node : nodes)
+		ids.push_back(node->getUUID());
+	return ids;
+}
+
+/**
+ * The message is posted while nodeMutex is held, so a node that detaches
+ * afterwards only has to wait for its workers to be done with it
+ */
+bool NodeHost::deliver(const NodeId& from, const NodeId& to,
+		const std::string& topic, const std::string& payload) {
+	std::lock_guard<std::mutex> lock(nodeMutex);
+	auto it = byId.find(to);
+	if (it == byId.end() || to == from)
+		return false;
+
+	it->second->deliverHosted(from, topic, payload);
+	return true;
+}
+
+int NodeHost::deliverAll(const NodeId& from, const std::string& topic,
+		const std::string& payload) {
+	std::lock_guard<std::mutex> lock(nodeMutex);
+	int delivered = 0;
+	for (auto node : nodes) {
+		if (node->getUUID() == from)
+			continue;
+		node->deliverHosted(from, topic, payload);
+		delivered++;
+	}
+	return delivered;
+}
+
+/**
+ * Interrupts epoll_wait, e.g. so the event thread sees that we're stopping
+ */
+void NodeHost::wake() {
+	uint64_t one = 1;
+	if (write(wakeFD, &one, sizeof one) < 0 && errno != EAGAIN)
+		cnLog->error("Unable to wake the host event thread");
+}
+
+/**
+ * The event thread. Each hosted node's epoll instance is itself watched
+ * here, so one thread waits on every socket. A node with events gets a
+ * pass of its I/O loop; every node gets one at least each IO_POLL_MS,
+ * which expires its connects and sends its heartbeats.
+ */
+void* NodeHost::handleEvents() {
+	cnLog->debug("Host listening for UDP messages on port " +
+		std::to_string(config.udpPort));
+
+	epoll_event events[CommNode::MAX_EVENTS];
+	auto lastSweep = std::chrono::steady_clock::now();
+	while (running) {
+		int n = epoll_wait(epollFD, events, CommNode::MAX_EVENTS,
+			CommNode::IO_POLL_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			cnLog->exitWithError("Error waiting for socket events");
+		}
+
+		std::lock_guard<std::mutex> lock(ioMutex);
+		auto now = std::chrono::steady_clock::now();
+		bool sweep = now - lastSweep >=
+			std::chrono::milliseconds((int)CommNode::IO_POLL_MS);
+		if (sweep)
+			lastSweep = now;
+
+		for (int i = 0; i < n; i++) {
+			void* ptr = events[i].data.ptr;
+			if (ptr == &udpListenerFD) {
+				readDatagrams();
+				continue;
+			}
+			if (ptr == &wakeFD) {
+				uint64_t count;
+				if (read(wakeFD, &count, sizeof count) < 0 && errno != EAGAIN)
+					cnLog->error("Error reading host wakeup descriptor");
+				continue;
+			}
+
+			//The node may have been detached since epoll_wait returned
+			CommNode* node = static_cast<CommNode*>(ptr);
+			if (!sweep && std::find(nodes.begin(), nodes.end(), node) !=
+					nodes.end())
+				node->pollIO(0);
+		}
+
+		if (sweep) {
+			for (auto node : nodes)
+				node->pollIO(0);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads what is waiting on the discovery socket. The first node applies
+ * the limits and relays each datagram once; every node then handles the
+ * ones it let through. Called with ioMutex held.
+ */
+void NodeHost::readDatagrams() {
+	for (int i = 0; i < CommNode::MAX_EVENTS; i++) {
+		memset(udpDgram, 0, CommNode::DGRAM_SIZE);
+
+		sockaddr_in origin;
+		socklen_t originSize = sizeof origin;
+		int ret = recvfrom(udpListenerFD, udpDgram, CommNode::DGRAM_SIZE, 0,
+			(sockaddr*)&origin, &originSize);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				cnLog->error("Error receiving UDP packet");
+			return;
+		}
+
+		if (nodes.empty() || !nodes[0]->handleDatagram(udpDgram, ret, origin))
+			continue;
+		for (size_t n = 1; n < nodes.size(); n++)
+			nodes[n]->postHeartbeat(udpDgram, ret, origin);
+	}
+}
+
+/**
+ * The timer thread. Pings neighbors and does the upkeep of every hosted
+ * node each heartbeat interval, as a Node's maintenance thread does for a
+ * node of its own.
+ */
+void* NodeHost::runTimers() {
+	std::unique_lock<std::mutex> lock(timerWaitMutex);
+	while (running) {
+		auto next = std::chrono::steady_clock::now() +
+			std::chrono::seconds(config.heartbeatIntervalSecs);
+		if (timerWake.wait_until(lock, next, [this]() { return !running; }))
+			break;
+
+		lock.unlock();
+		{
+			std::lock_guard<std::mutex> timers(timerMutex);
+			for (auto node : nodes)
+				node->update();
+		}
+		lock.lock();
+	}
+	return NULL;
+}
@@ -0,0 +1,174 @@
+#include "NodeId.h"
+#include <string.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSE2__
+/**
+ * Converts 16 hex digits to their values, clearing bits of valid for any
+ * byte that isn't a hex digit
+ */
+static inline __m128i hexToNibbles(__m128i c, int& valid) {
+	//Bytes above 0x7f are negative here, so they fail both range checks
+	__m128i isDigit = _mm_and_si128(
+		_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+
+	//Setting 0x20 folds 'A'-'F' onto 'a'-'f' and nothing else onto them
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i isAlpha = _mm_and_si128(
+		_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+	valid &= _mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha));
+
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i alpha = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+	return _mm_or_si128(_mm_and_si128(isDigit, digit),
+		_mm_and_si128(isAlpha, alpha));
+}
+
+/**
+ * Joins each pair of nibbles into a byte, leaving it in the low half of its
+ * 16-bit lane
+ */
+static inline __m128i joinNibbles(__m128i n) {
+	__m128i joined = _mm_or_si128(_mm_slli_epi16(n, 4), _mm_srli_epi16(n, 8));
+	return _mm_and_si128(joined, _mm_set1_epi16(0x00ff));
+}
+
+/**
+ * Converts HEX_SIZE hex digits to 16 bytes. Returns false on anything that
+ * isn't a hex digit.
+ */
+static bool decodeHex(const char* hex, unsigned char* bytes) {
+	int valid = 0xffff;
+	__m128i a = hexToNibbles(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex)), valid);
+	__m128i b = hexToNibbles(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + 16)), valid);
+	if (valid != 0xffff)
+		return false;
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(bytes),
+		_mm_packus_epi16(joinNibbles(a), joinNibbles(b)));
+	return true;
+}
+
+static inline __m128i nibblesToHex(__m128i n) {
+	//'0' + n, plus the gap between '9' and 'a' for n > 9
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)),
+		_mm_set1_epi8('a' - '0' - 10));
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+}
+
+static void encodeHex(const unsigned char* bytes, char* hex) {
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i high = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+	__m128i low = _mm_and_si128(b, mask);
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(hex),
+		nibblesToHex(_mm_unpacklo_epi8(high, low)));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(hex + 16),
+		nibblesToHex(_mm_unpackhi_epi8(high, low)));
+}
+#else
+static inline int hexValue(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static bool decodeHex(const char* hex, unsigned char* bytes) {
+	for (int i = 0; i < 16; i++) {
+		int high = hexValue(hex[2 * i]);
+		int low = hexValue(hex[2 * i + 1]);
+		if (high < 0 || low < 0)
+			return false;
+		bytes[i] = (high << 4) | low;
+	}
+	return true;
+}
+
+static void encodeHex(const unsigned char* bytes, char* hex) {
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < 16; i++) {
+		hex[2 * i] = digits[bytes[i] >> 4];
+		hex[2 * i + 1] = digits[bytes[i] & 0x0f];
+	}
+}
+#endif
+
+NodeId NodeId::fromBytes(const unsigned char* bytes) {
+	uint64_t high, low;
+	memcpy(&high, bytes, sizeof high);
+	memcpy(&low, bytes + 8, sizeof low);
+	return NodeId(be64toh(high), be64toh(low));
+}
+
+void NodeId::toBytes(unsigned char* bytes) const {
+	uint64_t high = htobe64(hi);
+	uint64_t low = htobe64(lo);
+	memcpy(bytes, &high, sizeof high);
+	memcpy(bytes + 8, &low, sizeof low);
+}
+
+boost::uuids::uuid NodeId::toUuid() const {
+	boost::uuids::uuid u;
+	toBytes(u.data);
+	return u;
+}
+
+bool NodeId::parse(const char* str, size_t len, NodeId& out) {
+	char hex[HEX_SIZE];
+
+	if (len == STRING_SIZE) {
+		//Squeeze out the dashes, checking they're where they belong
+		if (str[8] != '-' || str[13] != '-' || str[18] != '-' || str[23] != '-')
+			return false;
+		memcpy(hex, str, 8);
+		memcpy(hex + 8, str + 9, 4);
+		memcpy(hex + 12, str + 14, 4);
+		memcpy(hex + 16, str + 19, 4);
+		memcpy(hex + 20, str + 24, 12);
+		str = hex;
+	} else if (len != HEX_SIZE) {
+		return false;
+	}
+
+	unsigned char bytes[16];
+	if (!decodeHex(str, bytes))
+		return false;
+
+	out = fromBytes(bytes);
+	return true;
+}
+
+void NodeId::format(char* out) const {
+	unsigned char bytes[16];
+	char hex[HEX_SIZE];
+	toBytes(bytes);
+	encodeHex(bytes, hex);
+
+	memcpy(out, hex, 8);
+	out[8] = '-';
+	memcpy(out + 9, hex + 8, 4);
+	out[13] = '-';
+	memcpy(out + 14, hex + 12, 4);
+	out[18] = '-';
+	memcpy(out + 19, hex + 16, 4);
+	out[23] = '-';
+	memcpy(out + 24, hex + 20, 12);
+}
+
+std::string NodeId::toString() const {
+	char buf[STRING_SIZE];
+	format(buf);
+	return std::string(buf, STRING_SIZE);
+}
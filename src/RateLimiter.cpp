@@ -0,0 +1,54 @@
+#include "RateLimiter.h"
+#include <algorithm>
+
+RateLimiter::RateLimiter(double r, double b) : rate(r / 1e9), 
+		burst(std::max(b, 1.0)) {
+	overflow.tokens = burst;
+	overflow.last = 0;
+}
+
+bool RateLimiter::allow(uint64_t source, int64_t now) {
+	if (rate <= 0)
+		return true;
+
+	auto it = buckets.find(source);
+	if (it == buckets.end() && buckets.size() >= MAX_SOURCES &&
+			now - pruned >= 1000000000LL) {
+		pruned = now;
+		prune(now);
+	}
+
+	Bucket* b;
+	if (it != buckets.end()) {
+		b = &it->second;
+	} else if (buckets.size() < MAX_SOURCES) {
+		b = &buckets[source];
+		b->tokens = burst;
+		b->last = now;
+	} else {
+		b = &overflow;
+	}
+
+	refill(*b, now);
+	if (b->tokens < 1.0)
+		return false;
+	b->tokens -= 1.0;
+	return true;
+}
+
+void RateLimiter::refill(Bucket& b, int64_t now) const {
+	if (now > b.last) {
+		b.tokens = std::min(burst, b.tokens + (double)(now - b.last) * rate);
+		b.last = now;
+	}
+}
+
+void RateLimiter::prune(int64_t now) {
+	for (auto it = buckets.begin(); it != buckets.end(); ) {
+		refill(it->second, now);
+		if (it->second.tokens >= burst)
+			it = buckets.erase(it);
+		else
+			++it;
+	}
+}
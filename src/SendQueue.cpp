@@ -0,0 +1,75 @@
+#include "SendQueue.h"
+#include <string.h>
+
+TrafficClass SendQueue::classify(const char* frame) {
+	if (strncmp(frame, "msg ", 4) == 0 || strncmp(frame, "lat ", 4) == 0)
+		return TrafficClass::Bulk;
+	if (strncmp(frame, "ping ", 5) == 0 || strncmp(frame, "pong ", 5) == 0 ||
+			strncmp(frame, "ping", FRAME_SIZE) == 0)
+		return TrafficClass::Latency;
+	return TrafficClass::Control;
+}
+
+bool SendQueue::push(const char* frame, TrafficClass cls, int64_t now) {
+	std::deque<Frame>& q = queues[static_cast<int>(cls)];
+	if (cls == TrafficClass::Bulk && q.size() >= BULK_LIMIT)
+		return false;
+
+	//The send time goes in when a ping is written, so one waiting ping is as
+	//good as two
+	bool ping = strncmp(frame, "ping", FRAME_SIZE) == 0;
+	if (ping && pingQueued)
+		return true;
+	pingQueued = pingQueued || ping;
+
+	q.emplace_back();
+	Frame& f = q.back();
+	//Frames are text, so a short one such as a bare "ping" is padded here
+	//rather than read past its end
+	size_t len = strnlen(frame, FRAME_SIZE);
+	memcpy(f.data, frame, len);
+	memset(f.data + len, 0, FRAME_SIZE - len);
+	f.cls = cls;
+	f.queued = now;
+	return true;
+}
+
+bool SendQueue::pop(Frame& f) {
+	for (auto& q : queues) {
+		if (q.empty())
+			continue;
+		f = q.front();
+		q.pop_front();
+		if (pingQueued && strncmp(f.data, "ping", FRAME_SIZE) == 0)
+			pingQueued = false;
+		return true;
+	}
+	return false;
+}
+
+bool SendQueue::empty() const {
+	for (auto& q : queues) {
+		if (!q.empty())
+			return false;
+	}
+	return true;
+}
+
+size_t SendQueue::clear() {
+	size_t n = 0;
+	for (auto& q : queues) {
+		n += q.size();
+		q.clear();
+	}
+	pingQueued = false;
+	return n;
+}
+
+std::string SendQueue::pending() const {
+	std::string out;
+	for (auto& q : queues) {
+		for (auto& f : q)
+			out.append(f.data, FRAME_SIZE);
+	}
+	return out;
+}
@@ -0,0 +1,196 @@
+#include "StatsServer.h"
+#include "Metrics.h"
+#include "CommNodeLog.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+//Requests we accept are a single line, anything longer is refused
+static const int REQUEST_SIZE = 1024;
+//How long a client has to send its request
+static const int REQUEST_TIMEOUT_MS = 1000;
+
+/**
+ * Constructor
+ */
+StatsServer::StatsServer(int p) : port(p), listenerFD(-1), running(false) {
+	addHandler("/metrics", &Metrics::renderPrometheus);
+}
+
+StatsServer::~StatsServer() {
+	stop();
+}
+
+void StatsServer::addHandler(const std::string& path,
+		std::function<std::string()> fn) {
+	std::lock_guard<std::mutex> lock(handlerMutex);
+	handlers[path] = fn;
+}
+
+/**
+ * Binds to localhost and starts the request thread
+ */
+void StatsServer::start(int retryMs) {
+	listenerFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listenerFD < 0)
+		cnLog->exitWithError("Unable to create stats socket");
+
+	int enable = 1;
+	setsockopt(listenerFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	int ret = bind(listenerFD, (sockaddr*)&addr, sizeof addr);
+	for (int waited = 0; ret < 0 && errno == EADDRINUSE && waited < retryMs;
+			waited += 10) {
+		usleep(10000);
+		ret = bind(listenerFD, (sockaddr*)&addr, sizeof addr);
+	}
+	if (ret < 0 && errno == EADDRINUSE) {
+		//Another node on this host has the port
+		addr.sin_port = 0;
+		ret = bind(listenerFD, (sockaddr*)&addr, sizeof addr);
+	}
+	if (ret < 0)
+		cnLog->exitWithError("Unable to bind stats socket");
+
+	socklen_t len = sizeof addr;
+	getsockname(listenerFD, (sockaddr*)&addr, &len);
+	port = ntohs(addr.sin_port);
+
+	if (listen(listenerFD, 4) < 0)
+		cnLog->exitWithError("Unable to listen on stats socket");
+
+	running = true;
+	ret = pthread_create(&thread, NULL, &StatsServer::handleRequests, this);
+	if (ret)
+		cnLog->exitWithError("Error creating stats thread");
+
+	cnLog->debug("Serving stats on 127.0.0.1:" + std::to_string(port));
+}
+
+void StatsServer::stop() {
+	if (!running)
+		return;
+
+	running = false;
+	pthread_join(thread, NULL);
+	close(listenerFD);
+	listenerFD = -1;
+}
+
+void* StatsServer::handleRequests() {
+	while (running) {
+		//Poll with a timeout so stop() doesn't hang on accept
+		pollfd pfd;
+		pfd.fd = listenerFD;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		int fd = accept4(listenerFD, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		respond(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/**
+ * Reads "GET /path HTTP/1.x" and writes the registered handler's output
+ */
+void StatsServer::respond(int fd) {
+	char req[REQUEST_SIZE];
+	int len = 0;
+
+	while (len < REQUEST_SIZE - 1 && memchr(req, '\n', len) == NULL) {
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) <= 0)
+			return;
+
+		int n = read(fd, req + len, REQUEST_SIZE - 1 - len);
+		if (n <= 0)
+			return;
+		len += n;
+	}
+	req[len] = '\0';
+
+	char method[8], path[256];
+	std::string status = "200 OK";
+	std::string body;
+
+	if (sscanf(req, "%7s %255s", method, path) != 2 ||
+			strcmp(method, "GET") != 0) {
+		status = "400 Bad Request";
+	} else {
+		std::function<std::string()> fn;
+		{
+			std::lock_guard<std::mutex> lock(handlerMutex);
+			auto it = handlers.find(path);
+			if (it != handlers.end())
+				fn = it->second;
+		}
+
+		if (fn)
+			body = fn();
+		else
+			status = "404 Not Found";
+	}
+
+	std::string resp = "HTTP/1.0 " + status + "\r\n" +
+		"Content-Type: text/plain; version=0.0.4\r\n" +
+		"Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+	const char* p = resp.data();
+	size_t left = resp.size();
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n <= 0)
+			return;
+		p += n;
+		left -= n;
+	}
+}
+
+std::string StatsServer::fetch(int port, const std::string& path) {
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return "";
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	std::string resp;
+	std::string req = "GET " + path + " HTTP/1.0\r\n\r\n";
+
+	if (connect(fd, (sockaddr*)&addr, sizeof addr) == 0 &&
+			write(fd, req.data(), req.size()) == (ssize_t)req.size()) {
+		char buf[4096];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof buf)) > 0)
+			resp.append(buf, n);
+	}
+	close(fd);
+
+	//Strip the headers
+	size_t body = resp.find("\r\n\r\n");
+	return body == std::string::npos ? "" : resp.substr(body + 4);
+}
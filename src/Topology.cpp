@@ -0,0 +1,124 @@
+#include "Topology.h"
+#include <algorithm>
+#include <limits>
+
+Topology::Topology(int d, int r) : degree(d < 0 ? 0 : d),
+		randomLinks(r < 0 ? 0 : r), rng(std::random_device()()) {
+	if (randomLinks > degree)
+		randomLinks = degree;
+}
+
+Topology::Plan Topology::rebalance(const std::vector<Peer>& peers) {
+	Plan plan;
+
+	if (degree == 0) {
+		for (auto& p : peers) {
+			if (!p.connected)
+				plan.connect.push_back(p.id);
+		}
+		return plan;
+	}
+
+	//Rank by round trip. Connected neighbors get a head start so small
+	//changes in latency don't make us swap links back and forth. Neighbors
+	//we haven't measured go last.
+	std::vector<const Peer*> ranked;
+	for (auto& p : peers) {
+		if (!p.pinned)
+			ranked.push_back(&p);
+	}
+
+	auto score = [](const Peer* p) {
+		if (p->roundTrip < 0)
+			return std::numeric_limits<double>::max();
+		return p->connected ? p->roundTrip * HYSTERESIS : (double)p->roundTrip;
+	};
+	std::stable_sort(ranked.begin(), ranked.end(),
+		[&score](const Peer* a, const Peer* b) { return score(a) < score(b); });
+
+	std::set<NodeId> wanted;
+	int nearLinks = degree - randomLinks;
+	std::vector<const Peer*> rest;
+	for (auto p : ranked) {
+		if ((int)wanted.size() < nearLinks)
+			wanted.insert(p->id);
+		else
+			rest.push_back(p);
+	}
+
+	//Keep the random links we already have, as long as they're still around
+	std::set<NodeId> keptLinks;
+	for (auto p : rest) {
+		if (longLinks.count(p->id) != 0 &&
+				(int)keptLinks.size() < randomLinks) {
+			keptLinks.insert(p->id);
+		}
+	}
+	longLinks.swap(keptLinks);
+
+	//Top up from neighbors we're already connected to before opening new
+	//connections, so a node that just joined doesn't cause churn everywhere
+	std::vector<const Peer*> connected, passive;
+	for (auto p : rest) {
+		if (longLinks.count(p->id) != 0)
+			continue;
+		if (p->connected)
+			connected.push_back(p);
+		else
+			passive.push_back(p);
+	}
+	std::shuffle(connected.begin(), connected.end(), rng);
+	std::shuffle(passive.begin(), passive.end(), rng);
+
+	for (auto& pool : { &connected, &passive }) {
+		while ((int)longLinks.size() < randomLinks && !pool->empty()) {
+			longLinks.insert(pool->back()->id);
+			pool->pop_back();
+		}
+	}
+	wanted.insert(longLinks.begin(), longLinks.end());
+
+	//Probe one neighbor we aren't connected to, preferring ones we've never
+	//measured. If it turns out to be quick it ranks in next time, otherwise
+	//it is dropped again.
+	const Peer* probe = NULL;
+	for (auto p : passive) {
+		if (probe == NULL || (probe->roundTrip >= 0 && p->roundTrip < 0))
+			probe = p;
+	}
+	if (probe != NULL)
+		wanted.insert(probe->id);
+
+	//Connect what we want, drop outbound links we don't. Inbound ones are
+	//only dropped, slowest first, once there are too many.
+	std::vector<const Peer*> inbound;
+	for (auto& p : peers) {
+		if (p.pinned) {
+			if (!p.connected)
+				plan.connect.push_back(p.id);
+			continue;
+		}
+
+		bool want = wanted.count(p.id) != 0;
+		if (want && !p.connected) {
+			plan.connect.push_back(p.id);
+		} else if (!want && p.connected && p.outbound) {
+			//A link we opened but haven't measured yet is most likely last
+			//round's probe, so give it until its first pong
+			if (p.roundTrip >= 0)
+				plan.drop.push_back(p.id);
+		} else if (!want && p.connected) {
+			inbound.push_back(&p);
+		}
+	}
+
+	int excess = (int)inbound.size() - degree * MAX_INBOUND_FACTOR;
+	if (excess > 0) {
+		std::stable_sort(inbound.begin(), inbound.end(),
+			[&score](const Peer* a, const Peer* b) { return score(a) > score(b); });
+		for (int i = 0; i < excess; i++)
+			plan.drop.push_back(inbound[i]->id);
+	}
+
+	return plan;
+}
@@ -0,0 +1,169 @@
+#include "Tracer.h"
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <boost/filesystem.hpp>
+
+/**
+ * One recorded event. seq is odd while the owner is writing the slot and
+ * holds (position + 1) * 2 once it's complete.
+ */
+struct TraceEvent {
+	std::atomic<uint64_t> seq;
+	uint64_t start;
+	uint64_t dur;
+	const char* name;
+	uint64_t arg;
+	uint32_t tid;
+};
+
+struct alignas(64) Tracer::Ring {
+	std::atomic<uint64_t> head;				//Number of events ever written
+	TraceEvent events[RING_SIZE];
+};
+
+/**
+ * Rings are never freed. A thread that exits gives its ring back so the next
+ * thread can reuse it, and its events stay exportable until overwritten.
+ */
+struct Tracer::Registry {
+	std::mutex lock;
+	std::vector<Ring*> all;
+	std::vector<Ring*> free;
+};
+
+Tracer::Registry& Tracer::registry() {
+	static Registry* r = new Registry();
+	return *r;
+}
+
+Tracer::RingOwner::~RingOwner() {
+	if (ring != NULL)
+		releaseRing(ring);
+}
+
+Tracer::Ring* Tracer::acquireRing() {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.lock);
+
+	if (!r.free.empty()) {
+		Ring* ring = r.free.back();
+		r.free.pop_back();
+		return ring;
+	}
+
+	Ring* ring = new Ring();
+	ring->head = 0;
+	for (uint32_t i = 0; i < RING_SIZE; i++)
+		ring->events[i].seq = 0;
+	r.all.push_back(ring);
+	return ring;
+}
+
+void Tracer::releaseRing(Ring* ring) {
+	Registry& r = registry();
+	std::lock_guard<std::mutex> lock(r.lock);
+	r.free.push_back(ring);
+}
+
+Tracer::Ring* Tracer::localRing() {
+	static thread_local RingOwner owner;
+	if (owner.ring == NULL)
+		owner.ring = acquireRing();
+	return owner.ring;
+}
+
+void Tracer::complete(const char* name, uint64_t start, uint64_t dur,
+		uint64_t arg) {
+	static thread_local uint32_t tid = syscall(SYS_gettid);
+
+	Ring* ring = localRing();
+	uint64_t pos = ring->head.load(std::memory_order_relaxed);
+	TraceEvent& e = ring->events[pos & (RING_SIZE - 1)];
+
+	e.seq.store(pos * 2 + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	e.start = start;
+	e.dur = dur;
+	e.name = name;
+	e.arg = arg;
+	e.tid = tid;
+	e.seq.store((pos + 1) * 2, std::memory_order_release);
+
+	ring->head.store(pos + 1, std::memory_order_release);
+}
+
+std::string Tracer::exportChromeJson(const std::string& processName) {
+	std::stringstream ss;
+	int pid = getpid();
+
+	ss << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	ss << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid <<
+		",\"tid\":0,\"args\":{\"name\":\"" << processName << "\"}}";
+
+	std::vector<Ring*> rings;
+	{
+		Registry& r = registry();
+		std::lock_guard<std::mutex> lock(r.lock);
+		rings = r.all;
+	}
+
+	for (auto ring : rings) {
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+		for (uint64_t pos = first; pos < head; pos++) {
+			TraceEvent& e = ring->events[pos & (RING_SIZE - 1)];
+
+			uint64_t before = e.seq.load(std::memory_order_acquire);
+			TraceEvent copy;
+			copy.start = e.start;
+			copy.dur = e.dur;
+			copy.name = e.name;
+			copy.arg = e.arg;
+			copy.tid = e.tid;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint64_t after = e.seq.load(std::memory_order_relaxed);
+
+			//Skip slots the owner overwrote while we were copying
+			if (before != (pos + 1) * 2 || after != before)
+				continue;
+
+			//Chrome wants microseconds; keep the nanoseconds as decimals
+			ss << ",{\"name\":\"" << copy.name << "\",\"cat\":\"commnode\"," <<
+				"\"ph\":\"" << (copy.dur == 0 ? "i" : "X") << "\"," <<
+				"\"ts\":" << copy.start / 1000 << "." <<
+				(copy.start % 1000) / 100 << (copy.start % 100) / 10 <<
+				copy.start % 10;
+			if (copy.dur != 0) {
+				ss << ",\"dur\":" << copy.dur / 1000 << "." <<
+					(copy.dur % 1000) / 100 << (copy.dur % 100) / 10 <<
+					copy.dur % 10;
+			} else {
+				ss << ",\"s\":\"t\"";
+			}
+			ss << ",\"pid\":" << pid << ",\"tid\":" << copy.tid <<
+				",\"args\":{\"id\":" << copy.arg << "}}";
+		}
+	}
+
+	ss << "]}";
+	return ss.str();
+}
+
+bool Tracer::dumpToFile(const std::string& path,
+		const std::string& processName) {
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(
+		boost::filesystem::path(path).parent_path(), ec);
+
+	std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+	if (!out.is_open())
+		return false;
+
+	out << exportChromeJson(processName);
+	return out.good();
+}
@@ -0,0 +1,203 @@
+#include "TrafficCapture.h"
+#include <mutex>
+#include <algorithm>
+#include <thread>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+static size_t padded(size_t len) {
+	return (len + 7) & ~(size_t)7;
+}
+
+struct TrafficCapture::File {
+	std::mutex lock;							//Serializes start() and stop()
+	std::string path;
+	int fd = -1;
+	char* base = NULL;
+	uint64_t capacity = 0;
+	std::atomic<uint64_t> offset{0};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<int> writers{0};	//Records being copied in right now
+};
+
+TrafficCapture::File& TrafficCapture::file() {
+	static File* f = new File();
+	return *f;
+}
+
+bool TrafficCapture::start(const std::string& path, uint64_t maxBytes,
+		const unsigned char node[16], uint16_t frameSize) {
+	File& f = file();
+	std::lock_guard<std::mutex> lock(f.lock);
+	if (f.fd >= 0 || maxBytes < sizeof(CaptureHeader))
+		return false;
+
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(
+		boost::filesystem::path(path).parent_path(), ec);
+
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, maxBytes) != 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* base = mmap(NULL, maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		::close(fd);
+		return false;
+	}
+
+	CaptureHeader* h = static_cast<CaptureHeader*>(base);
+	memcpy(h->magic, "CNCP", 4);
+	h->version = VERSION;
+	h->frameSize = frameSize;
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->started = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	memcpy(h->node, node, 16);
+
+	f.path = path;
+	f.fd = fd;
+	f.base = static_cast<char*>(base);
+	f.capacity = maxBytes;
+	f.offset = sizeof(CaptureHeader);
+	f.dropped = 0;
+	enabled().store(true);
+	return true;
+}
+
+uint64_t TrafficCapture::stop() {
+	File& f = file();
+	std::lock_guard<std::mutex> lock(f.lock);
+	if (f.fd < 0)
+		return 0;
+
+	//Writers check the flag after registering, so once it's off and the 
+	//count drains nobody touches the mapping
+	enabled().store(false);
+	while (f.writers.load() > 0)
+		std::this_thread::yield();
+
+	munmap(f.base, f.capacity);
+	//If this fails the unused tail stays zeroed, which also ends the file
+	int ret = ftruncate(f.fd, std::min(f.offset.load(), f.capacity));
+	(void)ret;
+	::close(f.fd);
+
+	f.fd = -1;
+	f.base = NULL;
+	return f.dropped;
+}
+
+std::string TrafficCapture::getPath() {
+	File& f = file();
+	std::lock_guard<std::mutex> lock(f.lock);
+	return f.fd >= 0 ? f.path : std::string();
+}
+
+void TrafficCapture::write(Kind kind, uint32_t conn, int64_t time, 
+		const char* data, size_t len) {
+	File& f = file();
+	f.writers++;
+	//Not relaxed: this must not move above the increment stop() waits on
+	if (!enabled().load()) {
+		f.writers--;
+		return;
+	}
+
+	while (len > 0 && data[len - 1] == '\0')
+		len--;
+	if (len > UINT16_MAX)
+		len = UINT16_MAX;
+
+	size_t size = sizeof(CaptureRecord) + padded(len);
+	uint64_t at = f.offset.fetch_add(size);
+	if (at + size > f.capacity) {
+		f.dropped++;
+		f.writers--;
+		return;
+	}
+
+	CaptureRecord r;
+	r.time = time;
+	r.conn = conn;
+	r.kind = kind;
+	r.reserved = 0;
+	r.length = len;
+	memcpy(f.base + at, &r, sizeof r);
+	memcpy(f.base + at + sizeof r, data, len);
+	f.writers--;
+}
+
+CaptureReader::CaptureReader() : data(NULL), size(0), offset(0), 
+		header(NULL) {
+}
+
+CaptureReader::~CaptureReader() {
+	close();
+}
+
+bool CaptureReader::open(const std::string& path) {
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CaptureHeader)) {
+		::close(fd);
+		return false;
+	}
+
+	void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+		return false;
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	data = static_cast<const char*>(base);
+	size = st.st_size;
+	header = reinterpret_cast<const CaptureHeader*>(data);
+	if (memcmp(header->magic, "CNCP", 4) != 0 || 
+			header->version != TrafficCapture::VERSION) {
+		close();
+		return false;
+	}
+
+	rewind();
+	return true;
+}
+
+void CaptureReader::close() {
+	if (data != NULL)
+		munmap(const_cast<char*>(data), size);
+	data = NULL;
+	header = NULL;
+	size = 0;
+	offset = 0;
+}
+
+bool CaptureReader::next(CaptureRecord& r, const char*& payload) {
+	if (data == NULL || offset + sizeof r > size)
+		return false;
+
+	memcpy(&r, data + offset, sizeof r);
+	if (r.time == 0 || offset + sizeof r + r.length > size)
+		return false;
+
+	payload = data + offset + sizeof r;
+	offset += sizeof r + padded(r.length);
+	return true;
+}
+
+void CaptureReader::rewind() {
+	offset = sizeof(CaptureHeader);
+}
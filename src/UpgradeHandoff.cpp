@@ -0,0 +1,300 @@
+#include "UpgradeHandoff.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+const char* UpgradeHandoff::ENV_FD = "COMMNODE_HANDOFF_FD";
+
+static const uint32_t HANDOFF_MAGIC = 0x46484e43;	//"CNHF"
+static const uint32_t HANDOFF_VERSION = 3;
+
+/**
+ * Fixed size part of the state message. The snapshot path and neighbor list
+ * follow it.
+ */
+struct HandoffHeader {
+	uint32_t magic;
+	uint32_t version;
+	unsigned char uuid[16];
+	uint16_t udpPort;
+	uint16_t tcpPort;
+	int32_t udpListenerIndex;
+	int32_t udpBroadcastIndex;
+	int32_t tcpListenerIndex;
+	int32_t snapshotIndex;
+	uint32_t snapshotPathLen;
+	uint32_t neighborCount;
+	uint32_t fdCount;
+};
+
+/**
+ * Added in version 2, right after the snapshot path. Version 1 senders are
+ * still accepted so a node running the old binary can be upgraded.
+ */
+struct HandoffHeaderV2 {
+	int32_t bulkListenerIndex;
+	uint32_t reserved;
+};
+
+/**
+ * Followed by pendingLen bytes of queued frames and, from version 2, a
+ * uint32_t length and the start of a partly read frame. In versions 1 to 3
+ * the queued frames are 128 bytes each, padded with zeros, except that
+ * senders from before traffic classes send at most one message, unpadded.
+ * Version 3 adds outbound, and sends neighbors we aren't connected to with
+ * a socketIndex of -1.
+ */
+struct HandoffNeighborHeader {
+	SnapshotRecord record;
+	uint8_t local;
+	uint8_t outbound;
+	uint8_t reserved[2];
+	int32_t socketIndex;
+	uint32_t pendingLen;
+};
+
+static bool writeAll(int sock, const void* buf, size_t len) {
+	const char* p = static_cast<const char*>(buf);
+	while (len > 0) {
+		ssize_t n = write(sock, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool readAll(int sock, void* buf, size_t len) {
+	char* p = static_cast<char*>(buf);
+	while (len > 0) {
+		ssize_t n = read(sock, p, len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool UpgradeHandoff::sendFds(int sock, const int* fds, size_t count,
+		const void* data, size_t len) {
+	iovec iov;
+	iov.iov_base = const_cast<void*>(data);
+	iov.iov_len = len;
+
+	std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (count > 0) {
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	}
+
+	ssize_t ret;
+	do {
+		ret = sendmsg(sock, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	//The descriptors travel with the first byte, the rest is ordinary data
+	if (ret < 0)
+		return false;
+	return writeAll(sock, static_cast<const char*>(data) + ret, len - ret);
+}
+
+bool UpgradeHandoff::recvFds(int sock, std::vector<int>& fds, void* data,
+		size_t len) {
+	iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	std::vector<char> control(CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int)));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+
+	ssize_t ret;
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0 || (msg.msg_flags & MSG_CTRUNC))
+		return false;
+
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+		fds.insert(fds.end(), received, received + n);
+	}
+
+	return readAll(sock, static_cast<char*>(data) + ret, len - ret);
+}
+
+/**
+ * Sends the state message, then the descriptors in batches. Each batch
+ * carries its size as the payload so the receiver can check nothing was lost.
+ */
+bool UpgradeHandoff::send(int sock, const HandoffState& state,
+		const std::vector<int>& fds) {
+	HandoffHeader h;
+	memset(&h, 0, sizeof h);
+	h.magic = HANDOFF_MAGIC;
+	h.version = HANDOFF_VERSION;
+	memcpy(h.uuid, state.uuid, sizeof h.uuid);
+	h.udpPort = state.udpPort;
+	h.tcpPort = state.tcpPort;
+	h.udpListenerIndex = state.udpListenerIndex;
+	h.udpBroadcastIndex = state.udpBroadcastIndex;
+	h.tcpListenerIndex = state.tcpListenerIndex;
+	h.snapshotIndex = state.snapshotIndex;
+	h.snapshotPathLen = state.snapshotPath.size();
+	h.neighborCount = state.neighbors.size();
+	h.fdCount = fds.size();
+
+	HandoffHeaderV2 h2;
+	memset(&h2, 0, sizeof h2);
+	h2.bulkListenerIndex = state.bulkListenerIndex;
+
+	std::string buf((char*)&h, sizeof h);
+	buf += state.snapshotPath;
+	buf.append((char*)&h2, sizeof h2);
+
+	for (auto& it : state.neighbors) {
+		HandoffNeighborHeader nh;
+		memset(&nh, 0, sizeof nh);
+		nh.record = it.record;
+		nh.local = it.local;
+		nh.outbound = it.outbound;
+		nh.socketIndex = it.socketIndex;
+		nh.pendingLen = it.pending.size();
+
+		buf.append((char*)&nh, sizeof nh);
+		buf += it.pending;
+
+		uint32_t partialLen = it.partial.size();
+		buf.append((char*)&partialLen, sizeof partialLen);
+		buf += it.partial;
+	}
+
+	uint32_t len = buf.size();
+	if (!writeAll(sock, &len, sizeof len) || !writeAll(sock, buf.data(), len))
+		return false;
+
+	for (size_t i = 0; i < fds.size(); i += FDS_PER_MESSAGE) {
+		uint32_t batch = fds.size() - i < FDS_PER_MESSAGE ?
+			fds.size() - i : FDS_PER_MESSAGE;
+		if (!sendFds(sock, &fds[i], batch, &batch, sizeof batch))
+			return false;
+	}
+	return true;
+}
+
+bool UpgradeHandoff::receive(int sock, HandoffState& state,
+		std::vector<int>& fds) {
+	uint32_t len;
+	if (!readAll(sock, &len, sizeof len) || len < sizeof(HandoffHeader))
+		return false;
+
+	std::vector<char> buf(len);
+	if (!readAll(sock, buf.data(), len))
+		return false;
+
+	HandoffHeader h;
+	memcpy(&h, buf.data(), sizeof h);
+	if (h.magic != HANDOFF_MAGIC || h.version < 1 || 
+			h.version > HANDOFF_VERSION)
+		return false;
+
+	memcpy(state.uuid, h.uuid, sizeof state.uuid);
+	state.udpPort = h.udpPort;
+	state.tcpPort = h.tcpPort;
+	state.udpListenerIndex = h.udpListenerIndex;
+	state.udpBroadcastIndex = h.udpBroadcastIndex;
+	state.tcpListenerIndex = h.tcpListenerIndex;
+	state.snapshotIndex = h.snapshotIndex;
+
+	size_t off = sizeof h;
+	if (off + h.snapshotPathLen > len)
+		return false;
+	state.snapshotPath.assign(&buf[off], h.snapshotPathLen);
+	off += h.snapshotPathLen;
+
+	state.bulkListenerIndex = -1;
+	if (h.version >= 2) {
+		HandoffHeaderV2 h2;
+		if (off + sizeof h2 > len)
+			return false;
+		memcpy(&h2, &buf[off], sizeof h2);
+		off += sizeof h2;
+		state.bulkListenerIndex = h2.bulkListenerIndex;
+	}
+
+	state.neighbors.clear();
+	for (uint32_t i = 0; i < h.neighborCount; i++) {
+		HandoffNeighborHeader nh;
+		if (off + sizeof nh > len)
+			return false;
+		memcpy(&nh, &buf[off], sizeof nh);
+		off += sizeof nh;
+
+		if (off + nh.pendingLen > len)
+			return false;
+
+		HandoffNeighbor n;
+		n.record = nh.record;
+		n.local = nh.local != 0;
+		n.outbound = nh.outbound != 0;
+		n.socketIndex = nh.socketIndex;
+		n.pending.assign(&buf[off], nh.pendingLen);
+		off += nh.pendingLen;
+
+		if (h.version >= 2) {
+			uint32_t partialLen;
+			if (off + sizeof partialLen > len)
+				return false;
+			memcpy(&partialLen, &buf[off], sizeof partialLen);
+			off += sizeof partialLen;
+
+			if (off + partialLen > len)
+				return false;
+			n.partial.assign(&buf[off], partialLen);
+			off += partialLen;
+		}
+		state.neighbors.push_back(n);
+	}
+
+	fds.clear();
+	while (fds.size() < h.fdCount) {
+		uint32_t batch = 0;
+		size_t before = fds.size();
+		if (!recvFds(sock, fds, &batch, sizeof batch) ||
+				fds.size() - before != batch)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,201 @@
+#include "WorkerPool.h"
+#include "Metrics.h"
+#include "CommNodeLog.h"
+#include <thread>
+#include <sched.h>
+
+//This external variable holds the instance to the logger used by all files
+extern CommNodeLog* cnLog;
+
+//Lets submit() find the calling worker's own queue
+static thread_local WorkerPool* currentPool = NULL;
+static thread_local int currentWorker = -1;
+
+//How long an idle worker sleeps before looking for work to steal again
+static const int IDLE_WAIT_MS = 100;
+
+/**
+ * Queues a task, and schedules the strand if it wasn't already
+ */
+void WorkerPool::Strand::post(Task t) {
+	{
+		std::lock_guard<std::mutex> l(lock);
+		tasks.push_back(std::move(t));
+		if (scheduled)
+			return;
+		scheduled = true;
+	}
+
+	std::shared_ptr<Strand> self = shared_from_this();
+	pool.submit([self]() { self->run(); });
+}
+
+void WorkerPool::Strand::run() {
+	for (int i = 0; i < BATCH; i++) {
+		Task t;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (tasks.empty()) {
+				scheduled = false;
+				return;
+			}
+			t = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		t();
+	}
+
+	//Still more to do; let other strands have a turn first
+	std::shared_ptr<Strand> self = shared_from_this();
+	pool.submit([self]() { self->run(); });
+}
+
+/**
+ * Constructor
+ */
+WorkerPool::WorkerPool(int threads, const std::vector<int>& cpus) :
+		numThreads(threads), cpuList(cpus), running(false), queued(0),
+		outstanding(0), nextWorker(0), sleepers(0) {
+	if (numThreads <= 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads <= 0)
+		numThreads = 1;
+
+	for (int i = 0; i < numThreads; i++)
+		workers.push_back(new Worker());
+}
+
+WorkerPool::~WorkerPool() {
+	stop();
+	for (auto w : workers)
+		delete w;
+}
+
+void WorkerPool::start() {
+	if (running)
+		return;
+	running = true;
+
+	for (int i = 0; i < numThreads; i++) {
+		WorkerArgs* args = new WorkerArgs;
+		args->pool = this;
+		args->index = i;
+
+		int ret = pthread_create(&workers[i]->thread, NULL,
+			&WorkerPool::runWorker, args);
+		if (ret)
+			cnLog->exitWithError("Error creating worker thread");
+
+		if (!cpuList.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpuList[i % cpuList.size()], &set);
+			if (pthread_setaffinity_np(workers[i]->thread, sizeof set, &set) != 0)
+				cnLog->warning("Unable to pin worker " + std::to_string(i) +
+					" to CPU " + std::to_string(cpuList[i % cpuList.size()]));
+		}
+	}
+
+	cnLog->debug("Started " + std::to_string(numThreads) + " worker threads");
+}
+
+void WorkerPool::stop() {
+	if (!running)
+		return;
+
+	{
+		std::lock_guard<std::mutex> l(sleepMutex);
+		running = false;
+	}
+	wakeup.notify_all();
+
+	for (auto w : workers)
+		pthread_join(w->thread, NULL);
+}
+
+void WorkerPool::submit(Task t) {
+	int target = currentPool == this ? currentWorker :
+		nextWorker++ % numThreads;
+
+	outstanding++;
+	queued++;
+	{
+		std::lock_guard<std::mutex> l(workers[target]->lock);
+		workers[target]->tasks.push_back(std::move(t));
+	}
+
+	//Workers check queued under sleepMutex before sleeping, so taking it here
+	//means the notify can't slip in between their check and their wait
+	std::lock_guard<std::mutex> l(sleepMutex);
+	if (sleepers > 0)
+		wakeup.notify_one();
+}
+
+void WorkerPool::waitIdle() {
+	std::unique_lock<std::mutex> l(sleepMutex);
+	while (outstanding > 0)
+		idle.wait_for(l, std::chrono::milliseconds(IDLE_WAIT_MS));
+}
+
+/**
+ * Takes the oldest task from our own queue, or else from someone else's.
+ * Both ends are FIFO so a strand that yields really does go to the back.
+ */
+bool WorkerPool::takeTask(int index, Task& t) {
+	Worker* own = workers[index];
+	{
+		std::lock_guard<std::mutex> l(own->lock);
+		if (!own->tasks.empty()) {
+			t = std::move(own->tasks.front());
+			own->tasks.pop_front();
+			return true;
+		}
+	}
+
+	for (int i = 1; i < numThreads; i++) {
+		Worker* victim = workers[(index + i) % numThreads];
+		std::lock_guard<std::mutex> l(victim->lock);
+		if (!victim->tasks.empty()) {
+			t = std::move(victim->tasks.front());
+			victim->tasks.pop_front();
+			Metrics::increment(Counter::TasksStolen);
+			return true;
+		}
+	}
+	return false;
+}
+
+void* WorkerPool::runWorker(int index) {
+	currentPool = this;
+	currentWorker = index;
+
+	while (true) {
+		Task t;
+		if (takeTask(index, t)) {
+			queued--;
+			t();
+			Metrics::increment(Counter::TasksExecuted);
+
+			if (--outstanding == 0) {
+				std::lock_guard<std::mutex> l(sleepMutex);
+				idle.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> l(sleepMutex);
+		if (queued > 0)
+			continue;
+		//Everything queued before stop() has run
+		if (!running)
+			break;
+
+		sleepers++;
+		wakeup.wait_for(l, std::chrono::milliseconds(IDLE_WAIT_MS));
+		sleepers--;
+	}
+
+	currentPool = NULL;
+	currentWorker = -1;
+	return NULL;
+}
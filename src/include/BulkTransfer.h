@@ -0,0 +1,99 @@
+#ifndef BULKTRANSFER_H
+#define BULKTRANSFER_H
+
+#include <string>
+#include <atomic>
+#include <functional>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Moves files of any size between nodes on connections of their own, so a
+ * large transfer never sits in front of control messages.
+ *
+ * The sender streams the file in chunks with sendfile(), so the data goes
+ * from the page cache to the socket without being copied through user
+ * space. Each chunk carries an xxh64 checksum. The receiver reads straight
+ * into an mmap'd "<name>.part" file, verifies the chunk, and every so often
+ * syncs the data and records how far it got in a small progress file. If
+ * the connection drops, or a chunk doesn't verify, the sender reconnects
+ * and the receiver tells it where to resume. The finished file is renamed
+ * into place, so a file without the .part suffix is always complete.
+ */
+class BulkTransfer {
+	public:
+		//Bytes covered by one checksum
+		static const uint32_t CHUNK_SIZE = 4 * 1024 * 1024;
+		//Connections a sender makes before giving up on a transfer
+		static const int MAX_ATTEMPTS = 5;
+		//How often blocked threads check whether they should stop
+		static const int POLL_MS = 1000;
+
+		//Called on the sending thread when a transfer finishes or gives up
+		typedef std::function<void(uint64_t id, bool ok)> DoneCallback;
+
+		/**
+		 * @param dir where received files are written
+		 */
+		explicit BulkTransfer(const std::string& dir);
+		~BulkTransfer();
+
+		/**
+		 * Binds the listener to port, or a random port if it is 0 or taken
+		 */
+		void listen(int port);
+
+		/**
+		 * Takes over a listener that is already bound, e.g. during a hot upgrade
+		 */
+		void adopt(int fd);
+
+		/**
+		 * Starts/stops accepting transfers. stop() also waits for every transfer
+		 * to end; interrupted ones resume when the sender reconnects.
+		 * stopAccepting() leaves transfers running and the listener open.
+		 */
+		void start();
+		void stop();
+		void stopAccepting();
+
+		/**
+		 * Sends a file to the bulk port of another node on a new thread. name is
+		 * the file name used on the other side. Returns the transfer id, which
+		 * is also passed to done.
+		 */
+		uint64_t sendFile(const std::string& ip, int port,
+			const std::string& path, const std::string& name,
+			DoneCallback done = nullptr);
+
+		int getPort() { return port; };
+		int getListenerFD() { return listenerFD; };
+		int getActive() { return activeTransfers; };
+
+		//These functions let us use member functions as POSIX thread callbacks
+		static void* handleAccept(void* p) {
+			return static_cast<BulkTransfer*>(p)->handleAccept();
+		}
+
+		struct SendArgs;
+		struct ReceiveArgs;
+		static void* handleSend(void* p);
+		static void* handleReceive(void* p);
+
+	private:
+		void* handleAccept();
+		void receive(int fd);
+		bool sendAttempt(uint64_t id, const std::string& ip, int port,
+			int fileFD, uint64_t size, const std::string& name);
+		void startThread(void* (*fn)(void*), void* args);
+
+		std::string receiveDir;
+		int listenerFD;
+		int port;
+		std::atomic<bool> running;			//Transfers keep going while set
+		std::atomic<bool> accepting;			//The accept thread runs while set
+		std::atomic<int> activeTransfers;
+		pthread_t acceptThread;
+};
+
+#endif
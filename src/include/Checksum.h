@@ -0,0 +1,117 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * 64-bit FNV-1a hash. Pass the previous result as the seed to checksum data
+ * that isn't contiguous.
+ */
+inline uint64_t fnv1a64(const void* data, size_t len,
+		uint64_t seed = 14695981039346656037ULL) {
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * 64-bit xxHash (XXH64). Works on 32 bytes per round, so unlike FNV-1a it 
+ * keeps up with a 10GbE link on one core. Used for bulk transfer chunks.
+ */
+namespace xxh64detail {
+	static const uint64_t P1 = 11400714785074694791ULL;
+	static const uint64_t P2 = 14029467366897019727ULL;
+	static const uint64_t P3 = 1609587929392839161ULL;
+	static const uint64_t P4 = 9650029242287828579ULL;
+	static const uint64_t P5 = 2870177450012600261ULL;
+
+	inline uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline uint64_t read64(const unsigned char* p) {
+		uint64_t v;
+		memcpy(&v, p, sizeof v);
+		return v;
+	}
+
+	inline uint32_t read32(const unsigned char* p) {
+		uint32_t v;
+		memcpy(&v, p, sizeof v);
+		return v;
+	}
+
+	inline uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+
+	inline uint64_t merge(uint64_t acc, uint64_t val) {
+		acc ^= round(0, val);
+		return acc * P1 + P4;
+	}
+}
+
+inline uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0) {
+	using namespace xxh64detail;
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const unsigned char* end = p + len;
+	uint64_t hash;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + P1 + P2;
+		uint64_t v2 = seed + P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - P1;
+
+		const unsigned char* limit = end - 32;
+		do {
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		hash = merge(hash, v1);
+		hash = merge(hash, v2);
+		hash = merge(hash, v3);
+		hash = merge(hash, v4);
+	} else {
+		hash = seed + P5;
+	}
+
+	hash += len;
+
+	for (; p + 8 <= end; p += 8) {
+		hash ^= round(0, read64(p));
+		hash = rotl(hash, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		hash ^= (uint64_t)read32(p) * P1;
+		hash = rotl(hash, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		hash ^= (*p) * P5;
+		hash = rotl(hash, 11) * P1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= P2;
+	hash ^= hash >> 29;
+	hash *= P3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef CLIENTRING_H
+#define CLIENTRING_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+
+/**
+ * The shared memory a local client and the node exchange messages through
+ * (see LocalServer.h and CommNodeClient.h). It holds one ring in each
+ * direction. Each ring has one producer and one consumer per process, so
+ * pushing and popping is a copy and a release store, with no system call.
+ *
+ * The consumer only sleeps on the ring's eventfd after raising waiting and
+ * finding the ring still empty, and the producer only writes the eventfd
+ * when it clears a raised flag. A busy ring costs no system calls at all.
+ */
+
+//Largest topic plus payload, the same as CommNode::MAX_MESSAGE
+static const int CLIENT_MAX_MESSAGE = 122;
+
+struct ClientMessage {
+	unsigned char peer[16];				//Sender, or destination (all zero for every link)
+	uint16_t topicLen;
+	uint16_t payloadLen;
+	char data[CLIENT_MAX_MESSAGE];	//Topic, then payload
+};
+
+class ClientRing {
+	public:
+		//Must be a power of two
+		static const uint32_t SLOTS = 4096;
+
+		void init() {
+			head.store(0);
+			tail.store(0);
+			waiting.store(0);
+		}
+
+		/**
+		 * Copies m in and rings the doorbell if the consumer is asleep. Returns
+		 * false if the ring is full.
+		 */
+		bool push(const ClientMessage& m, int doorbell) {
+			uint64_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) >= SLOTS)
+				return false;
+
+			slots[t & (SLOTS - 1)] = m;
+			tail.store(t + 1, std::memory_order_seq_cst);
+
+			if (waiting.load(std::memory_order_seq_cst) && waiting.exchange(0)) {
+				uint64_t one = 1;
+				ssize_t ret = write(doorbell, &one, sizeof one);
+				(void)ret;
+			}
+			return true;
+		}
+
+		bool pop(ClientMessage& m) {
+			uint64_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire))
+				return false;
+
+			m = slots[h & (SLOTS - 1)];
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		/**
+		 * The message pop() would return, left on the ring, or NULL if it is
+		 * empty. Only the consumer calls this, so it stays put until popped.
+		 */
+		const ClientMessage* front() {
+			uint64_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire))
+				return NULL;
+			return &slots[h & (SLOTS - 1)];
+		}
+
+		//Drops the message front() returned
+		void popFront() {
+			head.store(head.load(std::memory_order_relaxed) + 1,
+				std::memory_order_release);
+		}
+
+		bool empty() {
+			return head.load(std::memory_order_acquire) ==
+				tail.load(std::memory_order_acquire);
+		}
+
+		/**
+		 * Raises waiting. Returns false if a message came in meanwhile, in which
+		 * case the consumer should pop instead of sleeping.
+		 */
+		bool prepareWait() {
+			waiting.store(1, std::memory_order_seq_cst);
+			if (tail.load(std::memory_order_seq_cst) !=
+					head.load(std::memory_order_relaxed)) {
+				waiting.store(0, std::memory_order_relaxed);
+				return false;
+			}
+			return true;
+		}
+
+		/**
+		 * Sleeps until the doorbell rings or timeoutMs passes (-1 waits for
+		 * ever). Returns true if there may be messages to pop.
+		 */
+		bool wait(int doorbell, int timeoutMs) {
+			if (!prepareWait())
+				return true;
+
+			pollfd pfd;
+			pfd.fd = doorbell;
+			pfd.events = POLLIN;
+			int ret = poll(&pfd, 1, timeoutMs);
+			waiting.store(0, std::memory_order_relaxed);
+			if (ret <= 0)
+				return !empty();
+
+			uint64_t count;
+			ssize_t n = read(doorbell, &count, sizeof count);
+			(void)n;
+			return true;
+		}
+
+	private:
+		alignas(64) std::atomic<uint64_t> head;	//Next slot to pop
+		alignas(64) std::atomic<uint64_t> tail;	//Next slot to push
+		alignas(64) std::atomic<uint32_t> waiting;	//The consumer is asleep
+		alignas(64) ClientMessage slots[SLOTS];
+};
+
+/**
+ * The whole shared region. Whoever creates it calls init().
+ */
+struct ClientShared {
+	static const uint32_t MAGIC = 0x434e4950;	//"CNIP"
+	static const uint32_t VERSION = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	ClientRing toNode;
+	ClientRing fromNode;
+
+	void init() {
+		magic = MAGIC;
+		version = VERSION;
+		toNode.init();
+		fromNode.init();
+	}
+};
+
+//The rings are shared between processes, so they have to work without locks
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+	"Client rings need lock free atomics");
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * Estimates how far a neighbor's clock is from ours, and how fast the gap
+ * changes, from NTP-style ping/pong exchanges. Each exchange gives four
+ * timestamps:
+ *
+ *   t1  we send the ping          (our clock)
+ *   t2  the neighbor receives it  (its clock)
+ *   t3  the neighbor sends a pong (its clock)
+ *   t4  we receive the pong       (our clock)
+ *
+ * The offset of one exchange assumes the path is symmetric, so it is only
+ * trusted from the exchanges that took least time. Those offsets, projected
+ * along the estimated drift, are then used to split every exchange into a
+ * delay out to the neighbor and a delay back, which is where asymmetry
+ * shows up. A fixed asymmetry in the quickest exchanges can't be told apart
+ * from clock offset; anything beyond that is attributed to the direction it
+ * happened in.
+ *
+ * All times are CLOCK_REALTIME nanoseconds. Receive times should come from
+ * the kernel (see enableTimestamps()) so scheduling delays stay out of them.
+ */
+class ClockSync {
+	public:
+		//Exchanges the estimate is based on
+		static const int WINDOW = 8;
+		//Larger drift means a clock step or bad samples, not a real oscillator
+		static constexpr double MAX_DRIFT = 500e-6;
+
+		static int64_t now();
+
+		/**
+		 * Asks the kernel to timestamp data received on fd. Returns false if it
+		 * can't, in which case receiveTime() falls back to now().
+		 */
+		static bool enableTimestamps(int fd);
+
+		/**
+		 * The kernel receive timestamp in the control data of msg, or now() if
+		 * there is none
+		 */
+		static int64_t receiveTime(msghdr* msg);
+
+		void addSample(int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+		/**
+		 * Neighbor's clock minus ours at time t (our clock)
+		 */
+		int64_t getOffset(int64_t t) const;
+		double getDriftPpm() const { return drift * 1e6; };
+		int64_t getRoundTrip() const { return roundTrip; };
+		int64_t getForward() const { return forward; };		//Us to the neighbor
+		int64_t getReverse() const { return reverse; };		//Neighbor to us
+		int getSamples() const { return count; };
+
+	private:
+		struct Sample {
+			int64_t at;						//t4
+			int64_t offset;
+			int64_t delay;				//Round trip minus the neighbor's turnaround
+		};
+
+		const Sample* best() const;
+		void updateDrift();
+
+		Sample window[WINDOW];
+		int count = 0;
+		int next = 0;
+		double drift = 0.0;				//Nanoseconds of offset per nanosecond
+		int64_t roundTrip = 0;
+		int64_t forward = 0;
+		int64_t reverse = 0;
+};
+
+#endif
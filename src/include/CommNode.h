@@ -2,10 +2,25 @@
 #define COMMNODE_H
 
 #include "NeighborInfo.h"
+#include "NeighborPool.h"
+#include "NodeConfig.h"
+#include "InterfaceManager.h"
+#include "NeighborSnapshot.h"
+#include "UpgradeHandoff.h"
+#include "BulkTransfer.h"
+#include "WorkerPool.h"
+#include "Topology.h"
+#include "DuplicateFilter.h"
+#include "RateLimiter.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "TrafficCapture.h"
+#include "SendQueue.h"
+#include "HeartbeatScheduler.h"
+#include "LatencyMatrix.h"
 #include <map>
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
-#include <boost/uuid/nil_generator.hpp>
 #include <boost/algorithm/string.hpp>
 #include <stdio.h>
 #include <unistd.h>
@@ -23,6 +38,13 @@
 #include <sys/poll.h>
 #include <sys/ioctl.h>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+class NodeHost;
 
 /**
  * This class performs the majority of the networking tasks
@@ -35,8 +57,25 @@ class CommNode {
 		 */
 		//Our sockets will deliver messages of exactly 128 bytes
 		static const int DGRAM_SIZE = 128;
+		//How long a neighbor has to accept our connection
+		static const int CONNECT_TIMEOUT_MS = 5000;
+		//How often the I/O thread checks for shutdown and connect timeouts
+		static const int IO_POLL_MS = 100;
+		//Socket events handled per epoll_wait
+		static const int MAX_EVENTS = 64;
+		//Heartbeats are handled in order per sender, on one of this many strands
+		static const int DISCOVERY_STRANDS = 16;
+		//Heartbeats a passive neighbor may miss before we forget it
+		static const int MEMBER_TIMEOUT_BEATS = 6;
+		//Unsent bytes the kernel may hold per neighbor socket. The rest of a
+		//backlog waits in our send queues, where pings and control can pass it.
+		static const int UNSENT_LIMIT = 16384;
 		//This string will signal nodes that a TCP conversation is over
 		static const char* NO_RESPONSE;
+		//Queued in place of a ping; the send time is added as it is written
+		static const char* PING;
+		//Starts an answer to a ping, which gets its send time the same way
+		static const char* PONG;
 
 		//These functions let us use member functions as 
 		//POSIX thread callbacks
@@ -47,17 +86,6 @@ class CommNode {
 		static void* handleTCP(void* p) {
 			return static_cast<CommNode*>(p)->handleTCP();
 		}
-	
-		static void* newNeighborHandler(void *arg) {
-			return static_cast<CommNode*>(arg)->newNeighborHandler();
-		}
-
-		static void* incomingMessageHandler(void *arg) {
-			std::pair<int, CommNode*> *params = 
-				static_cast<std::pair<int, CommNode*>*>(arg);
-
-			return params->second->incomingMessageHandler(params->first);
-		}
 
 		static void* runMetrics(void *arg) {
 			return static_cast<CommNode*>(arg)->runMetrics();
@@ -65,27 +93,125 @@ class CommNode {
 
 		/**
 		 * CONSTRUCTOR & DESTRUCTOR
+		 * A node given a host shares its threads and discovery socket, see 
+		 * NodeHost.h. The host does its upkeep, so update() isn't called on it.
 		 */
-		CommNode(boost::uuids::uuid id, int port);
+		CommNode(const NodeId& id, const NodeConfig& config, 
+			NodeHost* host = NULL);
 	
-		~CommNode() {
-			delete neighbors;
-			delete localNeighbors;
-		};
+		~CommNode();
 	
 		/**
 		 * CONTROL FUNCTIONS
 		 */
 		void start(); //start transmitting and listening 
 		void stop(); //stop transmitting and listening
-		void update(); //send heartbeat and perform maintenance
+		void update(); //ping neighbors and perform maintenance
+
+		/**
+		 * Warm restart support. The snapshot is saved on every update() and on
+		 * stop(). Known neighbors are dialed right away instead of waiting for
+		 * their next heartbeat.
+		 */
+		void setSnapshot(NeighborSnapshot* s) { snapshot = s; };
+		void dialKnownNeighbors(const std::vector<SnapshotRecord>& snap);
+
+		/**
+		 * Hot upgrade support. handOff() stops all threads without closing any
+		 * sockets and sends them, with the neighbor table, over a Unix socket. It
+		 * returns true once the new process acknowledges, in which case this 
+		 * process should exit without calling stop(). On failure the threads 
+		 * are restarted and false is returned. resume() is called instead of 
+		 * start() in the new process. Hosted nodes can't be handed off.
+		 */
+		bool handOff(int sock);
+		void resume(const HandoffState& state, const std::vector<int>& fds);
+
+		/**
+		 * Streams a file to a neighbor over a bulk transfer connection, leaving 
+		 * the control connection free. Returns the transfer id, or 0 if the 
+		 * neighbor is unknown or hasn't told us its bulk port yet.
+		 */
+		uint64_t sendFile(const NodeId& neighborId, const std::string& path,
+			const std::string& name = "", 
+			BulkTransfer::DoneCallback done = nullptr);
+
+		/**
+		 * Application messages. A message is a topic (one word) and a text 
+		 * payload, which together must fit in one frame. They are written to 
+		 * neighbors we have a link to, so to reach every member set maxDegree 
+		 * to 0. Handlers run on a worker thread, in order for the messages of 
+		 * one neighbor, and must not block for long. Nodes in the same host 
+		 * always reach each other, in memory.
+		 */
+		typedef std::function<void(const NodeId& from, 
+			const std::string& payload)> MessageHandler;
+		//Called as neighbors join the table and after they are forgotten
+		typedef std::function<void(const NodeId& id, bool joined)> 
+			MembershipHandler;
+		//Longest topic plus payload that fits in a frame
+		static const int MAX_MESSAGE = DGRAM_SIZE - 6;
+
+		bool send(const NodeId& to, const std::string& topic, 
+			const std::string& payload);
+		int publish(const std::string& topic, const std::string& payload);
+		/**
+		 * Frames are written by workers, so send() and publish() never wait for
+		 * a socket and a neighbor whose bulk queue is full refuses messages.
+		 * A caller that would rather slow down checks here first whether the
+		 * neighbor to (or for a nil id, every neighbor we have a link to) has
+		 * room for another message.
+		 */
+		bool hasRoom(const NodeId& to);
+		void subscribe(const std::string& topic, MessageHandler handler);
+		void unsubscribe(const std::string& topic);
+		void setMembershipHandler(MembershipHandler handler);
+		std::vector<NodeId> getMembers(bool linkedOnly = false);
+
+		/**
+		 * The links of the whole cluster, as their nodes measured them. Each
+		 * node gossips its row of the matrix to its neighbors every 
+		 * heartbeatInterval (see LatencyMatrix.h), so it trails the status 
+		 * files by a few intervals. Values are rounded to within about 12%.
+		 */
+		struct LinkMetrics {
+			NodeId from;
+			NodeId to;
+			double latencyMs;
+			double bandwidthKbps;
+		};
+		std::vector<LinkMetrics> getLatencyMatrix();
 		
 		/**
 		 * Accessor functions
 		 */
-		boost::uuids::uuid getUUID() { return uuid; };
+		NodeId getUUID() { return uuid; };
 		bool isRunning() { return running; };
+		bool isHosted() { return host != NULL; };
+		std::string getGaugeLabel() { return gaugeLabel; };
+		int getBulkPort() { return bulk.getPort(); };
 	private:
+		//Benchmarks drive the parsers and queues directly
+		friend class CommNodeBench;
+		friend class CaptureReplay;
+		//Runs the I/O of hosted nodes and hands them datagrams and messages
+		friend class NodeHost;
+
+		/**
+		 * A neighbor socket as seen by the I/O thread, which owns these. Frames
+		 * are collected here and handed to the connection's strand, so one 
+		 * connection's messages are handled in order while different 
+		 * connections are handled in parallel.
+		 */
+		struct Connection {
+			int fd;
+			bool connecting;							//Waiting to send our handshake
+			std::chrono::steady_clock::time_point deadline;	//For connecting
+			char frame[DGRAM_SIZE + 1];
+			int have;											//Bytes of frame read so far
+			std::shared_ptr<WorkerPool::Strand> strand;
+		};
+
 		/**
 		 * Private functions
 		 */
@@ -95,53 +221,152 @@ class CommNode {
 	  void startBroadcastListener();
 		void startTCPListener();
 		void* handleBroadcast(void);
+		bool handleDatagram(char* dgram, int len, const sockaddr_in& origin);
+		void postHeartbeat(const char* dgram, int len, const sockaddr_in& origin);
 		void* handleTCP(void);
-		void* newNeighborHandler(void);
-		void* incomingMessageHandler(int i);
-		void forwardToLocalNeighbors(char* msg, unsigned long int sz, 
-			std::string id = "");
-		void sendHeartbeat();
-		void addNeighborAsync(std::string id, std::string ip, int port, 
-			int fd = -1);
+		void startIO();
+		void pollIO(int timeoutMs);
+		void stopIO();
+		void addConnection(int fd, bool handshake);
+		void registerConnections();
+		void acceptConnections();
+		void finishConnect(Connection* c);
+		void readConnection(Connection* c);
+		void closeConnection(Connection* c);
+		void expireConnects();
+		void handleFrame(int fd, const std::string& frame, int64_t received);
+		void wakeIO();
+		void quiesce();
+		void restartThreads();
+		void forwardToLocalNeighbors(char* msg, const NodeId& id = NodeId());
+		void heartbeatIfDue();
+		void sendHeartbeat(int64_t gap);
+		void addNeighborAsync(const NodeId& id, std::string ip, int port, 
+			int fd = -1, int bulkPort = 0, int64_t heartbeatGap = 0);
+		static int64_t parseHeartbeatGap(const std::vector<std::string>& fields);
 		void connectToNeighbor(NeighborInfo* n);
+		void adoptConnection(NeighborInfo* n, int fd);
+		void disconnectNeighbor(int fd);
+		int countConnected();
+		void rebalance();
+		void expireNeighbors();
+		void saveSnapshot(bool sync);
 		void printNeighbors();
+		void gossipMatrix();
 		void* runMetrics();
-		std::string createTCPResponse(int sockFD, char* buf, unsigned long int sz);
+		std::string createTCPResponse(int sockFD, char* buf, 
+			int64_t received = 0);
 		void addToPollsAsync(int sock, short int flags);
-		void modifyXferQueueAsync(int fd, std::string msg);
+		void post(WorkerPool::Strand& strand, WorkerPool::Task task);
+		void submit(WorkerPool::Task task);
+		void runTask(const WorkerPool::Task& task);
+		void waitForTasks();
+		bool queueFrame(int fd, const char* frame);
+		bool queueFrame(int fd, const std::string& msg);
+		void writeQueued(int fd);
+		int takePartialFrame(int fd, char* frame);
+		bool writeFrame(int fd, const char* frame);
+		bool writeFrame(int fd, const std::string& msg);
+		void handleHeartbeat(const char* dgram, const sockaddr_in& origin);
+		static bool formatMessage(const std::string& topic, 
+			const std::string& payload, char* frame);
+		void deliverMessage(int fd, const std::string& topic, 
+			const std::string& payload);
+		void deliverMessage(const NodeId& from, const std::string& topic, 
+			const std::string& payload);
+		void deliverHosted(const NodeId& from, const std::string& topic,
+			const std::string& payload);
+		void notifyMembership(const NodeId& id, bool joined);
+		static uint64_t duplicateKey(const char* dgram, size_t len);
 		
 		/**
 		 * Private variables
 		 */
-		std::mutex xferMutex;
-		std::mutex fdMutex;
-		std::mutex mapMutex;
-		boost::uuids::uuid uuid;
-		bool running;		
+		InstrumentedMutex xferMutex;
+		InstrumentedMutex mapMutex;
+		NodeId uuid;
+		std::string uuidStr;					//Text form of uuid, for messages and file names
+		std::atomic<bool> running;
+		NodeHost* host;								//NULL unless we share a process, see NodeHost.h
+		std::string gaugeLabel;				//Tells our gauges apart from other hosted nodes'
+		std::unique_ptr<WorkerPool> ownPool;	//Unless the host lends us one
+		WorkerPool& pool;							//Runs message and heartbeat handling
+		std::vector<std::shared_ptr<WorkerPool::Strand>> discoveryStrands;
+		//Messages from nodes in the same host, in order per sender
+		std::vector<std::shared_ptr<WorkerPool::Strand>> hostedStrands;
+		//Our tasks on the pool, which a hosted node shares with the others, so
+		//stop() can wait for ours alone (see waitForTasks)
+		std::atomic<int> pendingTasks;				//Posted and not finished
+		std::atomic<int> activeTasks;					//Running now
+		std::atomic<bool> skipTasks;					//Stopped from one of our own
+		bool waitingForTasks;									//Guarded by taskMutex
+		std::mutex taskMutex;
+		std::condition_variable tasksDone;
+		static thread_local CommNode* currentNode;	//Whose task this thread runs
+		int epollFD;									//Neighbor sockets and the TCP listener
+		int wakeFD;										//eventfd that interrupts epoll_wait
+		std::map<int, Connection*> connections;	//Only touched by the I/O thread
+		std::mutex connMutex;
+		//Sockets waiting for the I/O thread to pick them up, and whether they
+		//need a handshake
+		std::vector<std::pair<int, bool>> newConnections;
 		int udpPortNumber;
 		int tcpPortNumber;
+		int preferredTcpPort;					//Port to try first, e.g. from a snapshot
+		int preferredBulkPort;
+		BulkTransfer bulk;						//Listener and threads for file transfers
 		char udpDgram[512];
 		int udpListenerFD;						//This socket is for listening to broadcasts
 		int udpBroadcastFD;						//This socket is for writing broadcasts
 		int tcpListenerFD;
-		sockaddr_in broadcastAddr;
+		std::unique_ptr<InterfaceManager> ownInterfaces;
+		InterfaceManager& interfaces;	//Local addresses and broadcast domains
 		std::string broadcastStr;
 		std::string listenerStr;
-		unsigned int broadcastLen;
 		unsigned int listenerLen;
 		unsigned int tcpLen;
 		std::vector<pollfd> fds;
+		NeighborSnapshot* snapshot = NULL;
 		pthread_t udpThread;
 		pthread_t tcpThread;
-		std::map<int,std::string> transferQueue; //Holds messages waiting to be sent
+		//Frames waiting to be written, by socket. Guarded by xferMutex.
+		std::map<int, SendQueue> sendQueues;
+		bool markDscp;								//Mark each traffic class with its DSCP
+		//Frames a stopped I/O thread had partly read, for the next one
+		std::map<int,std::string> partialFrames;
 		bool isListening;							//We are listening for UDP broadcasts
 		unsigned short tcpPort; 			//This is assigned when the TCP listener is 
 																	//initialized
 	
+		//Holds the records both maps refer to
+		NeighborPool neighborPool;
 		//This map contains all nodes that can be reached on the LAN
-		std::map<std::string, NeighborInfo*> *neighbors;
+		NeighborMap *neighbors;
 		//This map contains only nodes that exist on the same IP address as the
 		//current node
-		std::map<std::string, NeighborInfo*> *localNeighbors;
+		NeighborMap *localNeighbors;
+
+		Topology topology;						//Picks the neighbors we stay connected to
+		int64_t memberTimeout;				//Nanoseconds, see MEMBER_TIMEOUT_BEATS
+
+		//Only touched by the broadcast listener
+		DuplicateFilter duplicates;		//Datagrams seen recently
+		RateLimiter ingestLimit;			//Datagrams handled per source
+		RateLimiter relayLimit;				//Datagrams relayed per source
+		uint64_t heartbeatSeq;				//Lets receivers drop copies of a heartbeat
+
+		HeartbeatScheduler heartbeats;	//When the I/O thread sends the next one
+
+		bool shareMatrix;							//Gossip link metrics with our neighbors
+		std::mutex matrixMutex;
+		LatencyMatrix matrix;					//Cluster-wide latencies, guarded by matrixMutex
+		unsigned long interfaceGeneration;	//Of our addresses, when last checked
+
+		std::string statusDir;				//Where printNeighbors() writes, if set
+		std::mutex handlerMutex;
+		std::map<std::string, MessageHandler> subscriptions;
+		MembershipHandler membershipHandler;
+		//Keeps membership events in the order they happened
+		std::shared_ptr<WorkerPool::Strand> eventStrand;
 };
 #endif
@@ -0,0 +1,83 @@
+#ifndef COMMNODECLIENT_H
+#define COMMNODECLIENT_H
+
+#include "NodeId.h"
+#include "ClientRing.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Sends and receives messages through a commNode daemon running on this
+ * host. Requests go over the daemon's client socket (see LocalServer.h),
+ * messages over a pair of rings in memory shared with the daemon, so they
+ * never pass through the kernel.
+ *
+ *   CommNodeClient client;
+ *   client.connect(installDir + "/sockets/" + nodeId + ".sock");
+ *   client.subscribe("orders");
+ *   client.publish("orders", "created 42");
+ *   CommNodeClient::Message m;
+ *   while (client.receive(m))
+ *     ...
+ *
+ * Any thread may send; one thread at a time may receive. The daemon drops
+ * clients when it is upgraded, so connect again if a request fails.
+ */
+class CommNodeClient {
+	public:
+		struct Message {
+			NodeId from;
+			std::string topic;
+			std::string payload;
+		};
+
+		CommNodeClient();
+		~CommNodeClient();
+
+		/**
+		 * Connects to the daemon's client socket and maps the rings
+		 */
+		bool connect(const std::string& path);
+		void close();
+		bool isConnected() { return shared != NULL; };
+
+		/**
+		 * Requests, answered by the daemon. They fail if the connection has
+		 * gone.
+		 */
+		bool getNodeId(NodeId& id);
+		bool getMembers(std::vector<NodeId>& members, bool linkedOnly = false);
+		bool subscribe(const std::string& topic);
+		bool unsubscribe(const std::string& topic);
+
+		/**
+		 * Puts a message on the ring for the daemon to write to one neighbor,
+		 * or to every neighbor it has a link to. Returns false if the message
+		 * is too long or the ring is full.
+		 */
+		bool send(const NodeId& to, const std::string& topic,
+			const std::string& payload);
+		bool publish(const std::string& topic, const std::string& payload) {
+			return send(NodeId(), topic, payload);
+		};
+
+		/**
+		 * Takes the next message on a subscribed topic, waiting up to timeoutMs
+		 * for one (-1 waits for ever). Returns false if none came.
+		 */
+		bool receive(Message& m, int timeoutMs = -1);
+
+	private:
+		bool request(const std::string& req, std::string& reply,
+			std::vector<int>* fds = NULL);
+
+		int fd;
+		ClientShared* shared;
+		int toNodeBell;
+		int fromNodeBell;
+		std::mutex requestMutex;
+		std::mutex sendMutex;
+};
+
+#endif
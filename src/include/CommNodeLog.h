@@ -4,6 +4,7 @@
 #include <string>
 #include <fstream>
 #include <mutex>
+#include "Metrics.h"
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/posix_time/posix_time_io.hpp>
 #include <boost/filesystem.hpp>
@@ -39,13 +40,12 @@ class CommNodeLog {
 
 			boost::filesystem::path dir(newFile);
 
-			//If the file exists, just append to it
-			if (boost::filesystem::exists(newFile)) {
-				fileStream.open(newFile, std::ofstream::out | std::ofstream::app);
-			} else {
+			//If the file exists, just append to it. New files are opened for 
+			//append too, since a hot upgrade has two processes writing here.
+			if (!boost::filesystem::exists(newFile)) {
 				boost::filesystem::create_directories(dir.parent_path());
-				fileStream.open(newFile);
 			}
+			fileStream.open(newFile, std::ofstream::out | std::ofstream::app);
 		}
 
 		void close() {
@@ -61,11 +61,11 @@ class CommNodeLog {
 			time_facet* facet = new time_facet("%H-%M-%S");
 			newFileStream.imbue(locale(newFileStream.getloc(), facet));
 
-			newFileStream << logPath.stem() << "_" << 
-				second_clock::local_time() << endl;
+			newFileStream << logPath.stem().string() << "_" << 
+				second_clock::local_time() << logPath.extension().string();
 			boost::filesystem::path logArchive(logPath.parent_path().string() + 
-				"archive/" + newFileStream.str());
-			boost::filesystem::create_directories(logArchive);
+				"/archive/" + newFileStream.str());
+			boost::filesystem::create_directories(logArchive.parent_path());
 			boost::filesystem::rename(logPath, logArchive);
 		}
 
@@ -97,11 +97,11 @@ class CommNodeLog {
 		}
 
 	private:
-		std::mutex writeMutex;
+		InstrumentedMutex writeMutex;
 		static CommNodeLog* instance;
 		ofstream fileStream;
 		string logFilePath = "";
-		explicit CommNodeLog() {
+		explicit CommNodeLog() : writeMutex(Histogram::LogMutexWait) {
 		}
 
 		/**
@@ -112,14 +112,11 @@ class CommNodeLog {
 		 * @param msg The message the user wants to display in the log
 		 */
 		void writeMessage(severities sev, string msg) {
-			std::lock_guard<std::mutex> lock(writeMutex);
+			std::lock_guard<InstrumentedMutex> lock(writeMutex);
 			if (!fileStream.is_open()) {
-				if (logFilePath.length() == 0) {
-					cout << "Log file path not set. Call init() before trying " 
-							 << "to write to the log.";
-				} else {
+				//A program linking the library may not want a log at all
+				if (logFilePath.length() != 0)
 					cout << "Unable to open log file at path: " << logFilePath;
-				}
 				return;
 			}
 
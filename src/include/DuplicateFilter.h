@@ -0,0 +1,44 @@
+#ifndef DUPLICATEFILTER_H
+#define DUPLICATEFILTER_H
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Remembers the 64-bit keys it has seen for between half a window and a 
+ * window, so a datagram that comes around again (on a second interface, or
+ * through a loop) can be dropped. Keys go into one of two fixed size
+ * tables: new ones into the current table, which replaces the older one
+ * every half window.
+ * A table that fills up is rotated early, so a flood of distinct keys 
+ * shortens the window instead of growing memory or lookup cost.
+ *
+ * Not thread safe; the broadcast listener is its only user.
+ */
+class DuplicateFilter {
+	public:
+		//Keys each table holds before it is rotated early
+		static const int CAPACITY = 4096;
+
+		/**
+		 * @param windowNanos how long a key is remembered for, at most
+		 */
+		DuplicateFilter(int64_t windowNanos);
+
+		/**
+		 * Records key and returns true if it was already seen within the window
+		 */
+		bool check(uint64_t key, int64_t now);
+
+	private:
+		bool contains(const std::vector<uint64_t>& table, uint64_t key) const;
+		void rotate(int64_t now);
+
+		std::vector<uint64_t> current;
+		std::vector<uint64_t> previous;
+		int count = 0;								//Keys in current
+		int64_t halfWindow;
+		int64_t rotated = 0;					//When current was started
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef HEARTBEATSCHEDULER_H
+#define HEARTBEATSCHEDULER_H
+
+#include <atomic>
+#include <random>
+#include <stdint.h>
+
+/**
+ * Decides when the next heartbeat goes out. The interval starts at the
+ * minimum and doubles with every heartbeat, up to the maximum, while
+ * membership is stable. A join, a leave or an address change drops it back
+ * to the minimum, so the news spreads quickly and then the chatter dies
+ * down again (the Trickle timer of RFC 6206, without its suppression).
+ *
+ * Every member of the cluster heartbeats, so on top of that the interval is
+ * never shorter than members / budget seconds. However large the cluster
+ * and however much churn there is, the broadcast domain carries at most
+ * about budget heartbeats per second. Intervals get up to JITTER either
+ * way, so nodes that saw the same join don't all answer at once.
+ *
+ * noteChurn() may be called from any thread; the rest is only used by the
+ * I/O thread.
+ */
+class HeartbeatScheduler {
+	public:
+		static constexpr double JITTER = 0.1;
+
+		/**
+		 * @param minNanos interval right after churn
+		 * @param maxNanos interval once membership has been stable a while
+		 * @param budget heartbeats per second for the whole broadcast domain,
+		 * 0 for no cap
+		 */
+		HeartbeatScheduler(int64_t minNanos, int64_t maxNanos, double budget);
+
+		/**
+		 * Speeds heartbeats up, starting with the next check
+		 */
+		void noteChurn() { churned = true; };
+
+		/**
+		 * Whether a heartbeat should be sent now. members is how many nodes
+		 * share the budget, us included.
+		 */
+		bool due(int64_t now, int members);
+
+		/**
+		 * Records that a heartbeat went out, schedules the next one and returns
+		 * how long until then. Receivers expect the next heartbeat within this.
+		 */
+		int64_t sent(int64_t now, int members);
+
+		/**
+		 * The interval the budget allows for members nodes
+		 */
+		int64_t budgetInterval(int members) const;
+
+		int64_t getInterval() const { return scheduled; };
+
+	private:
+		std::atomic<bool> churned;
+		int64_t minInterval;
+		int64_t maxInterval;
+		double budget;
+		int64_t interval;							//Before the budget and jitter
+		int64_t last;									//When the last heartbeat went out
+		int64_t next;									//When the next one is due
+		std::atomic<int64_t> scheduled;	//From the last heartbeat to the next
+		std::mt19937 rng;
+};
+
+#endif
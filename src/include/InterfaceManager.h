@@ -0,0 +1,88 @@
+#ifndef INTERFACEMANAGER_H
+#define INTERFACEMANAGER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <unordered_set>
+#include <mutex>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/**
+ * A single IPv4 address assigned to a local interface
+ */
+struct InterfaceAddr {
+	std::string name;							//Interface name, e.g. eth0
+	int index;										//Kernel interface index
+	in_addr_t addr;								//Local address (network byte order)
+	in_addr_t broadcast;					//Broadcast address, 0 if there isn't one
+};
+
+/**
+ * Keeps an in-memory view of the local IPv4 addresses and broadcast domains.
+ * The view is loaded with an RTM_GETADDR dump and then kept current by
+ * listening for rtnetlink address events, so address changes (e.g. a new
+ * DHCP lease) are picked up without polling getifaddrs.
+ */
+class InterfaceManager {
+	public:
+		static void* handleNetlink(void* p) {
+			return static_cast<InterfaceManager*>(p)->handleNetlink();
+		}
+
+		/**
+		 * @param wanted Interfaces heartbeats should go out on. Empty means all
+		 * non-loopback interfaces.
+		 */
+		explicit InterfaceManager(std::vector<std::string> wanted);
+		~InterfaceManager();
+
+		void start();
+		void stop();
+
+		/**
+		 * Returns true if the address belongs to any interface on this host.
+		 * This is a hash lookup on the current snapshot and never blocks on
+		 * the netlink thread.
+		 */
+		bool isLocal(in_addr_t addr);
+
+		/**
+		 * Returns every configured interface address with a usable broadcast
+		 * address. Heartbeats are sent to each of these.
+		 */
+		std::vector<InterfaceAddr> getBroadcastDomains();
+
+		/**
+		 * Incremented every time the address set changes
+		 */
+		unsigned long getGeneration() { return generation; };
+
+	private:
+		struct Snapshot {
+			std::vector<InterfaceAddr> addrs;
+			std::unordered_set<in_addr_t> local;
+		};
+
+		void* handleNetlink(void);
+		void requestDump();
+		void processMessages(char* buf, int len);
+		void publish();
+		bool isWanted(const std::string& name);
+
+		std::vector<std::string> wantedNames;
+		std::vector<InterfaceAddr> current;		//Only touched by the netlink thread
+		std::vector<InterfaceAddr> previous;	//The last complete table, while dumping
+		std::shared_ptr<const Snapshot> snapshot;
+		std::atomic<unsigned long> generation;
+		std::atomic<bool> running;
+		int netlinkFD;
+		unsigned int dumpSeq;
+		bool dumping;									//A dump reply is partially applied
+		bool dumpFailed;							//The kernel answered the dump with an error
+		pthread_t netlinkThread;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef LATENCYMATRIX_H
+#define LATENCYMATRIX_H
+
+#include "NodeId.h"
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * The latency and bandwidth from every node to each neighbor it has a link
+ * to, for the whole cluster. Each node owns one row, its measured links,
+ * and gossips changes to it over its links. Rows learned from neighbors
+ * are passed on the same way, so every node ends up with every row.
+ *
+ * Only changes travel. A row has a version, bumped whenever one of its
+ * entries changes, and for each link we remember the version of each row
+ * we last sent, so the next round sends only the entries that changed
+ * since. A new link gets whole rows. Values are quantized to one of 63
+ * steps of 25% before they are compared and sent, so jitter within a step
+ * sends nothing, and the deltas of many rows are batched into each frame:
+ *
+ *   lat <row>:<base>:<version>:<entries> <row>:<base>:<version>:<entries> ..
+ *
+ * Rows and entries are named by an 8 character key derived from the node
+ * id, versions are in base 36 and each entry is the neighbor's key followed
+ * by one character each for latency and bandwidth. A delta from base applies
+ * to a copy of the row at base or newer, and a base of 0 replaces the row.
+ * A delta split across frames carries base = version after the first.
+ * Entries for links that went away are sent with a latency of 0.
+ *
+ * Versions start from the clock, so a restarted node's rows replace its
+ * old ones.
+ *
+ * Not thread safe; CommNode guards its matrix with matrixMutex.
+ */
+class LatencyMatrix {
+	public:
+		static const int FRAME_SIZE = 128;
+		static const int KEY_CHARS = 8;
+		static const int ENTRY_CHARS = KEY_CHARS + 2;
+		//Ratio between quantization steps
+		static constexpr double STEP = 1.25;
+		//Values of the lowest step, in microseconds and kbps
+		static constexpr double MIN_LATENCY_US = 1;
+		static constexpr double MIN_BANDWIDTH_KBPS = 0.1;
+
+		/**
+		 * A link as one of our neighbors measured it
+		 */
+		struct Sample {
+			uint64_t to;
+			int64_t roundTrip;						//Nanoseconds
+			float bandwidth;							//kbps
+		};
+
+		/**
+		 * A link in the matrix, at the middle of its quantization step
+		 */
+		struct Cell {
+			uint64_t from;
+			uint64_t to;
+			double latencyMs;
+			double bandwidthKbps;
+		};
+
+		explicit LatencyMatrix(const NodeId& self);
+
+		/**
+		 * 48 bits of id, the way rows and entries are named
+		 */
+		static uint64_t key(const NodeId& id);
+
+		/**
+		 * Replaces our own row with the links we measure now. Returns true if
+		 * that changed any quantized entry, which bumps the row's version.
+		 */
+		bool setLocal(const std::vector<Sample>& samples, int64_t now);
+
+		/**
+		 * Applies a "lat" frame from a neighbor. Returns false if it is
+		 * malformed; the segments before the bad one are kept.
+		 */
+		bool apply(const char* frame);
+
+		/**
+		 * The frames that bring the neighbor on link up to date, zero padded.
+		 * Afterwards they count as sent.
+		 */
+		std::vector<std::string> deltasFor(int link);
+
+		/**
+		 * The link closed or a frame to it was lost. If it comes back it gets
+		 * whole rows.
+		 */
+		void dropLink(int link);
+
+		/**
+		 * Drops what we know of a node we no longer hear from
+		 */
+		void forget(uint64_t node);
+
+		bool get(uint64_t from, uint64_t to, Cell& cell) const;
+		std::vector<Cell> getCells() const;
+
+		size_t getRows() const { return rows.size(); };
+		size_t getEntries() const;
+
+	private:
+		struct Entry {
+			uint8_t latency;							//Step, 0 if the link went away
+			uint8_t bandwidth;
+			uint64_t changed;							//Row version it changed at, or later
+		};
+
+		struct Row {
+			uint64_t version = 0;
+			std::unordered_map<uint64_t, Entry> entries;
+		};
+
+		static void appendKey(std::string& out, uint64_t key);
+		static bool parseKey(const char* in, uint64_t& key);
+		static int level(double value, double min, int current);
+		static double dequantize(int level, double min);
+
+		uint64_t self;
+		std::unordered_map<uint64_t, Row> rows;
+		//Version of each row last sent on each link
+		std::map<int, std::unordered_map<uint64_t, uint64_t>> sent;
+};
+
+#endif
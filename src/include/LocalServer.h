@@ -0,0 +1,95 @@
+#ifndef LOCALSERVER_H
+#define LOCALSERVER_H
+
+#include "CommNode.h"
+#include "ClientRing.h"
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <pthread.h>
+
+/**
+ * Lets programs on this host send and receive through a running node (see
+ * CommNodeClient.h for their side).
+ *
+ * Clients connect to a Unix domain SOCK_SEQPACKET socket, where each packet
+ * is one request and gets one reply:
+ *
+ *   attach                 "ok", with a shared memory region and its two
+ *                          doorbells passed as SCM_RIGHTS (see ClientRing.h)
+ *   id                     "ok <node id>"
+ *   members, links         "ok <id> <id> ..."; links are members we're
+ *                          connected to
+ *   subscribe <topic>      "ok"; messages on topic are put on the client's
+ *   unsubscribe <topic>    ring from then on
+ *
+ * Anything else is answered with "error <reason>". Messages are sent by
+ * putting them on the client's ring, which one thread drains for every
+ * client. A message whose neighbor has no room for it waits on the ring,
+ * holding up that client alone.
+ */
+class LocalServer {
+	public:
+		static void* handleClients(void* p) {
+			return static_cast<LocalServer*>(p)->handleClients();
+		}
+
+		/**
+		 * Topics clients subscribe to are subscribed to on node, replacing any
+		 * other handler for them.
+		 */
+		LocalServer(CommNode& node, const std::string& path);
+		~LocalServer();
+
+		bool start();
+		void stop();
+
+		std::string getPath() { return path; };
+		int getClients();
+		//Messages taken off client rings
+		uint64_t getReceived() { return received; };
+
+	private:
+		struct Client {
+			int fd;												//Control socket
+			ClientShared* shared = NULL;
+			int toNodeBell = -1;					//Rung by the client
+			int fromNodeBell = -1;				//Rung by us
+			std::set<std::string> topics;
+			//When the message at the front of its ring found no room
+			int64_t stalledSince = 0;
+		};
+
+		void* handleClients(void);
+		void acceptClient();
+		bool handleRequest(Client* c);
+		std::string attach(Client* c, int* fds);
+		void drain(Client* c);
+		void dropClient(Client* c);
+		void subscribe(Client* c, const std::string& topic);
+		void unsubscribe(Client* c, const std::string& topic);
+		void deliver(const std::string& topic, const NodeId& from,
+			const std::string& payload);
+
+		CommNode& node;
+		std::string path;
+		int listenerFD;
+		int epollFD;
+		int wakeFD;
+		std::atomic<bool> running;
+		pthread_t thread;
+
+		//Changed by our thread, read by workers delivering messages
+		std::mutex clientMutex;
+		std::map<int, std::shared_ptr<Client>> clients;	//By control socket
+		std::map<int, Client*> doorbells;	//By the doorbell the client rings
+		std::map<std::string, int> subscribers;
+		std::atomic<uint64_t> received;
+		//Doorbells of clients whose next message waits for room
+		std::set<int> stalled;
+};
+
+#endif
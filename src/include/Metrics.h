@@ -0,0 +1,176 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <stdint.h>
+
+/**
+ * Counters kept by every thread. Add new entries above COUNT and give them a
+ * name in Metrics.cpp.
+ */
+enum class Counter {
+	DatagramsReceived,
+	DatagramsRelayed,
+	HeartbeatsSent,
+	ParseFailures,
+	MessagesReceived,
+	MessagesSent,
+	BytesRead,
+	BytesWritten,
+	NeighborsAdded,
+	NeighborsRemoved,
+	BulkBytesSent,
+	BulkBytesReceived,
+	BulkChunksRejected,
+	BulkTransfersCompleted,
+	BulkTransfersFailed,
+	TasksExecuted,
+	TasksStolen,
+	LinksDropped,
+	DatagramsDuplicate,
+	DatagramsRateLimited,
+	RelaysRateLimited,
+	AppMessagesSent,
+	AppMessagesDelivered,
+	ClientMessagesDropped,
+	SendQueueFull,
+	MessagesHandedOff,
+	MatrixFramesSent,
+	COUNT
+};
+
+/**
+ * Latency histograms, recorded in nanoseconds
+ */
+enum class Histogram {
+	MapMutexWait,
+	XferMutexWait,
+	LogMutexWait,
+	RoundTrip,
+	DelayOut,
+	DelayIn,
+	//Time frames spent in a send queue, in TrafficClass order
+	SendQueueControl,
+	SendQueueLatency,
+	SendQueueBulk,
+	COUNT
+};
+
+/**
+ * Low overhead process-wide metrics. Every thread updates its own
+ * cache-line aligned shard with plain relaxed stores, so the hot path never
+ * takes a lock or bounces a cache line between cores. Readers add up all
+ * shards when a dump is requested. Shards of threads that exit are folded
+ * into a running total and reused by the next thread.
+ */
+class Metrics {
+	public:
+		//Histogram buckets are powers of two: bucket i holds values <= 2^i ns,
+		//and above the last one values are only counted in +Inf
+		static const int NUM_BUCKETS = 40;
+
+		static inline void increment(Counter c, uint64_t n = 1) {
+			std::atomic<uint64_t>& v =
+				localShard()->counters[static_cast<int>(c)];
+			v.store(v.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+		}
+
+		static inline void record(Histogram h, uint64_t ns) {
+			Shard::Hist& hist = localShard()->histograms[static_cast<int>(h)];
+			int bucket = ns <= 1 ? 0 : 64 - __builtin_clzll(ns - 1);
+			if (bucket > NUM_BUCKETS)
+				bucket = NUM_BUCKETS;
+
+			hist.buckets[bucket].store(
+				hist.buckets[bucket].load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+			hist.sum.store(hist.sum.load(std::memory_order_relaxed) + ns,
+				std::memory_order_relaxed);
+		}
+
+		/**
+		 * Registers a value that is sampled at read time, e.g. a queue depth.
+		 * Gauges of the same name from several nodes in one process are told
+		 * apart by their label, e.g. node="<uuid>".
+		 */
+		static void registerGauge(const std::string& name,
+			const std::string& help, std::function<double()> fn,
+			const std::string& label = "");
+		static void unregisterGauge(const std::string& name,
+			const std::string& label = "");
+
+		static uint64_t getCounter(Counter c);
+
+		/**
+		 * Formats every metric in the Prometheus text exposition format
+		 */
+		static std::string renderPrometheus();
+
+	private:
+		struct alignas(64) Shard {
+			std::atomic<uint64_t> counters[static_cast<int>(Counter::COUNT)];
+			struct Hist {
+				std::atomic<uint64_t> buckets[NUM_BUCKETS + 1];	//The last is +Inf
+				std::atomic<uint64_t> sum;
+			} histograms[static_cast<int>(Histogram::COUNT)];
+		};
+
+		//Returns this thread's shard to the pool when the thread exits
+		struct ShardOwner {
+			Shard* shard = NULL;
+			~ShardOwner();
+		};
+
+		static inline Shard* localShard() {
+			static thread_local ShardOwner owner;
+			if (owner.shard == NULL)
+				owner.shard = acquireShard();
+			return owner.shard;
+		}
+
+		struct Gauge;
+		struct Registry;
+		static Registry& registry();
+
+		static Shard* acquireShard();
+		static void releaseShard(Shard* s);
+		static void addShard(Shard& total, Shard& s);
+};
+
+/**
+ * A std::mutex that records how long callers waited for it. The uncontended
+ * path is a single try_lock; the clock is only read when we have to block.
+ * Usable anywhere a std::mutex is, e.g. with std::lock_guard.
+ */
+class InstrumentedMutex {
+	public:
+		explicit InstrumentedMutex(Histogram h) : hist(h) {}
+
+		void lock() {
+			if (m.try_lock()) {
+				Metrics::record(hist, 0);
+				return;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			m.lock();
+			auto waited = std::chrono::steady_clock::now() - start;
+			Metrics::record(hist, std::chrono::duration_cast<
+				std::chrono::nanoseconds>(waited).count());
+		}
+
+		bool try_lock() { return m.try_lock(); }
+		void unlock() { m.unlock(); }
+
+	private:
+		std::mutex m;
+		Histogram hist;
+};
+
+#endif
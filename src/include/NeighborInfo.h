@@ -1,17 +1,42 @@
 #ifndef NEIGHBORINFO_H
 #define NEIGHBORINFO_H
 
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include "NodeId.h"
+#include "ClockSync.h"
+#include <string>
+#include <unordered_map>
+#include <atomic>
+#include <stdint.h>
 
 class NeighborInfo {
 	public:
-		std::string uuid;							//Unique ID
+		NodeId uuid;									//Unique ID
 		std::string ip;								//Neighbor's IP Address in string format
 		unsigned short port;					//Neighbor's TCP port number
-		int socketFD = -1;						//TCP socket file descriptor
-		long latency;									//latency in milliseconds
-		float bandwidth;								//potential bandwidth in kbps
+		unsigned short bulkPort = 0;	//Port for bulk transfers, 0 if unknown
+		//TCP socket, -1 for a passive member. Relaying reads it without the 
+		//map lock.
+		std::atomic<int> socketFD{-1};
+		bool outbound = false;				//We opened the connection
+		long latency = 0;							//latency in milliseconds
+		float bandwidth = 0;						//potential bandwidth in kbps
+		int64_t roundTrip = -1;				//Nanoseconds, -1 if never measured
+		int64_t lastSeen = 0;					//When we last heard of it
+		int64_t heartbeatGap = 0;			//Nanoseconds until its next heartbeat, as
+																	//it announced. 0 for older nodes.
+		ClockSync clock;							//Offset of its clock, and one-way delays
 };
 
+/**
+ * Refers to a NeighborInfo held by a NeighborPool
+ */
+struct NeighborHandle {
+	uint32_t index = UINT32_MAX;
+	uint32_t generation = 0;
+
+	bool isNull() const { return index == UINT32_MAX; };
+};
+
+typedef std::unordered_map<NodeId, NeighborHandle> NeighborMap;
+
 #endif
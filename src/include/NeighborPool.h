@@ -0,0 +1,107 @@
+#ifndef NEIGHBORPOOL_H
+#define NEIGHBORPOOL_H
+
+#include "NeighborInfo.h"
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Holds every NeighborInfo of a node in slabs of SLAB_SIZE records, and 
+ * hands out NeighborHandles to them instead of pointers.
+ *
+ * A handle carries the generation of its slot. Releasing a record bumps the
+ * generation, so get() on an old handle returns NULL rather than someone
+ * else's record. The slot itself is only reused, and an empty slab only 
+ * freed, once every reader that might still hold a pointer into it is done:
+ * code that uses a record without holding the lock that guards the 
+ * neighbor maps does so inside a Guard, and released slots wait two epochs,
+ * which can only pass once the Guards from before the release are gone. 
+ * Allocation fills the lowest free slot, so after churn the high slabs 
+ * empty out and memory follows the number of live neighbors.
+ *
+ * allocate(), release() and reclaim() must be called with that lock held.
+ * get() and Guard may be used from any thread.
+ */
+class NeighborPool {
+	public:
+		static const int SLAB_SIZE = 64;
+		static const int MAX_SLABS = 4096;			//Up to 262144 neighbors
+
+		/**
+		 * Keeps records released while it is alive from being reused
+		 */
+		class Guard {
+			public:
+				explicit Guard(NeighborPool& p);
+				~Guard();
+
+			private:
+				Guard(const Guard&) = delete;
+				Guard& operator=(const Guard&) = delete;
+
+				NeighborPool& pool;
+				uint64_t epoch;
+		};
+
+		NeighborPool();
+		~NeighborPool();
+
+		/**
+		 * A new, default constructed record, or a null handle if the pool is 
+		 * full
+		 */
+		NeighborHandle allocate();
+		void release(NeighborHandle h);
+
+		/**
+		 * The record h refers to, or NULL if it has been released
+		 */
+		NeighborInfo* get(NeighborHandle h) const;
+
+		/**
+		 * Reuses the slots released long enough ago. allocate() and release()
+		 * call this; the timer calls it too so memory is returned when the
+		 * table stops changing.
+		 */
+		void reclaim();
+
+		size_t getLive() const { return live; };
+		size_t getSlabs() const { return slabs; };
+
+	private:
+		struct Slab {
+			//Constructed when allocated, destroyed when reclaimed
+			alignas(NeighborInfo) unsigned char records[SLAB_SIZE]
+				[sizeof(NeighborInfo)];
+		};
+
+		//Never freed, so generations survive their slab and a handle from 
+		//before a slab was freed can't match a record in its replacement
+		struct Directory {
+			std::atomic<uint32_t> generation[SLAB_SIZE];
+			std::atomic<Slab*> slab;
+			uint64_t freeSlots;					//Bit set for each unused slot
+			int used;										//Live and released slots
+		};
+
+		struct Released {
+			uint32_t index;
+			uint64_t epoch;
+		};
+
+		NeighborInfo* record(Slab* s, uint32_t slot) const {
+			return reinterpret_cast<NeighborInfo*>(s->records[slot]);
+		};
+
+		std::atomic<Directory*> directory[MAX_SLABS];
+		std::vector<Released> released;
+		size_t live = 0;
+		size_t slabs = 0;
+		int firstFree = 0;								//No free slots below this slab
+
+		std::atomic<uint64_t> epoch;
+		std::atomic<int> readers[2];			//Guards by the parity of their epoch
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef NEIGHBORSNAPSHOT_H
+#define NEIGHBORSNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "NodeId.h"
+
+/**
+ * The persisted form of a NeighborInfo. Addresses are kept in network byte
+ * order so they can be dialed without any formatting.
+ */
+struct SnapshotRecord {
+	unsigned char uuid[16];
+	uint32_t ip;
+	uint16_t port;
+	uint16_t bulkPort;						//0 in snapshots from older versions
+	int32_t latency;							//latency in milliseconds
+	float bandwidth;							//potential bandwidth in kbps
+};
+
+/**
+ * A small memory-mapped file holding this node's identity, its TCP port and
+ * its last known neighbors. Each running instance locks its own slot file
+ * in the snapshot directory, so several nodes can share an install
+ * directory.
+ *
+ * The file holds two banks that are written alternately. Each bank carries a
+ * sequence number and a checksum, so a crash during a save leaves the other
+ * bank intact and load() falls back to it.
+ */
+class NeighborSnapshot {
+	public:
+		//Upper bound on neighbors stored; the rest are rediscovered
+		static const unsigned int MAX_RECORDS = 1024;
+		//Upper bound on instances sharing one snapshot directory
+		static const unsigned int MAX_SLOTS = 64;
+
+		NeighborSnapshot();
+		~NeighborSnapshot();
+
+		/**
+		 * Claims the first unlocked slot file in dir and maps it. Returns false
+		 * if no slot could be opened. This runs before the log is open, so
+		 * errors are only reported through the return value.
+		 */
+		bool open(const std::string& dir);
+
+		/**
+		 * Maps a slot file that is already open and locked, e.g. one handed over
+		 * by the process we're replacing during a hot upgrade.
+		 */
+		bool adopt(int slotFD, const std::string& slotPath);
+
+		/**
+		 * Reads the newest valid bank. Returns false if there is none.
+		 */
+		bool load(NodeId& nodeId, unsigned short& tcpPort,
+			std::vector<SnapshotRecord>& out);
+
+		/**
+		 * Writes into the older bank. With sync set the pages are flushed before
+		 * returning, otherwise the kernel writes them back on its own schedule.
+		 */
+		void save(const NodeId& nodeId, unsigned short tcpPort,
+			const std::vector<SnapshotRecord>& records, bool sync = false);
+
+		bool isOpen() { return map != NULL; };
+		int getFD() { return fd; };
+		std::string getPath() { return path; };
+
+	private:
+		bool mapSlot();
+
+		int fd;
+		void* map;
+		size_t mapLen;
+		std::string path;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef NODE_H
+#define NODE_H
+
+#include "CommNode.h"
+#include "NodeHost.h"
+#include "NeighborSnapshot.h"
+#include "UpgradeHandoff.h"
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * The API of libcommnode, for programs that run a node in process instead
+ * of talking to a commNode daemon. Everything the daemon reads from its
+ * environment and install directory is passed in through NodeConfig.
+ *
+ *   NodeConfig config;
+ *   config.snapshotDir = "/var/lib/myservice/snapshots";
+ *   Node node(config);
+ *   node.subscribe("orders", [](const NodeId& from, const std::string& p) {
+ *     ...
+ *   });
+ *   node.start();
+ *   node.publish("orders", "created 42");
+ *
+ * A Node pings its neighbors and keeps its links up on a thread of its
+ * own, and sends heartbeats from its I/O thread on an adaptive schedule (see
+ * HeartbeatScheduler.h). Callbacks run on the node's worker threads. To
+ * run many nodes in one process, construct them with a NodeHost, which
+ * shares those threads between them (see NodeHost.h).
+ */
+class Node {
+	public:
+		typedef CommNode::MessageHandler MessageHandler;
+		typedef CommNode::MembershipHandler MembershipHandler;
+		static const int MAX_MESSAGE = CommNode::MAX_MESSAGE;
+
+		static void* runMaintenance(void* p) {
+			return static_cast<Node*>(p)->runMaintenance();
+		}
+
+		/**
+		 * With a nil id the node takes the identity saved in config.snapshotDir,
+		 * or a random one if there isn't a snapshot.
+		 */
+		explicit Node(const NodeConfig& config, const NodeId& id = NodeId());
+
+		/**
+		 * A node run by host, which must be started first. Nodes sharing a
+		 * snapshotDir each take an identity of their own from it.
+		 */
+		Node(const NodeConfig& config, NodeHost& host, 
+			const NodeId& id = NodeId());
+
+		/**
+		 * Takes over a node handed off by the process we're replacing (see
+		 * handOff()). start() resumes it rather than starting a new one.
+		 */
+		Node(const NodeConfig& config, const HandoffState& state,
+			const std::vector<int>& fds);
+
+		~Node();
+
+		/**
+		 * Opens the sockets and starts the threads. Returns false if the node
+		 * was already started.
+		 */
+		bool start();
+		/**
+		 * Waits for the node's handlers to finish. A node in a NodeHost may be
+		 * stopped from one of its own handlers, which skips the messages still
+		 * queued behind it; it must not be destroyed there.
+		 */
+		void stop();
+
+		/**
+		 * Hot upgrade support. Hands the running node to another process over
+		 * sock, which constructs its Node from what it receives. On success
+		 * this node must not be stopped, only destroyed; on failure it keeps
+		 * running.
+		 */
+		bool handOff(int sock);
+
+		/**
+		 * Messaging and membership, see CommNode
+		 */
+		bool send(const NodeId& to, const std::string& topic,
+				const std::string& payload) {
+			return node->send(to, topic, payload);
+		};
+		int publish(const std::string& topic, const std::string& payload) {
+			return node->publish(topic, payload);
+		};
+		void subscribe(const std::string& topic, MessageHandler handler) {
+			node->subscribe(topic, handler);
+		};
+		void unsubscribe(const std::string& topic) {
+			node->unsubscribe(topic);
+		};
+		void onMembership(MembershipHandler handler) {
+			node->setMembershipHandler(handler);
+		};
+		std::vector<NodeId> getMembers(bool linkedOnly = false) {
+			return node->getMembers(linkedOnly);
+		};
+		std::vector<CommNode::LinkMetrics> getLatencyMatrix() {
+			return node->getLatencyMatrix();
+		};
+		uint64_t sendFile(const NodeId& to, const std::string& path,
+				const std::string& name = "",
+				BulkTransfer::DoneCallback done = nullptr) {
+			return node->sendFile(to, path, name, done);
+		};
+
+		/**
+		 * Where the node logs to. Nothing is logged until this is called.
+		 */
+		static void setLogFile(const std::string& path);
+
+		/**
+		 * Accessor functions
+		 */
+		NodeId getId() { return id; };
+		bool isRunning() { return node->isRunning(); };
+		bool isWarmStart() { return warmStart; };
+		std::string getSnapshotPath() { return snapshot.getPath(); };
+		CommNode& getCommNode() { return *node; };
+
+	private:
+		void load();
+		void* runMaintenance(void);
+		void startMaintenance();
+		void stopMaintenance();
+
+		NodeConfig config;
+		NodeId id;
+		NodeHost* host = NULL;				//Does our upkeep instead of our own thread
+		CommNode* node;
+		NeighborSnapshot snapshot;
+		bool snapshotOpen = false;
+		bool warmStart = false;
+		std::vector<SnapshotRecord> knownNeighbors;
+
+		//Set when we were handed a running node
+		bool handedOver = false;
+		HandoffState handoffState;
+		std::vector<int> handoffFDs;
+
+		bool started = false;
+		bool maintaining = false;
+		pthread_t maintenanceThread;
+		std::mutex maintenanceMutex;
+		std::condition_variable maintenanceWake;
+};
+
+#endif
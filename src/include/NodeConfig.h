@@ -0,0 +1,55 @@
+#ifndef NODECONFIG_H
+#define NODECONFIG_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Holds the settings a CommNode is constructed with. The daemon fills this
+ * in from the [NodeProperties] section of CommNodeConfig.ini; programs that
+ * link the library fill it in themselves. Empty directories turn off what
+ * would be written there.
+ */
+struct NodeConfig {
+	int udpPort = 8000;							//Port used for discovery broadcasts
+	int heartbeatIntervalSecs = 10;	//Seconds between pings and upkeep
+
+	//Heartbeats start heartbeatMinMs apart after a join, leave or address
+	//change and back off to heartbeatMaxSecs while membership is stable.
+	//heartbeatBudget caps them per second across the broadcast domain, 0
+	//for no cap. See HeartbeatScheduler.h.
+	int heartbeatMinMs = 500;
+	int heartbeatMaxSecs = 30;
+	double heartbeatBudget = 100;
+	int tcpPort = 0;								//Preferred TCP port, 0 lets the OS pick
+	int statsPort = 9460;						//Localhost stats endpoint, 0 disables it
+	bool clientApi = true;					//Serve local clients, see LocalServer.h
+	int bulkPort = 0;								//Bulk transfer port, 0 lets the OS pick
+	std::string transferDir = "transfers";	//Where received files are written
+	std::string statusDir;					//Where the nodestatus file is written
+	std::string snapshotDir;				//Neighbor snapshots for warm restarts
+	int workerThreads = 0;					//Message handling threads, 0 for one per CPU
+
+	//CPUs to pin the worker threads to. Empty lets the scheduler decide.
+	std::vector<int> workerCpus;
+	bool tracing = false;						//Record trace events from startup
+	bool capture = false;						//Capture traffic from startup
+	int captureMaxMB = 256;					//Largest capture file
+	int maxDegree = 8;							//Neighbors we keep connections to, 0 for all
+	int randomLinks = 2;						//How many of those are picked at random
+	bool markDscp = false;					//Mark frames with a DSCP per traffic class
+	bool latencyMatrix = true;			//Share link metrics, see LatencyMatrix.h
+
+	//Datagrams per second (and burst) we accept from one address, and how
+	//many of those we relay to neighbors on this host. 0 means no limit.
+	int ingestRate = 50;
+	int ingestBurst = 100;
+	int relayRate = 10;
+	int relayBurst = 20;
+
+	//Names of the interfaces we send heartbeats on. If empty, every
+	//non-loopback IPv4 interface with a broadcast address is used.
+	std::vector<std::string> interfaces;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef NODEHOST_H
+#define NODEHOST_H
+
+#include "NodeConfig.h"
+#include "NodeId.h"
+#include "WorkerPool.h"
+#include "InterfaceManager.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+class CommNode;
+
+/**
+ * Runs many CommNodes in one process. Each keeps its own identity, TCP and
+ * bulk listeners, neighbor table and heartbeats, so on the wire it is a node
+ * like any other, but they share what a process only needs once:
+ *
+ *   - the worker pool and the view of the local interfaces
+ *   - the discovery socket. A datagram is checked and relayed once and then
+ *     handed to every hosted node, so none of them needs a relay from the
+ *     node that won the bind.
+ *   - the broadcast socket heartbeats go out on
+ *   - one event loop thread, which waits on every hosted node's sockets
+ *   - one timer thread, which does the upkeep of every hosted node
+ *
+ * Messages between nodes in the same host are handed over in memory
+ * instead of over a TCP link, and those nodes don't connect to each other.
+ *
+ *   NodeHost host(config);
+ *   host.start();
+ *   Node a(config, host), b(config, host);
+ *   a.start();
+ *   b.start();
+ *
+ * The host must be started before its nodes and stopped after them.
+ */
+class NodeHost {
+	public:
+		//These functions let us use member functions as POSIX thread callbacks
+		static void* handleEvents(void* p) {
+			return static_cast<NodeHost*>(p)->handleEvents();
+		}
+
+		static void* runTimers(void* p) {
+			return static_cast<NodeHost*>(p)->runTimers();
+		}
+
+		explicit NodeHost(const NodeConfig& config);
+		~NodeHost();
+
+		void start();
+		void stop();
+
+		/**
+		 * Called by a hosted CommNode once its sockets are open, and before it
+		 * closes them. After detach() returns neither thread calls the node.
+		 */
+		void attach(CommNode* node);
+		void detach(CommNode* node);
+
+		/**
+		 * Whether id is a node running in this host
+		 */
+		bool isHosted(const NodeId& id);
+		std::vector<NodeId> getHosted();
+
+		/**
+		 * Hands a message to a node in this host. The subscriber runs on a
+		 * worker, in order for the messages of one sender. deliver() returns
+		 * false if to isn't hosted here, deliverAll() how many nodes besides
+		 * from it was handed to.
+		 */
+		bool deliver(const NodeId& from, const NodeId& to,
+			const std::string& topic, const std::string& payload);
+		int deliverAll(const NodeId& from, const std::string& topic,
+			const std::string& payload);
+
+		/**
+		 * Accessor functions
+		 */
+		WorkerPool& getPool() { return pool; };
+		InterfaceManager& getInterfaces() { return interfaces; };
+		int getBroadcastFD() { return udpBroadcastFD; };
+		bool isListening() { return listening; };
+
+	private:
+		void initBroadcastListener();
+		void initBroadcastServer();
+		void* handleEvents(void);
+		void* runTimers(void);
+		void readDatagrams();
+		void wake();
+
+		NodeConfig config;
+		std::atomic<bool> running;
+		WorkerPool pool;
+		InterfaceManager interfaces;
+		int udpListenerFD;						//Discovery socket, if we won the bind
+		int udpBroadcastFD;						//Every node's heartbeats go out here
+		bool listening;
+		int epollFD;									//The discovery socket and each node's epoll
+		int wakeFD;										//Interrupts epoll_wait on attach and stop
+		char udpDgram[512];
+
+		//Nodes are only added and removed with all three locks held, in this
+		//order. Each thread holds its own while it calls into the nodes, so a
+		//node detached from the host is no longer used by it.
+		std::mutex timerMutex;
+		std::mutex ioMutex;
+		std::mutex nodeMutex;
+		std::vector<CommNode*> nodes;	//The first checks and relays datagrams
+		std::unordered_map<NodeId, CommNode*> byId;
+
+		pthread_t eventThread;
+		pthread_t timerThread;
+		std::mutex timerWaitMutex;
+		std::condition_variable timerWake;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef NODEID_H
+#define NODEID_H
+
+#include <string>
+#include <functional>
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/uuid/uuid.hpp>
+
+/**
+ * A node's identity: a 128-bit UUID held as two 64-bit words, so comparing,
+ * hashing and copying one costs a couple of instructions. The words are in
+ * big-endian byte order, which makes operator< agree with the order of the
+ * text form.
+ *
+ * The text form ("0f2c4a9e-5b1d-4c3e-8f6a-7d9e0b1c2a3f") is only used on the
+ * wire and in logs and status files. It is parsed and formatted 16 bytes at
+ * a time with SSE2 where available.
+ */
+class NodeId {
+	public:
+		//Length of the text form, without a terminator
+		static const size_t STRING_SIZE = 36;
+		//Length of the text form without dashes
+		static const size_t HEX_SIZE = 32;
+
+		NodeId() : hi(0), lo(0) {}
+		NodeId(uint64_t high, uint64_t low) : hi(high), lo(low) {}
+		explicit NodeId(const boost::uuids::uuid& u) { *this = fromBytes(u.data); }
+
+		/**
+		 * Converts from/to the 16 bytes of a UUID, as stored in snapshots and
+		 * handoff state
+		 */
+		static NodeId fromBytes(const unsigned char* bytes);
+		void toBytes(unsigned char* bytes) const;
+		boost::uuids::uuid toUuid() const;
+
+		/**
+		 * Parses the text form, with or without dashes, in either case. Returns
+		 * false and leaves out alone if str is anything else.
+		 */
+		static bool parse(const char* str, size_t len, NodeId& out);
+		static bool parse(const std::string& str, NodeId& out) {
+			return parse(str.data(), str.size(), out);
+		}
+
+		/**
+		 * Writes the STRING_SIZE characters of the text form to out, without a
+		 * terminator
+		 */
+		void format(char* out) const;
+		std::string toString() const;
+
+		bool isNil() const { return (hi | lo) == 0; };
+		uint64_t getHigh() const { return hi; };
+		uint64_t getLow() const { return lo; };
+
+		size_t hash() const {
+			//Most ids are random, but don't count on it: v1 UUIDs from one host
+			//differ only in a few bits
+			uint64_t h = (hi ^ (lo * 0x9E3779B97F4A7C15ULL)) * 0xC2B2AE3D27D4EB4FULL;
+			return (size_t)(h ^ (h >> 29));
+		}
+
+		bool operator==(const NodeId& o) const { return hi == o.hi && lo == o.lo; };
+		bool operator!=(const NodeId& o) const { return !(*this == o); };
+		bool operator<(const NodeId& o) const {
+			return hi < o.hi || (hi == o.hi && lo < o.lo);
+		};
+
+	private:
+		uint64_t hi;
+		uint64_t lo;
+};
+
+namespace std {
+	template<> struct hash<NodeId> {
+		size_t operator()(const NodeId& id) const { return id.hash(); }
+	};
+}
+
+#endif
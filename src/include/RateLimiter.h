@@ -0,0 +1,52 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unordered_map>
+
+/**
+ * A token bucket per source. Each source may send burst datagrams at once 
+ * and rate per second after that. Sources are usually IPv4 addresses.
+ *
+ * The table holds at most MAX_SOURCES buckets. Once it is full, buckets 
+ * that have refilled (which are no different from a missing one) are 
+ * dropped, and if that doesn't make room every new source shares one 
+ * overflow bucket. A flood from spoofed addresses then costs a fixed amount
+ * of memory and only limits itself.
+ *
+ * Not thread safe; the broadcast listener is its only user.
+ */
+class RateLimiter {
+	public:
+		static const size_t MAX_SOURCES = 1024;
+
+		/**
+		 * @param rate tokens added per second, 0 for no limit
+		 * @param burst tokens a bucket holds
+		 */
+		RateLimiter(double rate, double burst);
+
+		/**
+		 * Takes a token from source's bucket, returning false if it was empty
+		 */
+		bool allow(uint64_t source, int64_t now);
+
+	private:
+		struct Bucket {
+			double tokens;
+			int64_t last;								//When tokens was last updated
+		};
+
+		void refill(Bucket& b, int64_t now) const;
+		void prune(int64_t now);
+
+		std::unordered_map<uint64_t, Bucket> buckets;
+		Bucket overflow;
+		int64_t pruned = 0;						//At most once per second, so a full
+																	//table doesn't cost a scan per datagram
+		double rate;									//Tokens per nanosecond
+		double burst;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SENDQUEUE_H
+#define SENDQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+
+/**
+ * Frames go out in one of three classes. Control is the handshake and
+ * relayed heartbeats, Latency is pings and pongs, whose timing we measure,
+ * and Bulk is application messages and latency matrix updates.
+ */
+enum class TrafficClass {
+	Control,
+	Latency,
+	Bulk,
+	COUNT
+};
+
+/**
+ * The frames waiting to be written to one neighbor socket, a queue per
+ * traffic class. Frames are taken in strict priority order, so a ping
+ * queued behind thousands of application messages is the next frame
+ * written. Control and latency traffic is a few frames per heartbeat, so it
+ * can't starve bulk for long.
+ *
+ * Bulk is bounded; a sender that outruns the socket gets false from push()
+ * instead of growing the queue. The other classes aren't, since dropping a
+ * handshake or a pong would break the link or its measurements.
+ *
+ * Not thread safe; CommNode guards its queues with xferMutex.
+ */
+class SendQueue {
+	public:
+		static const int FRAME_SIZE = 128;
+		//Bulk frames queued per socket, 512 KB
+		static const size_t BULK_LIMIT = 4096;
+
+		struct Frame {
+			char data[FRAME_SIZE];
+			TrafficClass cls;
+			int64_t queued;							//Nanoseconds
+		};
+
+		/**
+		 * Classifies a frame by its command word
+		 */
+		static TrafficClass classify(const char* frame);
+
+		/**
+		 * Copies frame in, up to its first zero byte or FRAME_SIZE bytes, and
+		 * pads it with zeros. Returns false if its class is full. An unstamped
+		 * ping is only queued if there isn't one waiting already.
+		 */
+		bool push(const char* frame, TrafficClass cls, int64_t now);
+
+		/**
+		 * Takes the oldest frame of the most urgent class
+		 */
+		bool pop(Frame& f);
+
+		size_t depth(TrafficClass cls) const {
+			return queues[static_cast<int>(cls)].size();
+		}
+		bool empty() const;
+
+		/**
+		 * Drops every frame and returns how many there were
+		 */
+		size_t clear();
+
+		/**
+		 * The frames queued, in the order they would be written
+		 */
+		std::string pending() const;
+
+		//Set while one thread writes the queue out; others only push
+		bool writing = false;
+		//Held while connecting, so our handshake is the first frame written
+		bool held = false;
+		//The connection closed while a thread was writing; it closes the socket
+		bool closing = false;
+		int tos = 0;									//IP_TOS the socket is marked with
+
+	private:
+		bool pingQueued = false;
+		std::deque<Frame> queues[static_cast<int>(TrafficClass::COUNT)];
+};
+
+#endif
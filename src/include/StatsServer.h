@@ -0,0 +1,63 @@
+#ifndef STATSSERVER_H
+#define STATSSERVER_H
+
+#include <map>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <pthread.h>
+
+/**
+ * A tiny HTTP/1.0 server bound to 127.0.0.1. It serves the Prometheus 
+ * metrics on /metrics, plus any other paths registered with addHandler().
+ * Requests are answered one at a time on a single thread, which is plenty 
+ * for a scraper and the command line dump.
+ */
+class StatsServer {
+	public:
+		static void* handleRequests(void* p) {
+			return static_cast<StatsServer*>(p)->handleRequests();
+		}
+
+		/**
+		 * @param port Port to listen on. If it is taken, a random port is used
+		 * and reported in the log.
+		 */
+		explicit StatsServer(int port);
+		~StatsServer();
+
+		/**
+		 * @param retryMs How long to keep retrying a port that is in use before
+		 * settling for a random one, e.g. while the process we're replacing 
+		 * exits
+		 */
+		void start(int retryMs = 0);
+		void stop();
+		int getPort() { return port; };
+
+		/**
+		 * Registers the function that produces the body for a path
+		 */
+		void addHandler(const std::string& path, 
+			std::function<std::string()> fn);
+
+		/**
+		 * Fetches a path from a server on this host and returns the body, or 
+		 * an empty string on error. Used by "commNode --stats".
+		 */
+		static std::string fetch(int port, const std::string& path);
+
+	private:
+		void* handleRequests(void);
+		void respond(int fd);
+
+		int port;
+		int listenerFD;
+		std::atomic<bool> running;
+		pthread_t thread;
+		std::mutex handlerMutex;
+		std::map<std::string, std::function<std::string()>> handlers;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "NodeId.h"
+#include <vector>
+#include <set>
+#include <random>
+#include <stdint.h>
+
+/**
+ * Decides which neighbors this node keeps a connection to, so the number of
+ * sockets and pings per node stays bounded however large the cluster gets.
+ * Every other neighbor we hear from stays a passive member: we know its
+ * address, but don't talk to it.
+ *
+ * Most of the links go to the neighbors with the lowest round trip. A few
+ * go to neighbors picked at random, which keeps the overlay connected when
+ * latency alone would split it into clusters. On every rebalance one more
+ * passive neighbor is connected as a probe, so neighbors we have never
+ * measured get a chance to win a place.
+ *
+ * Links other nodes opened to us are left alone unless there are more than
+ * MAX_INBOUND_FACTOR times the degree of them, so two nodes that disagree
+ * about a link don't keep closing and reopening it.
+ */
+class Topology {
+	public:
+		//A connected neighbor is only replaced by one this much quicker
+		static constexpr double HYSTERESIS = 0.8;
+		static const int MAX_INBOUND_FACTOR = 2;
+
+		struct Peer {
+			NodeId id;
+			bool connected;
+			bool outbound;					//We opened the connection
+			bool pinned;						//Always connected and not counted, e.g.
+															//neighbors on this host
+			int64_t roundTrip;			//Nanoseconds, -1 if never measured
+		};
+
+		struct Plan {
+			std::vector<NodeId> connect;
+			std::vector<NodeId> drop;
+		};
+
+		/**
+		 * @param degree links to keep, 0 to connect to everyone
+		 * @param randomLinks how many of them go to random neighbors
+		 */
+		Topology(int degree, int randomLinks);
+
+		Plan rebalance(const std::vector<Peer>& peers);
+
+		/**
+		 * Whether a newly heard neighbor can be connected right away
+		 */
+		bool wantsMore(int connected) const {
+			return degree == 0 || connected < degree;
+		};
+		int getDegree() const { return degree; };
+
+	private:
+		int degree;
+		int randomLinks;
+		std::set<NodeId> longLinks;		//The random links picked so far
+		std::mt19937_64 rng;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Records nanosecond timestamped spans into per-thread ring buffers and
+ * exports them as Chrome trace / Perfetto JSON.
+ *
+ * Each thread only writes to its own ring, so recording is a handful of
+ * stores with no locks or shared cache lines. Every slot carries a sequence
+ * number so an export running at the same time can skip a slot that is
+ * being overwritten instead of reading a torn event. When tracing is off, a
+ * span costs one relaxed load.
+ *
+ * Timestamps come from CLOCK_REALTIME so traces from different nodes can be
+ * lined up, using the clock offsets the nodes measure to each other.
+ */
+class Tracer {
+	public:
+		//Events kept per thread. Older events are overwritten.
+		static const uint32_t RING_SIZE = 16384;
+
+		static void setEnabled(bool on) {
+			enabled().store(on, std::memory_order_relaxed);
+		}
+
+		static inline bool isEnabled() {
+			return enabled().load(std::memory_order_relaxed);
+		}
+
+		static inline uint64_t now() {
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+
+		/**
+		 * Records a span that started at start and lasted dur nanoseconds. The
+		 * name must be a string literal; only the pointer is stored.
+		 */
+		static void complete(const char* name, uint64_t start, uint64_t dur,
+			uint64_t arg = 0);
+
+		/**
+		 * Records a point in time, e.g. a datagram arriving
+		 */
+		static void instant(const char* name, uint64_t arg = 0) {
+			if (isEnabled())
+				complete(name, now(), 0, arg);
+		}
+
+		/**
+		 * Formats every buffered event as Chrome trace JSON. processName shows
+		 * up as the process label in the viewer (we use the node UUID).
+		 */
+		static std::string exportChromeJson(const std::string& processName);
+
+		/**
+		 * Writes exportChromeJson() to a file, creating its directory
+		 */
+		static bool dumpToFile(const std::string& path,
+			const std::string& processName);
+
+	private:
+		struct Ring;
+		struct Registry;
+		struct RingOwner {
+			Ring* ring = NULL;
+			~RingOwner();
+		};
+
+		static std::atomic<bool>& enabled() {
+			static std::atomic<bool> on(false);
+			return on;
+		}
+
+		static Registry& registry();
+		static Ring* localRing();
+		static Ring* acquireRing();
+		static void releaseRing(Ring* r);
+};
+
+/**
+ * Records the lifetime of a scope as a span
+ */
+class TraceSpan {
+	public:
+		explicit TraceSpan(const char* n, uint64_t a = 0) : name(n), arg(a),
+				start(Tracer::isEnabled() ? Tracer::now() : 0) {
+		}
+
+		~TraceSpan() {
+			if (start != 0 && Tracer::isEnabled())
+				Tracer::complete(name, start, Tracer::now() - start, arg);
+		}
+
+		void setArg(uint64_t a) { arg = a; };
+
+	private:
+		const char* name;
+		uint64_t arg;
+		uint64_t start;
+};
+
+#endif
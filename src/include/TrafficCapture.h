@@ -0,0 +1,124 @@
+#ifndef TRAFFICCAPTURE_H
+#define TRAFFICCAPTURE_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+/**
+ * Records every frame and datagram a node sends and receives into a binary
+ * file, so real traffic can be replayed later (see tools/CaptureReplay.cpp).
+ *
+ * The file is mapped into memory at its maximum size when a capture starts.
+ * Recording reserves space with one atomic add and copies the frame in, so
+ * the I/O thread, the broadcast listener and the workers never wait on each
+ * other or on the disk. Once the file is full, further records are counted
+ * and dropped. When capture is off, a record costs one relaxed load.
+ *
+ * Layout, integers in the byte order of the host that wrote it:
+ *
+ *   CaptureHeader                       32 bytes
+ *   CaptureRecord + payload, repeated   payload padded to 8 bytes
+ *
+ * A frame's trailing NULs are left out of its payload, which halves the 
+ * size of a typical capture; a reader pads it back to frameSize. A record 
+ * with a time of 0 marks the end, e.g. after a crash mid capture.
+ */
+struct CaptureHeader {
+	char magic[4];								//"CNCP"
+	uint16_t version;
+	uint16_t frameSize;						//TCP frames are padded to this size
+	int64_t started;							//Nanoseconds, CLOCK_REALTIME
+	unsigned char node[16];				//Id of the node that recorded it
+};
+
+struct CaptureRecord {
+	int64_t time;									//Nanoseconds, CLOCK_REALTIME
+	uint32_t conn;								//Socket for TCP, IPv4 address for UDP
+	uint8_t kind;									//A TrafficCapture::Kind
+	uint8_t reserved;
+	uint16_t length;							//Payload bytes that follow
+};
+
+static_assert(sizeof(CaptureHeader) == 32, "Capture header is 32 bytes");
+static_assert(sizeof(CaptureRecord) == 16, "Capture records are 16 bytes");
+
+class TrafficCapture {
+	public:
+		static const uint16_t VERSION = 1;
+
+		enum Kind : uint8_t {
+			TcpIn = 1,
+			TcpOut = 2,
+			UdpIn = 3,									//conn is the sender's address
+			UdpOut = 4,									//conn is the broadcast address
+			Open = 5,										//Payload is the peer's "ip:port"
+			Close = 6
+		};
+
+		/**
+		 * Starts writing to path, which may hold at most maxBytes. Fails if a
+		 * capture is already running or the file can't be created.
+		 */
+		static bool start(const std::string& path, uint64_t maxBytes,
+			const unsigned char node[16], uint16_t frameSize);
+
+		/**
+		 * Waits for records in progress, then trims the file to what was 
+		 * written. Returns the number of records dropped because it was full.
+		 */
+		static uint64_t stop();
+
+		static inline bool isEnabled() {
+			return enabled().load(std::memory_order_relaxed);
+		}
+
+		static void record(Kind kind, uint32_t conn, int64_t time, 
+				const char* data, size_t len) {
+			if (isEnabled())
+				write(kind, conn, time, data, len);
+		}
+
+		static std::string getPath();
+
+	private:
+		struct File;
+
+		static void write(Kind kind, uint32_t conn, int64_t time, 
+			const char* data, size_t len);
+
+		static std::atomic<bool>& enabled() {
+			static std::atomic<bool> on(false);
+			return on;
+		}
+		static File& file();
+};
+
+/**
+ * Reads a capture file back, record by record, from a read-only mapping
+ */
+class CaptureReader {
+	public:
+		CaptureReader();
+		~CaptureReader();
+
+		bool open(const std::string& path);
+		void close();
+
+		const CaptureHeader& getHeader() const { return *header; };
+
+		/**
+		 * Moves to the next record. payload points into the mapping and stays
+		 * valid until close().
+		 */
+		bool next(CaptureRecord& r, const char*& payload);
+		void rewind();
+
+	private:
+		const char* data;
+		size_t size;
+		size_t offset;
+		const CaptureHeader* header;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef UPGRADEHANDOFF_H
+#define UPGRADEHANDOFF_H
+
+#include "NeighborSnapshot.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Per-connection state carried across a hot upgrade. Fields ending in Index
+ * refer to a position in the file descriptor list sent alongside the state.
+ * pending holds every frame still in the connection's send queue, most
+ * urgent class first, each zero-padded to SendQueue::FRAME_SIZE bytes.
+ */
+struct HandoffNeighbor {
+	SnapshotRecord record;
+	bool local;										//Neighbor is on this host
+	bool outbound;								//We opened the connection
+	int socketIndex;							//-1 if we aren't connected to it
+	std::string pending;					//Queued frames that weren't written yet
+	std::string partial;					//Start of a frame that was partly read
+};
+
+/**
+ * Everything a freshly exec'd commNode needs to take over from the running
+ * one without closing any sockets.
+ */
+struct HandoffState {
+	unsigned char uuid[16];
+	uint16_t udpPort;
+	uint16_t tcpPort;
+	int udpListenerIndex;					//-1 if we weren't the broadcast master
+	int udpBroadcastIndex;
+	int tcpListenerIndex;
+	int snapshotIndex;						//-1 if there is no snapshot file
+	int bulkListenerIndex;				//-1 if the sender predates bulk transfers
+	std::string snapshotPath;
+	std::vector<HandoffNeighbor> neighbors;
+};
+
+/**
+ * Moves a HandoffState and its file descriptors over a connected Unix 
+ * socket. Descriptors are passed with SCM_RIGHTS so the receiving process
+ * gets its own references to the same open sockets.
+ */
+class UpgradeHandoff {
+	public:
+		//Environment variable telling a new process which fd to receive on
+		static const char* ENV_FD;
+
+		static bool send(int sock, const HandoffState& state, 
+			const std::vector<int>& fds);
+		static bool receive(int sock, HandoffState& state, std::vector<int>& fds);
+
+		/**
+		 * Sends/receives a batch of descriptors along with a small payload
+		 */
+		static bool sendFds(int sock, const int* fds, size_t count, 
+			const void* data, size_t len);
+		static bool recvFds(int sock, std::vector<int>& fds, void* data, 
+			size_t len);
+
+	private:
+		//Stay well below the kernel's SCM_MAX_FD of 253 per message
+		static const size_t FDS_PER_MESSAGE = 200;
+};
+
+#endif
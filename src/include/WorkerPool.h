@@ -0,0 +1,114 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * A fixed set of threads that run tasks handed to them by the I/O threads.
+ *
+ * Every worker has its own queue. Tasks submitted from a worker go on that
+ * worker's queue, where the data they touch is likely still in cache, and
+ * everything else is spread round robin. A worker that runs out of tasks
+ * steals the oldest one from another worker. Workers can be pinned to CPUs.
+ *
+ * Tasks that must run in order, e.g. the messages of one connection, are
+ * posted to a Strand instead of to the pool directly.
+ */
+class WorkerPool {
+	public:
+		typedef std::function<void()> Task;
+
+		/**
+		 * Runs the tasks posted to it one at a time, in order, on whichever
+		 * worker is free. Different strands run in parallel.
+		 */
+		class Strand : public std::enable_shared_from_this<Strand> {
+			public:
+				explicit Strand(WorkerPool& p) : pool(p), scheduled(false) {}
+				void post(Task t);
+
+			private:
+				//Tasks run before the strand goes to the back of the line, so one
+				//busy connection can't hold a worker forever
+				static const int BATCH = 64;
+
+				void run();
+
+				WorkerPool& pool;
+				std::mutex lock;
+				std::deque<Task> tasks;
+				bool scheduled;							//A run() is queued or running
+		};
+
+		/**
+		 * @param threads number of workers, 0 for one per CPU
+		 * @param cpus CPUs to pin workers to, in order. Empty leaves them to the
+		 * scheduler.
+		 */
+		WorkerPool(int threads, const std::vector<int>& cpus);
+		~WorkerPool();
+
+		void start();
+		/**
+		 * Runs everything already queued, then joins the workers
+		 */
+		void stop();
+		void submit(Task t);
+		/**
+		 * Waits until no task is queued or running
+		 */
+		void waitIdle();
+
+		std::shared_ptr<Strand> createStrand() {
+			return std::make_shared<Strand>(*this);
+		}
+
+		int getThreads() { return numThreads; };
+		int getQueued() { return queued; };
+
+		//This function lets us use a member function as a POSIX thread callback
+		struct WorkerArgs {
+			WorkerPool* pool;
+			int index;
+		};
+
+		static void* runWorker(void* p) {
+			WorkerArgs* args = static_cast<WorkerArgs*>(p);
+			WorkerArgs a = *args;
+			delete args;
+			return a.pool->runWorker(a.index);
+		}
+
+	private:
+		struct alignas(64) Worker {
+			std::mutex lock;
+			std::deque<Task> tasks;
+			pthread_t thread;
+		};
+
+		void* runWorker(int index);
+		bool takeTask(int index, Task& t);
+
+		int numThreads;
+		std::vector<int> cpuList;
+		std::vector<Worker*> workers;
+		std::atomic<bool> running;
+		std::atomic<int> queued;				//Submitted but not started
+		std::atomic<int> outstanding;			//Submitted but not finished
+		std::atomic<unsigned int> nextWorker;
+
+		//Idle workers sleep here
+		std::mutex sleepMutex;
+		std::condition_variable wakeup;
+		int sleepers;
+		std::condition_variable idle;
+};
+
+#endif
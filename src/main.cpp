@@ -1,30 +1,75 @@
 /**
  *  This is the main class for the CommNode program. It parses the config file 
- *  and starts the node. The application runs as a daemon/service.
+ *  and runs a Node from libcommnode, or several sharing a NodeHost. The 
+ *  application runs as a daemon/service.
  *
  *  Author: Robert Miller
  **/
 
-#include "CommNode.h"
+#include "Node.h"
 #include "CommNodeLog.h"
+#include "StatsServer.h"
+#include "LocalServer.h"
+#include "Tracer.h"
+#include "TrafficCapture.h"
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
+#include <memory>
+#include <stdio.h>
 #include <stdlib.h>
-#include <boost/uuid/uuid_io.hpp>
-#include <boost/uuid/uuid_generators.hpp>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 extern CommNodeLog* cnLog;
 boost::property_tree::ptree pt;
 
 //Global variables
-int portNumber = 8000;
-int heartbeatIntervalSecs = 10;
+NodeConfig nodeConfig;
+int hostedNodes = 1;						//Nodes this process runs, see NodeHost.h
+volatile sig_atomic_t shutdownRequested = 0;
+volatile sig_atomic_t upgradeRequested = 0;
+volatile sig_atomic_t traceDumpRequested = 0;
+
+//How long the new binary has to take over before we resume service
+const int HANDOFF_TIMEOUT_SECS = 10;
 
 void loadConfigFile();
+bool upgradeNode(Node& node, const std::string& binary, char* argv[]);
+bool startCapture(const NodeId& id);
+
+/**
+ * SIGTERM/SIGINT just flag the main loop so the node can stop cleanly and
+ * write its snapshot. SIGUSR2 asks for a hot upgrade.
+ */
+static void onShutdownSignal(int /*sig*/) {
+	shutdownRequested = 1;
+}
+
+static void onUpgradeSignal(int /*sig*/) {
+	upgradeRequested = 1;
+}
+
+/**
+ * SIGUSR1 writes the trace buffers to INSTALL_DIRECTORY/traces
+ */
+static void onTraceSignal(int /*sig*/) {
+	traceDumpRequested = 1;
+}
 
 int main(int argc, char *argv[]) {
+	//"commNode --stats [port]" prints the metrics of a node on this host
+	if (argc >= 2 && strcmp(argv[1], "--stats") == 0) {
+		int port = argc >= 3 ? atoi(argv[2]) : nodeConfig.statsPort;
+		std::string body = StatsServer::fetch(port, "/metrics");
+		if (body.empty()) {
+			std::cerr << "No stats endpoint on 127.0.0.1:" << port << endl;
+			exit(1);
+		}
+		std::cout << body;
+		exit(0);
+	}
+
 	//If the INSTALL_DIRECTORY environment variable isn't present, then the 
 	//node wasn't launched with the run script.
 	const char* installDir = getenv("INSTALL_DIRECTORY");
@@ -33,58 +78,286 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
-	pid_t pid, sid;
+	//If we were exec'd by a running node for a hot upgrade, it is already a
+	//daemon and hands us its identity and sockets instead of us creating them
+	const char* handoffEnv = getenv(UpgradeHandoff::ENV_FD);
+	int handoffFD = handoffEnv == NULL ? -1 : atoi(handoffEnv);
+	HandoffState handoffState;
+	std::vector<int> handoffFDs;
 
-	//Here's how we make our daemon
-	pid = fork();
+	if (handoffFD < 0) {
+		pid_t pid, sid;
 
-	if (pid < 0) { exit(EXIT_FAILURE); }
+		//Here's how we make our daemon
+		pid = fork();
 
-	//We have a good PID, so close the parent.
-	if (pid > 0) { exit(EXIT_SUCCESS); }
+		if (pid < 0) { exit(EXIT_FAILURE); }
 
-	umask(0);
+		//We have a good PID, so close the parent.
+		if (pid > 0) { exit(EXIT_SUCCESS); }
 
-	//Setting a new signature ID for the child process
-	sid = setsid();
-	if (sid < 0) { exit(EXIT_FAILURE); }
-	//Change working directory to somewhere guaranteed to be there
-	if ((chdir("/")) < 0) { exit(EXIT_FAILURE); }
+		umask(0);
 
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+		//Setting a new signature ID for the child process
+		sid = setsid();
+		if (sid < 0) { exit(EXIT_FAILURE); }
+		//Change working directory to somewhere guaranteed to be there
+		if ((chdir("/")) < 0) { exit(EXIT_FAILURE); }
+
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+	} else if (!UpgradeHandoff::receive(handoffFD, handoffState, handoffFDs)) {
+		//The old process notices the closed socket and keeps running
+		exit(EXIT_FAILURE);
+	}
 
-	
 	loadConfigFile();
 	
-	//Generate the node's UUID first so we can append it to the log file name
-	boost::uuids::uuid nodeId = boost::uuids::random_generator()();
+	//The node reuses the identity and neighbors from our last run if we have
+	//them. We need its id first so we can append it to the log file name.
+	//With more than one node they share a host, and the log is named for the
+	//first.
+	NodeHost* host = NULL;
+	std::vector<Node*> nodes;
+	if (handoffFD >= 0) {
+		nodes.push_back(new Node(nodeConfig, handoffState, handoffFDs));
+	} else if (hostedNodes > 1) {
+		host = new NodeHost(nodeConfig);
+		for (int i = 0; i < hostedNodes; i++)
+			nodes.push_back(new Node(nodeConfig, *host));
+	} else {
+		nodes.push_back(new Node(nodeConfig));
+	}
+	Node* node = nodes[0];
+	const NodeId nodeId = node->getId();
 
 	const std::string logFileName = pt.get<std::string>(
 		"NodeProperties.logFileName") + 
-		boost::uuids::to_string(nodeId) + ".log";
+		nodeId.toString() + ".log";
 	std::stringstream ssPath;
 	ssPath << std::string(installDir) << "/logs/" << logFileName;
-	cnLog->init(ssPath.str());
+	Node::setLogFile(ssPath.str());
 
 	cnLog->debug("Launching process with PID: " + 
 		std::to_string(::getpid()));
-	cnLog->debug("Node UUID is " + boost::uuids::to_string(nodeId));
-	cnLog->debug("Starting node with heartbeat every " + 
-		std::to_string(heartbeatIntervalSecs) + " seconds...");
+	for (auto n : nodes)
+		cnLog->debug("Node UUID is " + n->getId().toString());
+	cnLog->debug("Starting node with upkeep every " + 
+		std::to_string(nodeConfig.heartbeatIntervalSecs) + " seconds...");
+
+	signal(SIGTERM, onShutdownSignal);
+	signal(SIGINT, onShutdownSignal);
+	signal(SIGUSR2, onUpgradeSignal);
+	signal(SIGUSR1, onTraceSignal);
+	//A neighbor hanging up mid-write shows up as EPIPE instead
+	signal(SIGPIPE, SIG_IGN);
+	Tracer::setEnabled(nodeConfig.tracing);
+	if (nodeConfig.capture && !startCapture(nodeId))
+		cnLog->error("Unable to start traffic capture");
+
+	//We're now set up as a service, start the node
+	if (host != NULL)
+		host->start();
+	for (auto n : nodes)
+		n->start();
+
+	if (handoffFD >= 0) {
+		//Tell the old process it can exit
+		char ack = 'R';
+		if (write(handoffFD, &ack, 1) != 1)
+			cnLog->error("Unable to acknowledge upgrade handoff");
+		close(handoffFD);
+	}
+
+	//The old process still holds the stats port for a moment after a handoff
+	StatsServer stats(nodeConfig.statsPort);
+	const std::string nodeName = nodeId.toString();
+	stats.addHandler("/trace", [nodeName]() {
+		return Tracer::exportChromeJson(nodeName);
+	});
+	stats.addHandler("/trace/start", []() {
+		Tracer::setEnabled(true);
+		return std::string("tracing on\n");
+	});
+	stats.addHandler("/trace/stop", []() {
+		Tracer::setEnabled(false);
+		return std::string("tracing off\n");
+	});
+	stats.addHandler("/capture/start", [nodeId]() {
+		if (!startCapture(nodeId))
+			return std::string("unable to start capture\n");
+		return "capturing to " + TrafficCapture::getPath() + "\n";
+	});
+	stats.addHandler("/capture/stop", []() {
+		std::string path = TrafficCapture::getPath();
+		if (path.empty())
+			return std::string("not capturing\n");
+		uint64_t dropped = TrafficCapture::stop();
+		return "wrote " + path + ", " + std::to_string(dropped) + 
+			" records dropped\n";
+	});
+	stats.addHandler("/matrix", [node]() {
+		std::string body = "from to latency_ms bandwidth_kbps\n";
+		for (auto& l : node->getLatencyMatrix()) {
+			char values[64];
+			snprintf(values, sizeof values, " %.3f %.1f\n", l.latencyMs, 
+				l.bandwidthKbps);
+			body += l.from.toString() + " " + l.to.toString() + values;
+		}
+		return body;
+	});
+	if (nodeConfig.statsPort != 0)
+		stats.start(handoffFD >= 0 ? 1000 : 0);
+
+	//Programs on this host send and receive through each node here
+	std::vector<std::unique_ptr<LocalServer>> clients;
+	for (auto n : nodes) {
+		clients.emplace_back(new LocalServer(n->getCommNode(), 
+			std::string(installDir) + "/sockets/" + n->getId().toString() + 
+			".sock"));
+		if (nodeConfig.clientApi)
+			clients.back()->start();
+	}
 
-	//We're now set up as a service, create node object and begin
-	CommNode c(nodeId, portNumber);
-	c.start();
+	const std::string binary = std::string(installDir) + "/bin/commNode";
 
-	while(c.isRunning()) {
-		sleep(heartbeatIntervalSecs);
-		c.update();
+	//The node runs on threads of its own; we only wait for signals
+	while(node->isRunning() && !shutdownRequested) {
+		sleep(1);
+
+		if (traceDumpRequested) {
+			traceDumpRequested = 0;
+
+			std::string path = std::string(installDir) + "/traces/trace_" + 
+				nodeName + "_" + std::to_string(Tracer::now() / 1000000) + ".json";
+			if (Tracer::dumpToFile(path, nodeName))
+				cnLog->debug("Wrote trace to " + path);
+			else
+				cnLog->error("Unable to write trace to " + path);
+		}
+
+		if (upgradeRequested) {
+			upgradeRequested = 0;
+
+			//The new process owns everything now, including the log file
+			if (host != NULL) {
+				cnLog->warning("Hot upgrade needs hostedNodes = 1, ignoring");
+			} else {
+				//A client message queued now could be written by both processes
+				for (auto& it : clients)
+					it->stop();
+				if (upgradeNode(*node, binary, argv)) {
+					TrafficCapture::stop();
+					exit(EXIT_SUCCESS);
+				}
+				if (nodeConfig.clientApi) {
+					for (auto& it : clients)
+						it->start();
+				}
+			}
+		}
 	}
+
+	cnLog->debug("Shutting down");
+	stats.stop();
+	for (auto& it : clients)
+		it->stop();
+	clients.clear();
+	for (auto n : nodes) {
+		n->stop();
+		delete n;
+	}
+	if (host != NULL) {
+		host->stop();
+		delete host;
+	}
+	TrafficCapture::stop();
 	cnLog->close();
 }
 
+/**
+ * Starts capturing traffic to a new file in INSTALL_DIRECTORY/captures
+ */
+bool startCapture(const NodeId& id) {
+	std::string path = std::string(getenv("INSTALL_DIRECTORY")) + 
+		"/captures/capture_" + id.toString() + "_" + 
+		std::to_string(Tracer::now() / 1000000) + ".cncap";
+
+	unsigned char node[16];
+	id.toBytes(node);
+	if (!TrafficCapture::start(path, (uint64_t)nodeConfig.captureMaxMB << 20,
+			node, CommNode::DGRAM_SIZE))
+		return false;
+
+	cnLog->debug("Capturing traffic to " + path);
+	return true;
+}
+
+/**
+ * Starts the (possibly replaced) commNode binary and hands it our sockets 
+ * over a Unix socket pair. Returns true if the new process took over.
+ */
+bool upgradeNode(Node& node, const std::string& binary, char* argv[]) {
+	cnLog->debug("Upgrading to " + binary);
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		cnLog->error("Unable to create handoff socket");
+		return false;
+	}
+
+	//Build the child's environment now; setenv isn't safe after fork in a
+	//threaded process
+	std::string handoffVar = std::string(UpgradeHandoff::ENV_FD) + "=" + 
+		std::to_string(sv[1]);
+	std::vector<char*> envp;
+	for (char** e = environ; *e != NULL; e++) {
+		if (strncmp(*e, UpgradeHandoff::ENV_FD, 
+				strlen(UpgradeHandoff::ENV_FD)) != 0)
+			envp.push_back(*e);
+	}
+	envp.push_back(const_cast<char*>(handoffVar.c_str()));
+	envp.push_back(NULL);
+	long maxFD = sysconf(_SC_OPEN_MAX);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		cnLog->error("Unable to fork for upgrade");
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		//Only the handoff socket survives the exec. Everything the new process
+		//needs is sent through it.
+		for (long fd = 3; fd < maxFD; fd++) {
+			if (fd != sv[1])
+				close(fd);
+		}
+		execve(binary.c_str(), argv, envp.data());
+		_exit(127);
+	}
+
+	close(sv[1]);
+
+	timeval tv;
+	tv.tv_sec = HANDOFF_TIMEOUT_SECS;
+	tv.tv_usec = 0;
+	setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	bool ok = node.handOff(sv[0]);
+	close(sv[0]);
+
+	if (!ok) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	return ok;
+}
+
 /**
  * This function reads and parses an ini file to get configuration options. 
  */
@@ -95,6 +368,78 @@ void loadConfigFile() {
 		pt);
 
 	//Convert properties from std::strings to numbers
-	const std::string heartbeatIntervalString = pt.get<std::string>(
-		"NodeProperties.heartbeatInterval");
+	nodeConfig.heartbeatIntervalSecs = pt.get<int>(
+		"NodeProperties.heartbeatInterval", nodeConfig.heartbeatIntervalSecs);
+	nodeConfig.heartbeatMinMs = pt.get<int>("NodeProperties.heartbeatMinMs",
+		nodeConfig.heartbeatMinMs);
+	nodeConfig.heartbeatMaxSecs = pt.get<int>("NodeProperties.heartbeatMaxSecs",
+		nodeConfig.heartbeatMaxSecs);
+	nodeConfig.heartbeatBudget = pt.get<double>(
+		"NodeProperties.heartbeatBudget", nodeConfig.heartbeatBudget);
+
+	hostedNodes = pt.get<int>("NodeProperties.hostedNodes", hostedNodes);
+	nodeConfig.statsPort = pt.get<int>("NodeProperties.statsPort",
+		nodeConfig.statsPort);
+	nodeConfig.clientApi = pt.get<bool>("NodeProperties.clientApi",
+		nodeConfig.clientApi);
+	nodeConfig.tracing = pt.get<bool>("NodeProperties.tracing", 
+		nodeConfig.tracing);
+	nodeConfig.capture = pt.get<bool>("NodeProperties.capture", 
+		nodeConfig.capture);
+	nodeConfig.captureMaxMB = pt.get<int>("NodeProperties.captureMaxMB", 
+		nodeConfig.captureMaxMB);
+	nodeConfig.markDscp = pt.get<bool>("NodeProperties.markDscp", 
+		nodeConfig.markDscp);
+	nodeConfig.latencyMatrix = pt.get<bool>("NodeProperties.latencyMatrix", 
+		nodeConfig.latencyMatrix);
+
+	nodeConfig.bulkPort = pt.get<int>("NodeProperties.bulkPort", 
+		nodeConfig.bulkPort);
+	nodeConfig.transferDir = pt.get<std::string>("NodeProperties.transferDir",
+		"");
+	if (nodeConfig.transferDir.empty()) {
+		nodeConfig.transferDir = std::string(getenv("INSTALL_DIRECTORY")) + 
+			"/transfers";
+	}
+	nodeConfig.statusDir = getenv("INSTALL_DIRECTORY");
+	nodeConfig.snapshotDir = std::string(getenv("INSTALL_DIRECTORY")) + 
+		"/snapshots";
+
+	nodeConfig.workerThreads = pt.get<int>("NodeProperties.workerThreads",
+		nodeConfig.workerThreads);
+
+	nodeConfig.maxDegree = pt.get<int>("NodeProperties.maxDegree",
+		nodeConfig.maxDegree);
+	nodeConfig.randomLinks = pt.get<int>("NodeProperties.randomLinks",
+		nodeConfig.randomLinks);
+
+	nodeConfig.ingestRate = pt.get<int>("NodeProperties.ingestRate",
+		nodeConfig.ingestRate);
+	nodeConfig.ingestBurst = pt.get<int>("NodeProperties.ingestBurst",
+		nodeConfig.ingestBurst);
+	nodeConfig.relayRate = pt.get<int>("NodeProperties.relayRate",
+		nodeConfig.relayRate);
+	nodeConfig.relayBurst = pt.get<int>("NodeProperties.relayBurst",
+		nodeConfig.relayBurst);
+
+	//Worker CPUs are a comma separated list, e.g. "2,3"
+	const std::string cpuString = pt.get<std::string>(
+		"NodeProperties.workerCpus", "");
+	if (!cpuString.empty()) {
+		std::vector<std::string> cpus;
+		boost::split(cpus, cpuString, boost::is_any_of(", "), 
+			boost::token_compress_on);
+		for (auto& it : cpus) {
+			if (!it.empty())
+				nodeConfig.workerCpus.push_back(atoi(it.c_str()));
+		}
+	}
+
+	//Interfaces are a comma separated list, e.g. "eth0,eth1"
+	const std::string interfaceString = pt.get<std::string>(
+		"NodeProperties.interfaces", "");
+	if (!interfaceString.empty()) {
+		boost::split(nodeConfig.interfaces, interfaceString, 
+			boost::is_any_of(", "), boost::token_compress_on);
+	}
 }
@@ -0,0 +1,345 @@
+/**
+ *  Replays a traffic capture (see TrafficCapture.h) so real load can be
+ *  rerun as a benchmark.
+ *
+ *  By default the inbound frames and datagrams are fed straight to the
+ *  parsing and dispatch code of a CommNode that isn't running, and the time
+ *  each one takes is reported per message type. With --target they are sent
+ *  to a running node instead, one TCP connection per captured connection.
+ *
+ *  commNodeReplay [--speed N] [--loops N] [--target host:tcpPort]
+ *                 [--udp-port P] [--dump] capture.cncap
+ *
+ *    --speed N   1 keeps the recorded pace, 2 is twice as fast, 0 (the
+ *                default) is as fast as possible
+ *    --loops N   replay the capture N times
+ *    --target    send to a running node rather than in-process
+ *    --udp-port  where the target listens for discovery datagrams (8000)
+ *    --dump      print the records instead of replaying them
+ **/
+
+#include "CommNode.h"
+#include "CommNodeLog.h"
+#include "TrafficCapture.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <string.h>
+#include <netinet/tcp.h>
+
+extern CommNodeLog* cnLog;
+
+//Captured connections are fed to the node as these made up sockets, so they
+//can't collide with the ones this process has open
+static const int FIRST_FAKE_FD = 100000;
+
+struct ReplayOptions {
+	double speed = 0;
+	int loops = 1;
+	std::string target;
+	int udpPort = 8000;
+	bool dump = false;
+	std::string path;
+};
+
+/**
+ * Handling times of one message type, in nanoseconds
+ */
+struct Timings {
+	std::vector<int64_t> samples;
+
+	void report(const std::string& name) {
+		if (samples.empty())
+			return;
+		std::sort(samples.begin(), samples.end());
+		auto at = [this](double q) {
+			return samples[std::min(samples.size() - 1,
+				(size_t)(q * samples.size()))] / 1000.0;
+		};
+		std::cout << "  " << name << ": " << samples.size() << " messages, " <<
+			"p50 " << at(0.5) << "us, p99 " << at(0.99) << "us, max " <<
+			samples.back() / 1000.0 << "us" << std::endl;
+	}
+};
+
+static const char* kindName(uint8_t kind) {
+	switch (kind) {
+		case TrafficCapture::TcpIn: return "tcp-in";
+		case TrafficCapture::TcpOut: return "tcp-out";
+		case TrafficCapture::UdpIn: return "udp-in";
+		case TrafficCapture::UdpOut: return "udp-out";
+		case TrafficCapture::Open: return "open";
+		case TrafficCapture::Close: return "close";
+	}
+	return "unknown";
+}
+
+/**
+ * The first word of a frame, e.g. "ping"
+ */
+static std::string messageType(const char* payload, size_t len) {
+	const char* end = (const char*)memchr(payload, ' ', len);
+	return std::string(payload, end == NULL ? len : end - payload);
+}
+
+/**
+ * Sleeps until the record at recorded (relative to the first one) is due
+ */
+static void pace(const ReplayOptions& opts, int64_t recorded,
+		std::chrono::steady_clock::time_point start) {
+	if (opts.speed <= 0)
+		return;
+	std::this_thread::sleep_until(start +
+		std::chrono::nanoseconds((int64_t)(recorded / opts.speed)));
+}
+
+/**
+ * Drives the private parsing and dispatch entry points of a CommNode
+ */
+class CaptureReplay {
+	public:
+		static int replayInProcess(CaptureReader& reader,
+				const ReplayOptions& opts) {
+			NodeConfig config;
+			CommNode node(NodeId::fromBytes(reader.getHeader().node), config);
+			int frameSize = reader.getHeader().frameSize;
+			std::vector<char> frame(frameSize + 1);
+
+			std::map<std::string, Timings> timings;
+			uint64_t count = 0;
+			auto start = std::chrono::steady_clock::now();
+
+			for (int loop = 0; loop < opts.loops; loop++) {
+				reader.rewind();
+				auto loopStart = std::chrono::steady_clock::now();
+				int64_t first = 0;
+
+				CaptureRecord r;
+				const char* payload;
+				while (reader.next(r, payload)) {
+					if (first == 0)
+						first = r.time;
+					pace(opts, r.time - first, loopStart);
+
+					int64_t began = ClockSync::now();
+					if (r.kind == TrafficCapture::TcpIn) {
+						std::fill(frame.begin(), frame.end(), 0);
+						memcpy(frame.data(), payload, std::min((int)r.length, frameSize));
+						node.createTCPResponse(FIRST_FAKE_FD + r.conn, frame.data(),
+							r.time);
+					} else if (r.kind == TrafficCapture::UdpIn) {
+						std::fill(frame.begin(), frame.end(), 0);
+						memcpy(frame.data(), payload, std::min((int)r.length, frameSize));
+						sockaddr_in origin;
+						memset(&origin, 0, sizeof origin);
+						origin.sin_family = AF_INET;
+						origin.sin_addr.s_addr = r.conn;
+						node.handleHeartbeat(frame.data(), origin);
+					} else if (r.kind == TrafficCapture::Close) {
+						node.disconnectNeighbor(FIRST_FAKE_FD + r.conn);
+						continue;
+					} else {
+						continue;
+					}
+
+					std::string type = (r.kind == TrafficCapture::UdpIn ? "udp " :
+						"tcp ") + messageType(payload, r.length);
+					timings[type].samples.push_back(ClockSync::now() - began);
+					count++;
+				}
+			}
+
+			double secs = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+			std::cout << "Replayed " << count << " messages in " << secs <<
+				"s (" << (uint64_t)(count / std::max(secs, 1e-9)) << "/s)" <<
+				std::endl;
+			for (auto& it : timings)
+				it.second.report(it.first);
+
+			//Nothing was connected, but the records still belong to the pool
+			std::lock_guard<InstrumentedMutex> lock(node.mapMutex);
+			for (auto& it : *node.neighbors)
+				node.neighborPool.release(it.second);
+			node.neighbors->clear();
+			node.localNeighbors->clear();
+			return 0;
+		}
+};
+
+/**
+ * Sends the inbound traffic of a capture to a running node
+ */
+static int replayToTarget(CaptureReader& reader, const ReplayOptions& opts) {
+	std::string host = opts.target.substr(0, opts.target.find(':'));
+	int tcpPort = opts.target.find(':') == std::string::npos ? 0 :
+		atoi(opts.target.substr(opts.target.find(':') + 1).c_str());
+
+	sockaddr_in tcpAddr, udpAddr;
+	memset(&tcpAddr, 0, sizeof tcpAddr);
+	tcpAddr.sin_family = AF_INET;
+	tcpAddr.sin_port = htons(tcpPort);
+	if (inet_pton(AF_INET, host.c_str(), &tcpAddr.sin_addr) != 1) {
+		std::cerr << "Target must be an IPv4 address and port" << std::endl;
+		return 1;
+	}
+	udpAddr = tcpAddr;
+	udpAddr.sin_port = htons(opts.udpPort);
+
+	int udpFD = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	int frameSize = reader.getHeader().frameSize;
+	std::vector<char> frame(frameSize);
+	std::vector<char> discard(65536);
+
+	//One connection per captured one, opened on its first frame
+	std::map<uint32_t, int> sockets;
+	auto connectionFor = [&](uint32_t conn) {
+		auto it = sockets.find(conn);
+		if (it != sockets.end())
+			return it->second;
+
+		int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		int noDelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+		if (connect(fd, (sockaddr*)&tcpAddr, sizeof tcpAddr) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		sockets[conn] = fd;
+		return fd;
+	};
+
+	uint64_t sent = 0, failed = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int loop = 0; loop < opts.loops; loop++) {
+		reader.rewind();
+		auto loopStart = std::chrono::steady_clock::now();
+		int64_t first = 0;
+
+		CaptureRecord r;
+		const char* payload;
+		while (reader.next(r, payload)) {
+			if (first == 0)
+				first = r.time;
+
+			bool ok = false;
+			if (r.kind == TrafficCapture::TcpIn || r.kind == TrafficCapture::UdpIn) {
+				pace(opts, r.time - first, loopStart);
+				std::fill(frame.begin(), frame.end(), 0);
+				memcpy(frame.data(), payload, std::min((int)r.length, frameSize));
+			}
+
+			if (r.kind == TrafficCapture::TcpIn) {
+				int fd = connectionFor(r.conn);
+				ok = fd >= 0 && send(fd, frame.data(), frameSize, MSG_NOSIGNAL) ==
+					frameSize;
+				//Answers aren't checked, but must not fill the socket buffers
+				while (fd >= 0 && recv(fd, discard.data(), discard.size(),
+						MSG_DONTWAIT) > 0);
+			} else if (r.kind == TrafficCapture::UdpIn) {
+				ok = sendto(udpFD, frame.data(), frameSize, 0, (sockaddr*)&udpAddr,
+					sizeof udpAddr) == frameSize;
+			} else if (r.kind == TrafficCapture::Close) {
+				auto it = sockets.find(r.conn);
+				if (it != sockets.end()) {
+					if (it->second >= 0)
+						close(it->second);
+					sockets.erase(it);
+				}
+				continue;
+			} else {
+				continue;
+			}
+
+			if (ok)
+				sent++;
+			else
+				failed++;
+		}
+	}
+
+	double secs = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	std::cout << "Sent " << sent << " messages to " << opts.target << " in " <<
+		secs << "s (" << (uint64_t)(sent / std::max(secs, 1e-9)) << "/s), " <<
+		failed << " failed" << std::endl;
+
+	for (auto& it : sockets) {
+		if (it.second >= 0)
+			close(it.second);
+	}
+	close(udpFD);
+	return 0;
+}
+
+static int dump(CaptureReader& reader) {
+	const CaptureHeader& h = reader.getHeader();
+	std::cout << "Node " << NodeId::fromBytes(h.node).toString() <<
+		", frame size " << h.frameSize << std::endl;
+
+	CaptureRecord r;
+	const char* payload;
+	while (reader.next(r, payload)) {
+		std::string conn = std::to_string(r.conn);
+		if (r.kind == TrafficCapture::UdpIn || r.kind == TrafficCapture::UdpOut) {
+			char ip[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &r.conn, ip, INET_ADDRSTRLEN);
+			conn = ip;
+		}
+		std::cout << (r.time - h.started) / 1000 << "us " << kindName(r.kind) <<
+			" " << conn << " " << std::string(payload, r.length) << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	ReplayOptions opts;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--speed" && hasValue)
+			opts.speed = atof(argv[++i]);
+		else if (arg == "--loops" && hasValue)
+			opts.loops = std::max(1, atoi(argv[++i]));
+		else if (arg == "--target" && hasValue)
+			opts.target = argv[++i];
+		else if (arg == "--udp-port" && hasValue)
+			opts.udpPort = atoi(argv[++i]);
+		else if (arg == "--dump")
+			opts.dump = true;
+		else if (arg[0] != '-' && opts.path.empty())
+			opts.path = arg;
+		else
+			opts.path.clear(), i = argc;
+	}
+
+	if (opts.path.empty()) {
+		std::cerr << "Usage: " << argv[0] << " [--speed N] [--loops N] " <<
+			"[--target host:tcpPort] [--udp-port P] [--dump] capture.cncap" <<
+			std::endl;
+		return 1;
+	}
+
+	CaptureReader reader;
+	if (!reader.open(opts.path)) {
+		std::cerr << "Unable to read capture " << opts.path << std::endl;
+		return 1;
+	}
+
+	if (opts.dump)
+		return dump(reader);
+	if (!opts.target.empty())
+		return replayToTarget(reader, opts);
+
+	//The node logs as it handles messages; keep that out of the way
+	boost::filesystem::path logDir = boost::filesystem::temp_directory_path() /
+		boost::filesystem::unique_path("commnode-replay-%%%%%%%%");
+	cnLog->init((logDir / "replay.log").string());
+
+	int ret = CaptureReplay::replayInProcess(reader, opts);
+
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(logDir, ec);
+	return ret;
+}